@@ -0,0 +1,217 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CAsyncLog.h"
+#include "CMetrics.h"
+
+#include <cstdint>
+
+std::unique_ptr<CAsyncLog::Record[]> CAsyncLog::records_;
+size_t CAsyncLog::mask_ = 0;
+std::atomic<size_t> CAsyncLog::enqueuePos_(0);
+std::atomic<size_t> CAsyncLog::dequeuePos_(0);
+std::atomic<size_t> CAsyncLog::dropped_(0);
+std::atomic<bool> CAsyncLog::running_(false);
+boost::thread CAsyncLog::thread_;
+google::base::Logger *CAsyncLog::originals_[google::NUM_SEVERITIES] = {};
+CAsyncLog::Logger *CAsyncLog::proxies_[google::NUM_SEVERITIES] = {};
+std::mutex CAsyncLog::cs_;
+std::condition_variable CAsyncLog::wakeCv_;
+std::condition_variable CAsyncLog::drainedCv_;
+
+void CAsyncLog::Install(size_t capacity) {
+    if(running_)
+        return;
+
+    size_t size = MIN_CAPACITY;
+    while(size < capacity)
+        size <<= 1;
+
+    records_.reset(new Record[size]);
+    mask_ = size - 1;
+
+    // memory for usual message is allocated once
+    for(size_t i = 0; i < size; ++i){
+        records_[i].sequence = i;
+        records_[i].message.reserve(RECORD_RESERVE);
+    }
+
+    enqueuePos_ = 0;
+    dequeuePos_ = 0;
+    dropped_ = 0;
+    running_ = true;
+    thread_ = boost::thread(&CAsyncLog::run);
+
+    // FATAL logger stays synchronous: glog aborts right after FATAL message
+    for(int severity = google::GLOG_INFO; severity < google::GLOG_FATAL; ++severity){
+        originals_[severity] = google::base::GetLogger(severity);
+        proxies_[severity] = new Logger(originals_[severity]);
+        google::base::SetLogger(severity, proxies_[severity]);
+    }
+
+    LOG(INFO) << "Asynchronous logging is enabled, buffer of " << size << " messages";
+}
+
+void CAsyncLog::Shutdown() {
+    if( ! running_ )
+        return;
+
+    // messages, logged after this, are written directly. glog doesn't delete replaced logger, so proxies are deleted below.
+    // glog writes message and SetLogger replaces logger under the same lock, so proxy isn't used after SetLogger
+    for(int severity = google::GLOG_INFO; severity < google::GLOG_FATAL; ++severity)
+        google::base::SetLogger(severity, originals_[severity]);
+
+    // thread writes the rest of buffer before exit
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        running_ = false;
+    }
+    wakeCv_.notify_one();
+    drainedCv_.notify_all();
+    thread_.join();
+
+    for(int severity = google::GLOG_INFO; severity < google::GLOG_FATAL; ++severity){
+        delete proxies_[severity];
+        proxies_[severity] = nullptr;
+    }
+}
+
+bool CAsyncLog::isInstalled() {
+    return running_;
+}
+
+CAsyncLog::Logger::Logger(google::base::Logger *target)
+        : target_(target)
+{}
+
+void CAsyncLog::Logger::Write(bool force_flush, time_t timestamp, const char *message, int message_len) {
+    // FATAL message is the last one, so everything must be on disk before abort
+    if(message_len > 0 && message[0] == 'F'){
+        waitDrained();
+        target_->Write(true, timestamp, message, message_len);
+        return;
+    }
+
+    if( ! push(target_, force_flush, timestamp, message, message_len) ){
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        CMetrics::add(CMetrics::LOG_MESSAGES_DROPPED);
+    }
+}
+
+void CAsyncLog::Logger::Flush() {
+    waitDrained();
+    target_->Flush();
+}
+
+google::uint32 CAsyncLog::Logger::LogSize() {
+    return target_->LogSize();
+}
+
+bool CAsyncLog::push(google::base::Logger *target, bool flush, time_t timestamp, const char *message, int len) {
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+
+    for(;;){
+        Record &record = records_[pos & mask_];
+        const size_t sequence = record.sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+        if(diff == 0){
+            // slot is free, try to take it
+            if(enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }else if(diff < 0){
+            // slot isn't written by drain thread yet: buffer is full
+            return false;
+        }else{
+            // other thread took slot
+            pos = enqueuePos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    Record &record = records_[pos & mask_];
+    record.target = target;
+    record.flush = flush;
+    record.timestamp = timestamp;
+    record.message.assign(message, static_cast<size_t>(len));
+
+    record.sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+size_t CAsyncLog::drain() {
+    size_t count = 0;
+
+    for(;;){
+        const size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        Record &record = records_[pos & mask_];
+
+        if(record.sequence.load(std::memory_order_acquire) != pos + 1)
+            break;
+
+        record.target->Write(record.flush, record.timestamp, record.message.data(), static_cast<int>(record.message.size()));
+
+        // don't keep memory of rare long messages (e.g. with big statements)
+        if(record.message.capacity() > 4 * RECORD_RESERVE){
+            string().swap(record.message);
+            record.message.reserve(RECORD_RESERVE);
+        }
+
+        record.sequence.store(pos + mask_ + 1, std::memory_order_release);
+        dequeuePos_.store(pos + 1, std::memory_order_release);
+        ++count;
+    }
+
+    return count;
+}
+
+void CAsyncLog::waitDrained() {
+    const size_t pos = enqueuePos_.load(std::memory_order_acquire);
+
+    std::unique_lock<std::mutex> lock(cs_);
+    // drain thread mustn't sleep for DRAIN_INTERVAL
+    wakeCv_.notify_one();
+    drainedCv_.wait_for(lock, std::chrono::milliseconds(static_cast<long>(FLUSH_TIMEOUT)), [pos]{
+        return ! running_ || dequeuePos_.load(std::memory_order_acquire) >= pos;
+    });
+}
+
+void CAsyncLog::reportDropped(size_t dropped) {
+    const time_t timestamp = std::time(nullptr);
+    struct tm time{};
+#ifdef WIN32
+    localtime_s(&time, &timestamp);
+#else
+    localtime_r(&timestamp, &time);
+#endif
+
+    // prefix like glog's one: severity, date and time
+    char prefix[32] = {};
+    std::strftime(prefix, sizeof(prefix), "W%m%d %H:%M:%S", &time);
+
+    const string message = string(prefix) + " CAsyncLog.cpp] Asynchronous log: " + std::to_string(dropped)
+                           + " messages were dropped, buffer is full\n";
+
+    for(int severity = google::GLOG_WARNING; severity >= google::GLOG_INFO; --severity)
+        originals_[severity]->Write(false, timestamp, message.data(), static_cast<int>(message.size()));
+}
+
+void CAsyncLog::run() {
+    while(running_){
+        if(drain() == 0){
+            std::unique_lock<std::mutex> lock(cs_);
+            if(running_)
+                wakeCv_.wait_for(lock, std::chrono::milliseconds(static_cast<long>(DRAIN_INTERVAL)));
+        }else{
+            // dequeuePos_ is changed before lock, so waiter either sees it or is notified
+            std::lock_guard<std::mutex> lock(cs_);
+            drainedCv_.notify_all();
+        }
+
+        const size_t dropped = dropped_.exchange(0);
+        if(dropped > 0)
+            reportDropped(dropped);
+    }
+
+    drain();
+}
@@ -0,0 +1,99 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CASYNCLOG_H
+#define CS_MINISQLITESERVER_CASYNCLOG_H
+#pragma once
+
+#include "glog/logging.h"
+
+#include <boost/thread.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+
+using std::string;
+
+/*Asynchronous sink for log files of glog.
+  glog formats message on calling thread and passes it to file logger of each severity.
+  Install() replaces these loggers: message is copied into lock-free ring buffer and
+  background thread writes it to original logger (file). So slow disk doesn't delay io threads.
+  If buffer is full, message is dropped and counted (see CMetrics::LOG_MESSAGES_DROPPED).
+  FATAL messages are written synchronously after buffer is drained.
+  Doesn't affect logging to stderr (FLAGS_logtostderr)*/
+class CAsyncLog {
+public:
+    CAsyncLog() = delete;
+
+    /*Must be called after google::InitGoogleLogging(). capacity - count of messages in buffer (rounded up to power of 2)*/
+    static void Install(size_t capacity);
+
+    /*Write buffered messages, return original loggers to glog and delete proxies.
+      Must be called before google::ShutdownGoogleLogging()*/
+    static void Shutdown();
+
+    static bool isInstalled();
+
+private:
+    // proxy of original logger of one severity. Deleted by Shutdown(), if it isn't called, glog deletes it as current logger
+    class Logger : public google::base::Logger {
+    public:
+        explicit Logger(google::base::Logger *target);
+
+        void Write(bool force_flush, time_t timestamp, const char *message, int message_len) override;
+
+        void Flush() override;
+
+        google::uint32 LogSize() override;
+
+    private:
+        google::base::Logger *const target_;
+    };
+
+    struct Record {
+        std::atomic<size_t> sequence;   // ring buffer protocol of D. Vyukov: slot is free for position == sequence
+        google::base::Logger *target;
+        time_t timestamp;
+        bool flush;
+        string message;
+    };
+
+    enum { MIN_CAPACITY = 64, RECORD_RESERVE = 256, DRAIN_INTERVAL = 10 /*ms*/, FLUSH_TIMEOUT = 1000 /*ms*/ };
+
+    /*Return FALSE, if buffer is full*/
+    static bool push(google::base::Logger *target, bool flush, time_t timestamp, const char *message, int len);
+
+    /*Write all buffered messages. Return count of written messages. Called only by drain thread*/
+    static size_t drain();
+
+    /*Wait (at most FLUSH_TIMEOUT), while drain thread writes messages, that are in buffer now*/
+    static void waitDrained();
+
+    /*Write warning about dropped messages to original loggers of WARNING and INFO (as glog does).
+      LOG() isn't used by drain thread: caller of waitDrained() holds lock of glog, while it waits for drain thread*/
+    static void reportDropped(size_t dropped);
+
+    static void run();
+
+    static std::unique_ptr<Record[]> records_;
+    static size_t mask_;
+    static std::atomic<size_t> enqueuePos_;
+    static std::atomic<size_t> dequeuePos_;
+    static std::atomic<size_t> dropped_;
+    static std::atomic<bool> running_;
+    static boost::thread thread_;
+    static google::base::Logger *originals_[google::NUM_SEVERITIES];
+    static Logger *proxies_[google::NUM_SEVERITIES];
+
+    // drain thread sleeps on wakeCv_ while buffer is empty, waitDrained() sleeps on drainedCv_
+    static std::mutex cs_;
+    static std::condition_variable wakeCv_;
+    static std::condition_variable drainedCv_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CASYNCLOG_H
@@ -0,0 +1,57 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CBackoff.h"
+
+#include <algorithm>
+#include <random>
+
+CBackoff::CBackoff(size_t baseDelayMs, size_t maxAttempts, size_t deadlineMs)
+        : baseDelayMs_(std::max<size_t>(baseDelayMs, 1))
+        , maxAttempts_(maxAttempts)
+        , deadlineMs_(deadlineMs)
+        , attempts_(0)
+        , started_(clock::now())
+{}
+
+CBackoff::ptr CBackoff::new_(size_t baseDelayMs, size_t maxAttempts, size_t deadlineMs) {
+    ptr new_(new CBackoff(baseDelayMs, maxAttempts, deadlineMs));
+    return new_;
+}
+
+void CBackoff::restart() {
+    attempts_ = 0;
+    started_ = clock::now();
+}
+
+bool CBackoff::expired() const {
+    return attempts_ >= maxAttempts_ || elapsed() >= deadlineMs_;
+}
+
+size_t CBackoff::nextDelay() {
+    // each thread has own generator, so no locks needed
+    thread_local std::minstd_rand generator{std::random_device{}()};
+
+    const size_t shift = std::min<size_t>(attempts_, 5); // 2^5 == MAX_DELAY_FACTOR
+    const size_t delay = std::min<size_t>(baseDelayMs_ << shift, baseDelayMs_ * MAX_DELAY_FACTOR);
+
+    // "equal jitter": half of delay is fixed, other half is random.
+    // This prevents all waiting threads to wake up at the same time
+    std::uniform_int_distribution<size_t> jitter(0, delay / 2);
+    size_t next = delay - delay / 2 + jitter(generator);
+
+    const size_t spent = elapsed();
+    const size_t left = spent < deadlineMs_ ? deadlineMs_ - spent : 0;
+
+    ++attempts_;
+    return std::max<size_t>(std::min(next, left), 1);
+}
+
+size_t CBackoff::attempts() const {
+    return attempts_;
+}
+
+size_t CBackoff::elapsed() const {
+    return static_cast<size_t>(std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - started_).count());
+}
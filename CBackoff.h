@@ -0,0 +1,53 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CBACKOFF_H
+#define CS_MINISQLITESERVER_CBACKOFF_H
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <chrono>
+
+/*Exponential backoff with jitter, limited by count of attempts and
+  by deadline of the whole operation (since last restart())*/
+class CBackoff {
+    enum { MAX_DELAY_FACTOR = 32 }; // the longest single wait is baseDelay * MAX_DELAY_FACTOR
+    using clock = std::chrono::steady_clock;
+
+public:
+    typedef boost::shared_ptr<CBackoff> ptr;
+
+    /*Class factory. This method create shared pointer to CBackoff.*/
+    static ptr new_(size_t baseDelayMs, size_t maxAttempts, size_t deadlineMs);
+
+    explicit CBackoff(size_t baseDelayMs, size_t maxAttempts, size_t deadlineMs);
+
+    /*Start new operation: reset attempts and deadline*/
+    void restart();
+
+    /*Return TRUE if there is no more attempts or deadline is reached*/
+    bool expired() const;
+
+    /*Return time in ms to wait before next attempt and count this attempt.
+      Delay grows twice on each attempt, is randomised in [delay/2, delay]
+      and never exceeds time left to deadline*/
+    size_t nextDelay();
+
+    /*Count of attempts since last restart()*/
+    size_t attempts() const;
+
+    /*Time in ms since last restart()*/
+    size_t elapsed() const;
+
+private:
+    const size_t baseDelayMs_;
+    const size_t maxAttempts_;
+    const size_t deadlineMs_;
+
+    size_t attempts_;
+    clock::time_point started_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CBACKOFF_H
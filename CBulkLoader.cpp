@@ -0,0 +1,404 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CBulkLoader.h"
+
+#include <cstdlib>
+
+CBulkLoader::CBulkLoader(CSQLiteDB::ptr db, boost::asio::io_context::strand &strand, size_t commitRows, size_t commitMillisec, bool relaxSync)
+        : db_(std::move(db))
+        , commitRows_(commitRows ? commitRows : DEFAULT_COMMIT_ROWS)
+        , commitMillisec_(commitMillisec ? commitMillisec : DEFAULT_COMMIT_MILLISEC)
+        , relaxSync_(relaxSync)
+        , strand_(strand)
+        , commitTimer_(strand.context())
+        , inTransaction_(false)
+        , busy_(false)
+        , pStmt_(nullptr)
+        , columnCount_(0)
+        , totalRows_(0)
+        , uncommittedRows_(0)
+        , lastCommit_(clock::now())
+{}
+
+CBulkLoader::ptr CBulkLoader::new_(CSQLiteDB::ptr db, boost::asio::io_context::strand &strand, size_t commitRows, size_t commitMillisec, bool relaxSync) {
+    ptr new_(new CBulkLoader(std::move(db), strand, commitRows, commitMillisec, relaxSync));
+    return new_;
+}
+
+CBulkLoader::~CBulkLoader() {
+    // client didn't finish loading, so uncommitted rows are rolled back
+    if(isStarted())
+        release(false);
+}
+
+bool CBulkLoader::begin(const string &table, const std::vector<string> &columns) {
+    strLastError_.clear();
+    busy_ = false;
+
+    if(isStarted()){
+        strLastError_ = "bulk load is already started";
+        return false;
+    }
+
+    if(! db_->isConnected() && ! db_->OpenConnection()){
+        strLastError_ = db_->GetLastError();
+        return false;
+    }
+
+    if(db_->isInTransaction()){
+        strLastError_ = "bulk load can't be started inside transaction";
+        return false;
+    }
+
+    if(columns.empty() || ! isValidName(table)){
+        strLastError_ = "wrong table name or empty list of columns";
+        return false;
+    }
+
+    string insertSql = "INSERT INTO \"" + table + "\" (";
+    string values = ") VALUES (";
+
+    for (size_t i = 0; i < columns.size(); ++i) {
+        if(! isValidName(columns[i])){
+            strLastError_ = "wrong column name '" + columns[i] + "'";
+            return false;
+        }
+
+        insertSql += (i ? ", \"" : "\"") + columns[i] + "\"";
+        values += i ? ", ?" : "?";
+    }
+
+    insertSql += values + ");";
+
+    if(relaxSync_){
+        IResult *res = db_->ExecuteSelect("PRAGMA synchronous;");
+        if(res){
+            if(res->Next() && res->ColomnData(0))
+                oldSynchronous_ = res->ColomnData(0);
+            res->ReleaseStatement();
+        }
+
+        // 'synchronous' can't be changed inside transaction, so change it before BEGIN
+        db_->StepControlSql("PRAGMA synchronous = OFF;");
+    }
+
+    // don't wait for busy db (e.g. while schema is read), session calls begin() again later
+    db_->BeginOperation(false);
+
+    const int rc = sqlite3_prepare_v2(db_->pSQLiteConn->pCon, insertSql.c_str(), -1, &pStmt_, nullptr);
+    if(rc != SQLITE_OK){
+        busy_ = (rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED);
+        strLastError_ = "can't prepare '" + insertSql + "': " + sqlite3_errmsg(db_->pSQLiteConn->pCon);
+        LOG_IF(WARNING, ! busy_) << "BULK_LOADER: " << strLastError_;
+        release(false);
+        return false;
+    }
+
+    // lock is taken at once, so client knows, that it can load
+    if(! beginTransaction()){
+        release(false);
+        return false;
+    }
+
+    columnCount_ = static_cast<int>(columns.size());
+    totalRows_ = uncommittedRows_ = 0;
+
+    VLOG(1) << "DEBUG: bulk load started: " << insertSql;
+    return true;
+}
+
+long CBulkLoader::insertRows(const string &rows) {
+    strLastError_.clear();
+    busy_ = false;
+
+    if(! isStarted()){
+        strLastError_ = "bulk load is not started";
+        return -1;
+    }
+
+    // transaction was committed by timer
+    if(! inTransaction_){
+        if(db_->isInTransaction()){
+            strLastError_ = "rows can't be inserted inside transaction of client";
+            return -1;
+        }
+
+        if(! beginTransaction())
+            return -1;
+    }
+
+    // write lock is held by transaction, so steps shouldn't be busy. If they are, frame is rolled back and tried again
+    db_->BeginOperation(false);
+
+    // rows of one frame are inserted all or none
+    if(! db_->StepControlSql("SAVEPOINT bulk_rows;")){
+        strLastError_ = "can't create savepoint: " + string(sqlite3_errmsg(db_->pSQLiteConn->pCon));
+        return -1;
+    }
+
+    long inserted = 0;
+
+    for (size_t begin = 0; begin < rows.size(); ) {
+        size_t end = rows.find(ROW_SEPARATOR, begin);
+        if(end == string::npos)
+            end = rows.size();
+
+        if(end > begin){
+            bool ok = bindRow(rows, begin, end);
+
+            if(ok){
+                int rc = sqlite3_step(pStmt_);
+                ok = (rc == SQLITE_DONE);
+                busy_ = (rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED);
+
+                if(! ok)
+                    strLastError_ = "sqlite3_step returned with error_code(" + std::to_string(rc) + "): " + sqlite3_errmsg(db_->pSQLiteConn->pCon);
+            }
+
+            sqlite3_reset(pStmt_);
+            sqlite3_clear_bindings(pStmt_);
+
+            if(! ok){
+                strLastError_ = "row " + std::to_string(inserted + 1) + ": " + strLastError_;
+                VLOG(1) << "DEBUG: bulk load: " << strLastError_;
+
+                db_->StepControlSql("ROLLBACK TO bulk_rows;");
+                db_->StepControlSql("RELEASE bulk_rows;");
+                return -1;
+            }
+
+            ++inserted;
+        }
+
+        begin = end + 1;
+    }
+
+    db_->StepControlSql("RELEASE bulk_rows;");
+
+    totalRows_ += inserted;
+    uncommittedRows_ += inserted;
+
+    if(! commitIfNeeded())
+        return -1;
+
+    return inserted;
+}
+
+bool CBulkLoader::end() {
+    strLastError_.clear();
+
+    if(! isStarted()){
+        strLastError_ = "bulk load is not started";
+        return false;
+    }
+
+    release(true);
+
+    VLOG(1) << "DEBUG: bulk load finished. Rows: " << totalRows_;
+    return strLastError_.empty();
+}
+
+bool CBulkLoader::isStarted() const {
+    return pStmt_ != nullptr;
+}
+
+bool CBulkLoader::isBusy() const {
+    return busy_;
+}
+
+size_t CBulkLoader::getTotalRows() const {
+    return totalRows_;
+}
+
+string CBulkLoader::getLastError() const {
+    return strLastError_;
+}
+
+bool CBulkLoader::bindRow(const string &rows, size_t begin, size_t end) {
+    int column = 0;
+
+    for (size_t pos = begin; ; ) {
+        size_t next = rows.find(VALUE_SEPARATOR, pos);
+        if(next == string::npos || next > end)
+            next = end;
+
+        if(++column > columnCount_)
+            break;
+
+        const char *value = rows.data() + pos;
+        const size_t len = next - pos;
+        const string number = (len > 1) ? string(value + 1, len - 1) : string();
+        char *numberEnd = nullptr;
+        int rc = SQLITE_OK;
+
+        switch (len ? value[0] : 'n') {
+            case 'n':
+                rc = sqlite3_bind_null(pStmt_, column);
+                break;
+            case 'i':
+                rc = sqlite3_bind_int64(pStmt_, column, std::strtoll(number.c_str(), &numberEnd, 10));
+                break;
+            case 'r':
+                rc = sqlite3_bind_double(pStmt_, column, std::strtod(number.c_str(), &numberEnd));
+                break;
+            case 't':
+                // rows live until sqlite3_step, so sqlite needn't copy text
+                rc = sqlite3_bind_text(pStmt_, column, value + 1, static_cast<int>(len - 1), SQLITE_STATIC);
+                break;
+            case 'x': {
+                // two hex digits per byte
+                string blob;
+                blob.reserve((len - 1) / 2);
+                for (size_t i = 1; i < len; i += 2) {
+                    const int high = hexDigit(value[i]);
+                    const int low = (i + 1 < len) ? hexDigit(value[i + 1]) : -1;
+                    if(high < 0 || low < 0){
+                        strLastError_ = "wrong blob '" + string(value + 1, len - 1) + "' in column " + std::to_string(column);
+                        return false;
+                    }
+                    blob += static_cast<char>(high << 4 | low);
+                }
+                rc = sqlite3_bind_blob(pStmt_, column, blob.data(), static_cast<int>(blob.size()), SQLITE_TRANSIENT);
+                break;
+            }
+            default:
+                strLastError_ = "unknown type '" + string(1, value[0]) + "' of column " + std::to_string(column);
+                return false;
+        }
+
+        if(numberEnd && (number.empty() || *numberEnd != '\0')){
+            strLastError_ = "wrong number '" + number + "' in column " + std::to_string(column);
+            return false;
+        }
+
+        if(rc != SQLITE_OK){
+            strLastError_ = "can't bind column " + std::to_string(column) + ": " + sqlite3_errstr(rc);
+            return false;
+        }
+
+        if(next == end)
+            break;
+
+        pos = next + 1;
+    }
+
+    if(column != columnCount_){
+        strLastError_ = "expected " + std::to_string(columnCount_) + " values, but got " + std::to_string(column);
+        return false;
+    }
+
+    return true;
+}
+
+bool CBulkLoader::beginTransaction() {
+    // IMMEDIATE waits for other writers, so don't wait here: session tries again on timer
+    db_->BeginOperation(false);
+
+    if(! db_->BeginTransaction(CSQLiteDB::IMMEDIATE)){
+        busy_ = db_->isBusy();
+        strLastError_ = "can't begin transaction: " + string(sqlite3_errmsg(db_->pSQLiteConn->pCon));
+        return false;
+    }
+
+    inTransaction_ = true;
+    lastCommit_ = clock::now();
+    post_commit();
+    return true;
+}
+
+bool CBulkLoader::commitIfNeeded() {
+    const auto sinceCommit = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - lastCommit_).count();
+
+    if(uncommittedRows_ < commitRows_ && static_cast<size_t>(sinceCommit) < commitMillisec_)
+        return true;
+
+    if(! commit()){
+        release(false);
+        return false;
+    }
+
+    return true;
+}
+
+bool CBulkLoader::commit() {
+    commitTimer_.cancel();
+
+    if(! db_->EndTransaction()){
+        strLastError_ = "can't commit rows: " + db_->GetLastError();
+        LOG(WARNING) << "BULK_LOADER: " << strLastError_;
+        return false;
+    }
+
+    VLOG(1) << "DEBUG: bulk load committed " << uncommittedRows_ << " rows. Total: " << totalRows_;
+
+    inTransaction_ = false;
+    uncommittedRows_ = 0;
+    return true;
+}
+
+void CBulkLoader::post_commit() {
+    // loader can be destroyed by session before timer is called
+    boost::weak_ptr<CBulkLoader> self = shared_from_this();
+
+    commitTimer_.expires_from_now(boost::posix_time::millisec(commitMillisec_));
+    commitTimer_.async_wait(boost::asio::bind_executor(strand_, [self](const boost::system::error_code &err){
+        if(ptr loader = self.lock())
+            loader->on_commit_timer(err);
+    }));
+}
+
+void CBulkLoader::on_commit_timer(const boost::system::error_code &err) {
+    // handler of cancelled timer can be queued already, then timer is rearmed for the next transaction
+    if(err || ! inTransaction_ || commitTimer_.expires_at() > boost::asio::deadline_timer::traits_type::now())
+        return;
+
+    // on error transaction stays, next rows try to commit it again and get error
+    commit();
+}
+
+void CBulkLoader::release(bool commit) {
+    // transaction, begun by client after commit of loader, isn't touched
+    const bool inTransaction = inTransaction_;
+    inTransaction_ = false;
+    commitTimer_.cancel();
+
+    if(pStmt_){
+        sqlite3_finalize(pStmt_);
+        pStmt_ = nullptr;
+    }
+
+    if(inTransaction && db_->isInTransaction() && ! db_->EndTransaction(commit)){
+        strLastError_ = "can't finish bulk load: " + db_->GetLastError();
+        LOG(WARNING) << "BULK_LOADER: " << strLastError_;
+    }
+
+    if(relaxSync_ && ! oldSynchronous_.empty()){
+        db_->StepControlSql(("PRAGMA synchronous = " + oldSynchronous_ + ";").c_str());
+        oldSynchronous_.clear();
+    }
+}
+
+bool CBulkLoader::isValidName(const string &name) {
+    if(name.empty())
+        return false;
+
+    for(const char c : name){
+        if(! (isalnum(static_cast<unsigned char>(c)) || c == '_'))
+            return false;
+    }
+
+    return true;
+}
+
+int CBulkLoader::hexDigit(char c) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
@@ -0,0 +1,117 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CBULKLOADER_H
+#define CS_MINISQLITESERVER_CBULKLOADER_H
+#pragma once
+
+#include "CSQLiteDB.h"
+
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*Streaming insert of many rows into one table.
+  All rows are bound to one cached INSERT statement and committed
+  every commitRows rows or every commitMillisec ms. Timer of commitMillisec commits rows also,
+  when client doesn't send next rows, so write lock isn't held between frames.
+  Next transaction is begun by the next rows.
+
+  Format of rows: rows are separated by ROW_SEPARATOR, values by VALUE_SEPARATOR.
+  First char of value is its type:
+    'i' - integer, 'r' - real, 't' - text, 'x' - blob in hex, 'n' (or empty value) - NULL
+  Example of 2 rows with 2 columns: "i1\x1Fthello\x1Ei2\x1Fn"
+  Session removes line breaks from messages, so rows with them are rejected instead of inserting changed text.
+  Loader doesn't wait for busy db: begin() and insertRows() fail with isBusy() and can be called again later*/
+class CBulkLoader : public boost::enable_shared_from_this<CBulkLoader>
+                  , boost::noncopyable {
+    using clock = std::chrono::steady_clock;
+
+public:
+    enum { DEFAULT_COMMIT_ROWS = 10000, DEFAULT_COMMIT_MILLISEC = 1000 };
+
+    static const char ROW_SEPARATOR = '\x1E';
+    static const char VALUE_SEPARATOR = '\x1F';
+
+    typedef boost::shared_ptr<CBulkLoader> ptr;
+
+    /*Class factory. relaxSync == TRUE turns 'PRAGMA synchronous = OFF' while loading.
+      Commit timer is executed in strand, that uses db*/
+    static ptr new_(CSQLiteDB::ptr db, boost::asio::io_context::strand &strand, size_t commitRows, size_t commitMillisec, bool relaxSync);
+
+    ~CBulkLoader();
+
+    /*Prepare INSERT statement and begin transaction. Return FALSE on error (check isBusy())*/
+    bool begin(const string &table, const std::vector<string> &columns);
+
+    /*Insert rows. Rows of one call are inserted all or none.
+      Return count of inserted rows or -1 on error (check isBusy())*/
+    long insertRows(const string &rows);
+
+    /*Commit rest of rows and release statement*/
+    bool end();
+
+    bool isStarted() const;
+
+    /*Return TRUE if last begin() or insertRows() failed, because db was busy. Nothing was changed by it*/
+    bool isBusy() const;
+
+    size_t getTotalRows() const;
+
+    string getLastError() const;
+
+private:
+    explicit CBulkLoader(CSQLiteDB::ptr db, boost::asio::io_context::strand &strand, size_t commitRows, size_t commitMillisec, bool relaxSync);
+
+    bool bindRow(const string &rows, size_t begin, size_t end);
+
+    /*Begin transaction of next rows and start commit timer*/
+    bool beginTransaction();
+
+    bool commitIfNeeded();
+
+    /*Commit rows. Transaction isn't begun again until next rows*/
+    bool commit();
+
+    void post_commit();
+
+    void on_commit_timer(const boost::system::error_code &err);
+
+    void release(bool commit);
+
+    static bool isValidName(const string &name);
+
+    // value of hex digit, -1 if c isn't hex digit
+    static int hexDigit(char c);
+
+private:
+    CSQLiteDB::ptr db_;
+    const size_t commitRows_;
+    const size_t commitMillisec_;
+    const bool relaxSync_;
+
+    boost::asio::io_context::strand &strand_;
+    boost::asio::deadline_timer commitTimer_;
+    bool inTransaction_;        // transaction of loader is begun
+    bool busy_;                 // last begin() or insertRows() failed on busy db
+
+    sqlite3_stmt *pStmt_;
+    int columnCount_;
+    string oldSynchronous_;
+
+    size_t totalRows_;
+    size_t uncommittedRows_;
+    clock::time_point lastCommit_;
+
+    string strLastError_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CBULKLOADER_H
@@ -3,6 +3,8 @@
 //
 
 #include "CBusinessLogic.h"
+#include "CConnectionFactory.h"
+#include "CMetrics.h"
 
 CBusinessLogic::CBusinessLogic()
         : placeFree_("-1")
@@ -10,6 +12,12 @@ CBusinessLogic::CBusinessLogic()
         , restoreProgress_(-1)
 {/*static int instCount = 0; instCount++;VLOG(1) <<instCount;*/}
 
+CBusinessLogic::~CBusinessLogic() {
+    // scheduler thread calls isRestoreExecuting(), so stop it before members are destroyed
+    if(checkpointScheduler_)
+        checkpointScheduler_->stop();
+}
+
 void CBusinessLogic::checkPlaceFree(const CSQLiteDB::ptr &dbPtr, const string &selectQuery_sql) {
     if(placeFree_ == "-1"){
         //selectPlaceFree(dbPtr, "select PlaceFree from Config");
@@ -130,7 +138,8 @@ bool CBusinessLogic::prepareBeforeRestore(const string &mainDbPath, const string
         restoreProgress_ = 0;
     }
 
-    std::ofstream fileWriter(mainDbPath, std::ios::binary);
+    // only check, that file can be written. Clients still work with it, so don't truncate it here
+    std::ofstream fileWriter(mainDbPath, std::ios::in | std::ios::out | std::ios::binary);
 
     if((! fileReader.open(restoreDbPath)) && (! fileReader.open(restoreDbPath))){
         errMsg = "can't open for read restore file '" + restoreDbPath + "'";
@@ -175,6 +184,15 @@ bool CBusinessLogic::prepareBeforeRestore(const string &mainDbPath, const string
 void CBusinessLogic::restoreDbFromFile(const string &mainDbPath, const string &restoreDbPath) {
     string errMsg;
     CBinaryFileReader fileReader;
+
+    {
+        // move all frames from WAL to db file and truncate WAL, so old frames won't be applied to restored db
+        CSQLiteDB::ptr mainDb = CSQLiteDB::new_(mainDbPath);
+        if(! mainDb->OpenConnection() || ! mainDb->WalCheckpoint(SQLITE_CHECKPOINT_TRUNCATE)){
+            LOG(WARNING) << "BUSINESS_LOGIC: restore db: can't checkpoint WAL: " << mainDb->GetLastError();
+        }
+    }
+
     std::ofstream fileWriter(mainDbPath, std::ios::binary);
 
     if((! fileReader.open(restoreDbPath)) && (! fileReader.open(restoreDbPath))){
@@ -248,6 +266,44 @@ void CBusinessLogic::resetRestoreProgress() {
     restoreProgress_ = -1;
 }
 
+void CBusinessLogic::startCheckpointScheduler(const string &mainDbPath, size_t intervalMs, long long walSizeLimit) {
+    if(checkpointScheduler_ || intervalMs == 0)
+        return;
+
+    checkpointScheduler_ = CCheckpointScheduler::new_(mainDbPath, intervalMs, walSizeLimit, [this](){
+        // restore rewrites db file, so scheduler mustn't touch it
+        return isRestoreExecuting();
+    });
+    checkpointScheduler_->start();
+}
+
+string CBusinessLogic::getCheckpointStats() const {
+    string out;
+
+    CMetrics::renderGauge(out, "minisqlite_checkpoint_scheduler_enabled", checkpointScheduler_ ? 1 : 0);
+    if(! checkpointScheduler_)
+        return out;
+
+    const CCheckpointScheduler::Stats stats = checkpointScheduler_->getStats();
+    using ms = std::chrono::milliseconds;
+
+    CMetrics::renderGauge(out, "minisqlite_wal_file_size_bytes", stats.walFileSize);
+    CMetrics::renderGauge(out, "minisqlite_wal_frames", stats.walFrames);
+    CMetrics::renderCounter(out, "minisqlite_checkpoint_passive_total", stats.passiveCount);
+    CMetrics::renderCounter(out, "minisqlite_checkpoint_restart_total", stats.restartCount);
+    CMetrics::renderCounter(out, "minisqlite_checkpoint_truncate_total", stats.truncateCount);
+    CMetrics::renderCounter(out, "minisqlite_checkpoint_busy_total", stats.busyCount);
+    CMetrics::renderGauge(out, "minisqlite_checkpoint_last_duration_seconds", ms(stats.lastDurationMs));
+    CMetrics::renderGauge(out, "minisqlite_checkpoint_max_duration_seconds", ms(stats.maxDurationMs));
+    CMetrics::renderCounter(out, "minisqlite_checkpoint_duration_seconds_total", ms(stats.totalDurationMs));
+
+    return out;
+}
+
+string CBusinessLogic::getStats() const {
+    return CMetrics::Render() + getCheckpointStats() + CConnectionFactory::GetMemoryStats();
+}
+
 void CBusinessLogic::SyncDbWithTmp(const string &mainDbPath, const std::function<void(const size_t)> &waitFunc) {
 
     static std::recursive_mutex sync_;
@@ -270,6 +326,9 @@ void CBusinessLogic::SyncDbWithTmp(const string &mainDbPath, const std::function
         throw BusinessLogicError(errMsg);
     }
 
+    // queries, that were deferred during backup, change main db now
+    CConnectionFactory::WatchChanges(mainDb);
+
     if(! mainDb->OpenConnection()) {
         string errMsg("can't connect to " + mainDbPath + ": " + mainDb->GetLastError());
         LOG(WARNING) <<"BUSINESS_LOGIC: " <<errMsg;
@@ -320,8 +379,8 @@ void CBusinessLogic::SyncDbWithTmp(const string &mainDbPath, const std::function
 
         //VLOG(1) <<"DEBUG: rowid: " <<rowid <<" query: " <<query;
 
-        // executing query from tmp table
-        int queryResult = mainDb->Execute(query.c_str());
+        // executing query from tmp table. It can be batch of several statements
+        int queryResult = mainDb->ExecuteBatch(query.c_str());
 
         if(queryResult < 0){
             string errorMsg = "BUSINESS_LOGIC: can't execute query '" + query + "' from tmp db: " + mainDb->GetLastError();
@@ -9,6 +9,7 @@
 #include "main.h"
 #include "CSQLiteDB.h"
 #include "CBinaryFileReader.h"
+#include "CCheckpointScheduler.h"
 #include "glog/logging.h"
 
 #include <memory>
@@ -47,7 +48,7 @@ class CBusinessLogic : public boost::enable_shared_from_this<CBusinessLogic>
 public:
     explicit CBusinessLogic();
 
-     //~CBusinessLogic(){/*VLOG(1) <<"DEBUG: free CBusinessLogic";*/}
+    ~CBusinessLogic();
 
     CBusinessLogic(CBusinessLogic const&) = delete;
     CBusinessLogic operator=(CBusinessLogic const&) = delete;
@@ -79,6 +80,15 @@ public:
 
     void resetRestoreProgress();
 
+    // start background WAL checkpointing. If intervalMs == 0, checkpoints are left to sqlite (auto-checkpoint)
+    void startCheckpointScheduler(const string &mainDbPath, size_t intervalMs, long long walSizeLimit);
+
+    // return stats of checkpoint scheduler in Prometheus text format (see CMetrics)
+    string getCheckpointStats() const;
+
+    // return all stats of server (metrics, checkpoints, memory) in Prometheus text format
+    string getStats() const;
+
     // throws BuisnessLogicErro
     // This method select saved querys, while backup was active, and execute theirs in main db
     static void SyncDbWithTmp(const string &mainDbPath, const std::function<void(const size_t)> &waitFunc);
@@ -105,6 +115,8 @@ private:
 
     std::unique_ptr<deadline_timer> backupTimer_;
 
+    CCheckpointScheduler::ptr checkpointScheduler_;
+
 };
 
 
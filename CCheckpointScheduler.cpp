@@ -0,0 +1,214 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CCheckpointScheduler.h"
+#include "main.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <sys/stat.h>
+
+CCheckpointScheduler::CCheckpointScheduler(string dbPath, size_t intervalMs, long long walSizeLimit, std::function<bool()> isPaused)
+        : dbPath_(std::move(dbPath))
+        , intervalMs_(intervalMs)
+        , walSizeLimit_(walSizeLimit)
+        , isPaused_(std::move(isPaused))
+        , stopping_(false)
+        , dataVersion_(0)
+        , pending_(false)
+        , restartedWalSize_(0)
+        , walFileSize_(0)
+        , walFrames_(0)
+        , passiveCount_(0)
+        , restartCount_(0)
+        , truncateCount_(0)
+        , busyCount_(0)
+        , lastDurationMs_(0)
+        , maxDurationMs_(0)
+        , totalDurationMs_(0)
+{}
+
+CCheckpointScheduler::ptr CCheckpointScheduler::new_(string dbPath, size_t intervalMs, long long walSizeLimit, std::function<bool()> isPaused) {
+    ptr new_(new CCheckpointScheduler(std::move(dbPath), intervalMs, walSizeLimit, std::move(isPaused)));
+    return new_;
+}
+
+CCheckpointScheduler::~CCheckpointScheduler() {
+    stop();
+}
+
+void CCheckpointScheduler::start() {
+    if(thread_.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        stopping_ = false;
+    }
+
+    LOG(INFO) << "Checkpoint scheduler started. Interval: " << intervalMs_ << "ms, WAL size limit: " << walSizeLimit_ << " bytes";
+    thread_ = boost::thread(&CCheckpointScheduler::run, this);
+}
+
+void CCheckpointScheduler::stop() {
+    if(! thread_.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+CCheckpointScheduler::Stats CCheckpointScheduler::getStats() const {
+    Stats stats{};
+    stats.walFileSize = walFileSize_;
+    stats.walFrames = walFrames_;
+    stats.passiveCount = passiveCount_;
+    stats.restartCount = restartCount_;
+    stats.truncateCount = truncateCount_;
+    stats.busyCount = busyCount_;
+    stats.lastDurationMs = lastDurationMs_;
+    stats.maxDurationMs = maxDurationMs_;
+    stats.totalDurationMs = totalDurationMs_;
+    return stats;
+}
+
+void CCheckpointScheduler::run() {
+    for(;;){
+        {
+            std::unique_lock<std::mutex> lock(cs_);
+            if(cv_.wait_for(lock, std::chrono::milliseconds(intervalMs_), [this]{ return stopping_; }))
+                break;
+        }
+
+        if(isPaused_ && isPaused_()){
+            // db file can be replaced (restore), so connection will be reopened later
+            db_.reset();
+            continue;
+        }
+
+        long long dataVersion = 0;
+        if(! open() || ! readDataVersion(dataVersion))
+            continue;
+
+        const bool changed = (dataVersion != dataVersion_);
+        dataVersion_ = dataVersion;
+        if(changed)
+            pending_ = true;
+
+        const long long walFileSize = walFileSize_ = getWalFileSize();
+
+        if(walFileSize > walSizeLimit_ && ! changed){
+            checkpoint(SQLITE_CHECKPOINT_TRUNCATE);
+            walFileSize_ = getWalFileSize();
+        }else if(walFileSize > walSizeLimit_ && walFileSize > restartedWalSize_){
+            // after RESTART writers reuse WAL file from the beginning, so it grows only if RESTART didn't help
+            checkpoint(SQLITE_CHECKPOINT_RESTART);
+            restartedWalSize_ = walFileSize;
+        }else if(! changed && pending_){
+            checkpoint(SQLITE_CHECKPOINT_PASSIVE);
+        }
+    }
+
+    VLOG(1) << "DEBUG: checkpoint scheduler stopped";
+}
+
+bool CCheckpointScheduler::open() {
+    if(db_)
+        return true;
+
+    // RESTART and TRUNCATE block new writers while waiting for readers, so don't wait longer, than interval
+    db_ = CSQLiteDB::new_(dbPath_, sqlCountOfAttempts, sqlWaitTime, intervalMs_);
+    // busy handler waits inside sqlite3_wal_checkpoint_v2, so waiting mustn't throw
+    db_->setWaitFunction([](size_t ms){ std::this_thread::sleep_for(std::chrono::milliseconds(ms)); });
+
+    // new connection doesn't know, that db is in WAL mode, until it reads db. Without it checkpoint does nothing
+    if(! db_->OpenConnection() || ! db_->ExecuteScript("PRAGMA journal_mode = WAL;")){
+        LOG(WARNING) << "CHECKPOINT: can't connect to '" << dbPath_ << "': " << db_->GetLastError();
+        db_.reset();
+        return false;
+    }
+
+    // data_version of new connection isn't related to the previous one
+    dataVersion_ = 0;
+    return true;
+}
+
+bool CCheckpointScheduler::readDataVersion(long long &version) {
+    IResult *res = db_->ExecuteSelect("PRAGMA data_version;");
+
+    if(nullptr == res){
+        if(! db_->isBusy()){
+            LOG(WARNING) << "CHECKPOINT: can't read data_version: " << db_->GetLastError();
+            db_.reset();
+        }
+        return false;
+    }
+
+    bool ok = res->Next() && res->ColomnData(0);
+    if(ok)
+        version = std::atoll(res->ColomnData(0));
+
+    res->ReleaseStatement();
+    return ok;
+}
+
+void CCheckpointScheduler::checkpoint(int mode) {
+    int logFrames = 0, checkpointedFrames = 0;
+    const auto started = std::chrono::steady_clock::now();
+
+    bool ok = db_->WalCheckpoint(mode, &logFrames, &checkpointedFrames);
+
+    const size_t duration = static_cast<size_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started).count());
+
+    lastDurationMs_ = duration;
+    totalDurationMs_ += duration;
+    if(duration > maxDurationMs_)
+        maxDurationMs_ = duration;
+
+    const char *modeName = "passive";
+    if(mode == SQLITE_CHECKPOINT_TRUNCATE){
+        ++truncateCount_;
+        modeName = "truncate";
+    }else if(mode == SQLITE_CHECKPOINT_RESTART){
+        ++restartCount_;
+        modeName = "restart";
+    }else{
+        ++passiveCount_;
+    }
+
+    if(! ok){
+        if(db_->isBusy()){
+            ++busyCount_;
+        }else{
+            LOG(WARNING) << "CHECKPOINT: " << db_->GetLastError();
+            db_.reset();
+        }
+        return;
+    }
+
+    // PASSIVE checkpoint can skip frames, that are read by somebody. Try again on next idle check
+    pending_ = (logFrames != checkpointedFrames);
+    // after TRUNCATE WAL is empty, after RESTART it is written from the beginning by the next writer
+    walFrames_ = (mode == SQLITE_CHECKPOINT_PASSIVE || pending_) ? logFrames : 0;
+    if(mode == SQLITE_CHECKPOINT_TRUNCATE)
+        restartedWalSize_ = 0;
+
+    VLOG(1) << "DEBUG: checkpoint (" << modeName << ") "
+            << checkpointedFrames << "/" << logFrames << " frames in " << duration << "ms";
+}
+
+long long CCheckpointScheduler::getWalFileSize() const {
+    struct stat walStat{};
+
+    if(0 != stat((dbPath_ + "-wal").c_str(), &walStat))
+        return 0;
+
+    return static_cast<long long>(walStat.st_size);
+}
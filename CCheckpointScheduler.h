@@ -0,0 +1,104 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CCHECKPOINTSCHEDULER_H
+#define CS_MINISQLITESERVER_CCHECKPOINTSCHEDULER_H
+#pragma once
+
+#include "CSQLiteDB.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+
+using std::string;
+
+/*Background WAL checkpointing on own thread and connection.
+  Client connections must be opened with 'PRAGMA wal_autocheckpoint = 0',
+  so COMMIT of client never runs checkpoint.
+  Every interval scheduler reads 'PRAGMA data_version' (it is changed by commits of other connections).
+  Size of WAL file isn't used for it: after complete checkpoint sqlite writes WAL from the beginning, file keeps its size.
+    - db wasn't changed since last check (idle) and WAL has frames, that aren't in db: PASSIVE checkpoint
+      (doesn't wait for anybody)
+    - db is changed and WAL file grew over walSizeLimit: RESTART checkpoint (waits for readers and writers,
+      so next writer starts WAL from the beginning and file stops growing)
+    - db is idle and WAL file is bigger, than walSizeLimit: TRUNCATE checkpoint (as RESTART, then truncates WAL file)*/
+class CCheckpointScheduler : boost::noncopyable {
+public:
+    struct Stats {
+        long long walFileSize;      // size of WAL file in bytes on last check
+        long long walFrames;        // frames in WAL, reported by the last checkpoint
+        size_t passiveCount;        // count of PASSIVE checkpoints
+        size_t restartCount;        // count of RESTART checkpoints
+        size_t truncateCount;       // count of TRUNCATE checkpoints
+        size_t busyCount;           // count of checkpoints, that failed, because db was busy
+        size_t lastDurationMs;      // duration of last checkpoint
+        size_t maxDurationMs;       // duration of the longest checkpoint
+        size_t totalDurationMs;     // duration of all checkpoints
+    };
+
+    typedef boost::shared_ptr<CCheckpointScheduler> ptr;
+
+    /*Class factory. isPaused is checked before each checkpoint,
+      while it returns TRUE scheduler doesn't touch db (e.g. db is restoring)*/
+    static ptr new_(string dbPath, size_t intervalMs, long long walSizeLimit, std::function<bool()> isPaused);
+
+    ~CCheckpointScheduler();
+
+    void start();
+
+    void stop();
+
+    Stats getStats() const;
+
+private:
+    explicit CCheckpointScheduler(string dbPath, size_t intervalMs, long long walSizeLimit, std::function<bool()> isPaused);
+
+    void run();
+
+    /*Open connection of scheduler, if it isn't opened*/
+    bool open();
+
+    /*Read 'PRAGMA data_version'. Return FALSE on error*/
+    bool readDataVersion(long long &version);
+
+    void checkpoint(int mode);
+
+    long long getWalFileSize() const;
+
+private:
+    const string dbPath_;
+    const size_t intervalMs_;
+    const long long walSizeLimit_;
+    std::function<bool()> isPaused_;
+
+    boost::thread thread_;
+    // stop() wakes up thread, that waits for next check. Thread isn't interrupted:
+    // interruption can be thrown from busy handler through frames of sqlite
+    std::mutex cs_;
+    std::condition_variable cv_;
+    bool stopping_;
+    CSQLiteDB::ptr db_;
+    long long dataVersion_;         // on last check
+    bool pending_;                  // WAL has frames, that weren't copied to db by checkpoint
+    long long restartedWalSize_;    // size of WAL file, when RESTART was made. Next RESTART is made, if WAL grows over it
+
+    std::atomic<long long> walFileSize_;
+    std::atomic<long long> walFrames_;
+    std::atomic<size_t> passiveCount_;
+    std::atomic<size_t> restartCount_;
+    std::atomic<size_t> truncateCount_;
+    std::atomic<size_t> busyCount_;
+    std::atomic<size_t> lastDurationMs_;
+    std::atomic<size_t> maxDurationMs_;
+    std::atomic<size_t> totalDurationMs_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CCHECKPOINTSCHEDULER_H
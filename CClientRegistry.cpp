@@ -0,0 +1,73 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CClientRegistry.h"
+
+CClientRegistry::CClientRegistry()
+        : nextId_(0)
+        , version_(0)
+        , size_(0)
+{}
+
+uint64_t CClientRegistry::add(const client_ptr &client) {
+    const uint64_t id = nextId_++;
+    Shard &shard = shardOf(id);
+
+    {
+        boost::mutex::scoped_lock lk(shard.cs);
+        shard.clients.emplace(id, client);
+    }
+
+    ++size_;
+    return id;
+}
+
+bool CClientRegistry::remove(uint64_t id) {
+    Shard &shard = shardOf(id);
+    client_ptr removed; // session must be destroyed out of lock
+
+    {
+        boost::mutex::scoped_lock lk(shard.cs);
+        auto it = shard.clients.find(id);
+        if(it == shard.clients.end())
+            return false;
+
+        removed = std::move(it->second);
+        shard.clients.erase(it);
+    }
+
+    --size_;
+    notifyChanged();
+    return true;
+}
+
+CClientRegistry::clients_vector CClientRegistry::snapshot() const {
+    clients_vector clients;
+    clients.reserve(size_);
+
+    for(const Shard &shard : shards_){
+        boost::mutex::scoped_lock lk(shard.cs);
+        for(const auto &it : shard.clients)
+            clients.push_back(it.second);
+    }
+
+    return clients;
+}
+
+size_t CClientRegistry::size() const {
+    return size_;
+}
+
+uint64_t CClientRegistry::version() const {
+    return version_;
+}
+
+void CClientRegistry::notifyChanged() {
+    ++version_;
+}
+
+CClientRegistry::Shard &CClientRegistry::shardOf(uint64_t id) {
+    // ids are sequential, so clients are spread evenly
+    return shards_[id % SHARDS];
+}
@@ -0,0 +1,66 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CCLIENTREGISTRY_H
+#define CS_MINISQLITESERVER_CCLIENTREGISTRY_H
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class CClientSession;
+
+/*Registry of started client sessions. Sessions are split by id between shards,
+  each shard has own lock, so adding/removing of client is O(1) and doesn't block other shards.
+  Instead of notifying every session, registry counts changes of clients list: session
+  remembers version, that was sent to its client, and compares it with current one*/
+class CClientRegistry : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<CClientSession> client_ptr;
+    typedef std::vector<client_ptr> clients_vector;
+
+    enum { SHARDS = 64 };
+
+    CClientRegistry();
+
+    /*Register client. Return id, by which client must be removed*/
+    uint64_t add(const client_ptr &client);
+
+    /*Remove client and increase version. Return FALSE, if client isn't registered*/
+    bool remove(uint64_t id);
+
+    /*Copy of clients. Shards are copied one by one, so it isn't consistent
+      with changes, that are made at the same time*/
+    clients_vector snapshot() const;
+
+    size_t size() const;
+
+    /*Count of changes of clients list*/
+    uint64_t version() const;
+
+    /*Increase version, e.g. when user name of client was changed*/
+    void notifyChanged();
+
+private:
+    struct Shard {
+        mutable boost::mutex cs;
+        std::unordered_map<uint64_t, client_ptr> clients;
+    };
+
+    Shard &shardOf(uint64_t id);
+
+    Shard shards_[SHARDS];
+    std::atomic<uint64_t> nextId_;
+    std::atomic<uint64_t> version_;
+    std::atomic<size_t> size_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CCLIENTREGISTRY_H
@@ -1,21 +1,25 @@
 ﻿#include "CClientSession.h"
+#include "CNotifier.h"
+#include "CDeflater.h"
 
-boost::recursive_mutex clients_cs;
-typedef boost::shared_ptr<CClientSession> client_ptr;
-typedef std::vector<client_ptr> cli_ptr_vector;
-cli_ptr_vector clients;
+CClientRegistry clients;
 
-CClientSession::CClientSession(io_context &io_context, const size_t maxTimeout,
+CClientSession::CClientSession(io_context &io_context, boost::asio::io_context &background, CIdleWheel::ptr idleWheel,
                                CClientSession::businessLogic_ptr businessLogic)
-        : sock_(io_context)
+        : io_context_(io_context)
+        , strand_(io_context)
+        , idleWheel_(std::move(idleWheel))
+        , read_buffer_({ new char[MAX_READ_BUFFER + 1] })
+        , background_(background)
         , started_(false)
-        , timer_(io_context)
-        , maxTimeout_(maxTimeout)
-        , clients_changed_(false)
-        , username_("user")
-        , io_context_(io_context)
-        , write_buffer_({ new char[MAX_WRITE_BUFFER] })
-        , read_buffer_({ new char[MAX_READ_BUFFER] })
+        , reading_(false)
+        , writing_(false)
+        , compressReplies_(false)
+        , lineBreaksRemoved_(false)
+        , lastActivity_(0)
+        , username_(boost::make_shared<const string>("user"))
+        , id_(0)
+        , clients_version_(0)
         , businessLogic_(std::move(businessLogic))
 {}
 
@@ -24,95 +28,94 @@ CClientSession::~CClientSession() { /*VLOG(1) << "DEBUG: ~CClientSession()";*/ }
 void CClientSession::start()
 {
     started_ = true;
+    CMetrics::add(CMetrics::ACTIVE_SESSIONS, 1);
 
-    {
-        boost::recursive_mutex::scoped_lock lk(clients_cs);
-        clients.push_back(shared_from_this());
-    }
+    clients_version_ = clients.version();
+    id_ = clients.add(shared_from_this());
+    CTrace::Record(CTrace::SESSION_START, id_);
 
-    db = CSQLiteDB::new_(dbPath, sqlCountOfAttempts, sqlWaitTime);
-    db->setWaitFunction([=](size_t ms){
-        // Construct a timer without setting an expiry time.
-        deadline_timer timer(io_context_);
-        // Set an expiry time relative to now.
-        timer.expires_from_now(boost::posix_time::millisec(ms));
-        // Wait for the timer to expire.
-        timer.wait();
-    });
-    LOG_IF(WARNING, ! db->OpenConnection()) << "ERROR: can't connect to db: " <<db->GetLastError();
-    IResult *res = db->ExecuteSelect(string("PRAGMA journal_mode = WAL; PRAGMA encoding = \"UTF-8\"; "
-                                                      "PRAGMA foreign_keys = 1; PRAGMA page_size = " + std::to_string(blockOrClusterSize) + "; PRAGMA cache_size = -3000;").c_str());
-    res->ReleaseStatement();
+    db = CConnectionFactory::NewConnection(dbPath, sqlCountOfAttempts, sqlWaitTime, sqlBusyTimeout);
 
-    last_ping_ = boost::posix_time::microsec_clock::local_time();
+    touch();
+    idleWheel_->add(shared_from_this());
 
     do_read();
 }
 
-CClientSession::ptr CClientSession::new_(io_context& io_context, const size_t maxTimeout, businessLogic_ptr businessLogic)
+void CClientSession::stop()
 {
-    ptr new_(new CClientSession(io_context, maxTimeout, std::move(businessLogic)));
-    return new_;
+    // if we are in strand yet, do_stop() is called immediately
+    dispatch(strand_, bind(&CClientSession::do_stop, shared_from_this()));
 }
 
-void CClientSession::stop()
+void CClientSession::do_stop()
 {
-    {
-        boost::recursive_mutex::scoped_lock lk(cs_);
+    if( ! started_.exchange(false) )
+        return;
 
-        if( !started_ )
-            return;
+    CMetrics::add(CMetrics::ACTIVE_SESSIONS, -1);
 
-        VLOG(1) << "DEBUG: stop client: " << username();
+    VLOG(1) << "DEBUG: stop client: " << username();
 
-        started_ = false;
-        sock_.cancel();
-        //There is a bug: https://svn.boost.org/trac10/ticket/7611#no1
-        //so in multithread mode we mustn't stop socket, because asio in some time can run async_read/write on socket exactly when we close socket
-        //and OS send SIGSEGV to server :(
-        //To prevent SIGSEGV, I don't close socket. Socket will be closed automaticaly, after destructor CClientSession::~CClientSession()
-        //sock_.close();
-    }
+    cancel_io();
+    //There is a bug: https://svn.boost.org/trac10/ticket/7611#no1
+    //so in multithread mode we mustn't stop socket, because asio in some time can run async_read/write on socket exactly when we close socket
+    //and OS send SIGSEGV to server :(
+    //To prevent SIGSEGV, I don't close socket. Socket will be closed automaticaly, after destructor CClientSession::~CClientSession()
+    //sock_.close();
 
     VLOG(1) << "DEBUG: socket was stopped for client: " << username();
 
-    ptr self = shared_from_this();
+    // don't hold locks of unfinished client transaction, until session is destroyed
+    bulkLoader_.reset();
 
-    {
-        boost::recursive_mutex::scoped_lock lk(clients_cs);
-        auto it = std::find(clients.begin(), clients.end(), self);
-        if(it != clients.end())
-            clients.erase(it);
+    if(db && db->isInTransaction()){
+        VLOG(1) << "DEBUG: rollback unfinished transaction of client: " << username();
+        db->Rollback();
     }
-    update_clients_changed();
+
+    CNotifier::Unsubscribe(id_);
+
+    // other clients will be notified on next ping
+    clients.remove(id_);
+    CTrace::Record(CTrace::SESSION_STOP, id_);
+}
+
+size_t CClientSession::count()
+{
+    return clients.size();
 }
 
 bool CClientSession::started() const
 {
-    boost::recursive_mutex::scoped_lock lk(cs_);
     return started_;
 }
 
-ip::tcp::socket& CClientSession::sock()
+string CClientSession::username() const
 {
-    boost::recursive_mutex::scoped_lock lk(cs_);
-    return sock_;
+    return *boost::atomic_load(&username_);
 }
 
-string CClientSession::username() const
+int64_t CClientSession::lastActivity() const
+{
+    return lastActivity_;
+}
+
+void CClientSession::notify(string msg)
 {
-    boost::recursive_mutex::scoped_lock lk(cs_);
-    return username_;
+    // notification doesn't wait for answer, so next message isn't read after it
+    do_write(std::move(msg), false);
 }
 
-void CClientSession::set_clients_changed()
+void CClientSession::touch()
 {
-    boost::recursive_mutex::scoped_lock lk(cs_);
-    clients_changed_ = true;
+    lastActivity_ = CIdleWheel::now();
 }
 
 void CClientSession::on_read(const error_code &err, size_t bytes)
 {
+    reading_ = false;
+
     if( err )
         stop();
 
@@ -122,7 +125,12 @@ void CClientSession::on_read(const error_code &err, size_t bytes)
     try {
         // process the msg]
 
-        // we must make copy of read_buffer_, for quick unlock cs_ mutex
+        // message is captured as it was received
+        CTrace::Record(CTrace::MESSAGE, id_, read_buffer_.get(), std::min(bytes, size_t(MAX_READ_BUFFER)));
+
+        // buffer isn't cleared before reading, so terminate received data
+        read_buffer_[std::min(bytes, size_t(MAX_READ_BUFFER))] = char(0);
+
         size_t len = strlen(read_buffer_.get()) - sizeEndOfMsg;
 
         if((len < 7)||(len > MAX_READ_BUFFER))
@@ -130,152 +138,220 @@ void CClientSession::on_read(const error_code &err, size_t bytes)
 
         string inMsg(len, char(0));
         size_t cleanMsgSize = 0;
-        {
-            boost::recursive_mutex::scoped_lock lk(cs_);
-            for (size_t i = 0; i < inMsg.size(); ++i) {
-                //continue if read_buffer_[i] == one of (\r, \n, NULL)
-                if((read_buffer_[i] != char(0)) && (read_buffer_[i] != char(13))  && (read_buffer_[i] != char(10)))
-                    inMsg[cleanMsgSize++] = read_buffer_[i];
+        bool lineBreak = false;
+        lineBreaksRemoved_ = false;
+        for (size_t i = 0; i < inMsg.size(); ++i) {
+            //continue if read_buffer_[i] == one of (\r, \n, NULL)
+            if((read_buffer_[i] != char(0)) && (read_buffer_[i] != char(13))  && (read_buffer_[i] != char(10))){
+                inMsg[cleanMsgSize++] = read_buffer_[i];
+                // line break at the end of message only ends line, inside it changes data
+                lineBreaksRemoved_ = lineBreaksRemoved_ || lineBreak;
+            }else if(read_buffer_[i] != char(0)){
+                lineBreak = true;
             }
         }
         inMsg.resize(cleanMsgSize);
 
 
         VLOG(1) << "DEBUG: received msg '" << inMsg << "\nDEBUG: received bytes from user '" <<username() <<"' bytes: " << bytes
-                << " delay: " <<(boost::posix_time::microsec_clock::local_time() - last_ping_).total_milliseconds() <<"ms";
+                << " delay: " <<(CIdleWheel::now() - lastActivity_) <<"ms";
+
+        touch();
+        CMetrics::add(CMetrics::BYTES_IN, bytes);
+
+        const CMetrics::clock::time_point started = CMetrics::clock::now();
+        // queries and backup are finished asynchronously, they are measured by themselves
+        CMetrics::Command command = CMetrics::CMD_UNKNOWN;
+        bool measured = true;
 
         if(businessLogic_->isRestoreExecuting()){
             VLOG(1) <<"DEBUG: Server is busy at the moment. ";
             do_write("Server is busy at the moment. Database restore progress [" + std::to_string(businessLogic_->getRestoreProgress()) + "%]", false);
             stop();
 
-        }else if(0 == inMsg.find(u8"UPDATE Config SET PlaceFree")){
-            int progress = businessLogic_->getBackUpProgress();
-            string msg;
+        }else if(const Command *cmd = commands().find(inMsg)){
+            command = cmd->metric;
 
-            if(progress > -1 && progress <100) {
-                msg = "'UPDATE Config SET PlaceFree...'. Backup in progress [" + std::to_string(progress) + "%]";
+            if(cmd->needsArguments && boost::trim_copy(CCommandTable<Command>::arguments(inMsg)).empty()){
+                do_write("ERROR: arguments are missing: " + CCommandTable<Command>::firstWord(inMsg) + "\n");
             }else{
-                businessLogic_->updatePlaceFree(db, inMsg, "select PlaceFree from Config;");
-                msg = "NONE";
+                measured = cmd->measured;
+                cmd->handler(*this, inMsg);
             }
 
-            do_write(msg);
+        }else if(inMsg.size() > 10) {
+            measured = false;
+            on_query(inMsg, QUERY_STATEMENT);
 
-        }else if(0 == inMsg.find(u8"get_place_free")) {
-            try {
-                businessLogic_->checkPlaceFree(db, "select PlaceFree from Config;");
-                do_write(businessLogic_->getCachedPlaceFree());
-            } catch (BusinessLogicError &e){
-                // if an error occur, send last PlaceFree. If last PlaceFree == -1, send 0
-                do_write(businessLogic_->getCachedPlaceFree() == "-1" ? "0" : businessLogic_->getCachedPlaceFree());
-            }
+        }else{
+            do_write(string(u8"ERROR: very short command:") + inMsg + "\n");
+            LOG(WARNING) << "very short command from client " << username() << ": '" << inMsg << '\'';
+        }
 
-        }else if(0 == inMsg.find(u8"restore_db")){
-            do_restore_db();
+        if(measured)
+            CMetrics::record(command, CMetrics::clock::now() - started);
 
-        }else if(0 == inMsg.find(u8"backup_db")){
-            auto self = shared_from_this();
-            io_context_.post([self, this](){ //async call
-                do_db_backup();
-            });
+    }catch (BusinessLogicError &e){
+        LOG(WARNING) <<"BusinessLogic [" <<e.what() <<"]";
+        do_write(e.what());
+    }catch (...){
+        stop();
+    }
 
-        }else if(0 == inMsg.find(u8"get_db_backup_progress")){
-            do_ask_db_backup_progress();
+}
 
-        }else if(0 == inMsg.find(u8"get_db_backup")){
-            do_get_db_backup();
+const CCommandTable<CClientSession::Command> &CClientSession::commands()
+{
+    using Metric = CMetrics::Command;
 
-        }else if(0 == inMsg.find(u8"login ")){
-            on_login(inMsg);
+    static const CCommandTable<Command> table = []{
+        CCommandTable<Command> table;
 
-        }else if(0 == inMsg.find(u8"ping")){
-            on_ping();
+        table.add(u8"UPDATE Config SET PlaceFree", { Metric::CMD_UPDATE_PLACE_FREE, true, false, [](CClientSession &s, const string &msg){ s.on_update_place_free(msg); } });
+        table.add(u8"get_place_free", { Metric::CMD_GET_PLACE_FREE, true, false, [](CClientSession &s, const string &){ s.on_get_place_free(); } });
+        table.add(u8"restore_db", { Metric::CMD_RESTORE, true, false, [](CClientSession &s, const string &){ s.do_restore_db(); } });
+        table.add(u8"backup_db", { Metric::CMD_BACKUP, false, false, [](CClientSession &s, const string &){ s.on_backup(); } });
+        table.add(u8"get_db_backup_progress", { Metric::CMD_BACKUP_PROGRESS, true, false, [](CClientSession &s, const string &){ s.do_ask_db_backup_progress(); } });
+        table.add(u8"get_db_backup", { Metric::CMD_GET_BACKUP, true, false, [](CClientSession &s, const string &){ s.do_get_db_backup(); } });
 
-        }else if(0 == inMsg.find(u8"who")){
-            on_clients();
+        table.add(u8"stats", { Metric::CMD_STATS, true, false, [](CClientSession &s, const string &){ s.do_write(s.businessLogic_->getStats()); } });
+        table.add(u8"get_checkpoint_stats", { Metric::CMD_STATS, true, false, [](CClientSession &s, const string &){ s.do_write(s.businessLogic_->getCheckpointStats()); } });
+        table.add(u8"get_memory_stats", { Metric::CMD_STATS, true, false, [](CClientSession &s, const string &){ s.do_write(CConnectionFactory::GetMemoryStats()); } });
 
-        }else if(0 == inMsg.find(u8"fibo ")){
-            on_fibo(inMsg);
+        for(const char *transaction : { u8"begin", u8"commit", u8"rollback" })
+            table.add(transaction, { Metric::CMD_TRANSACTION, true, false, [](CClientSession &s, const string &msg){ s.on_transaction(msg); } });
 
-        }else if(0 == inMsg.find(u8"exit")){
-            stop();
+        table.add(u8"exec_batch", { Metric::CMD_EXEC_BATCH, false, true, [](CClientSession &s, const string &msg){
+            s.on_query(CCommandTable<Command>::arguments(msg), QUERY_BATCH);
+        } });
 
-        }else if(inMsg.size() > 10) {
-            on_query(inMsg);
+        for(const char *bulk : { u8"bulk_begin", u8"bulk_rows", u8"bulk_end" })
+            table.add(bulk, { Metric::CMD_BULK, true, false, [](CClientSession &s, const string &msg){ s.on_bulk(msg); } });
 
-        }else{
-            do_write(string(u8"ERROR: very short command:") + inMsg + "\n");
-            LOG(WARNING) << "very short command from client " << username() << ": '" << inMsg << '\'';
-        }
+        table.add(u8"login", { Metric::CMD_LOGIN, true, true, [](CClientSession &s, const string &msg){ s.on_login(msg); } });
+        table.add(u8"ping", { Metric::CMD_PING, true, false, [](CClientSession &s, const string &){ s.on_ping(); } });
+        table.add(u8"who", { Metric::CMD_WHO, true, false, [](CClientSession &s, const string &){ s.on_clients(); } });
+        table.add(u8"fibo", { Metric::CMD_FIBO, true, true, [](CClientSession &s, const string &msg){ s.on_fibo(msg); } });
+        table.add(u8"exit", { Metric::CMD_EXIT, true, false, [](CClientSession &s, const string &){ s.stop(); } });
 
-    }catch (BusinessLogicError &e){
-        LOG(WARNING) <<"BusinessLogic [" <<e.what() <<"]";
-        do_write(e.what());
-    }catch (...){
-        stop();
+        for(const char *subscribe : { u8"subscribe", u8"unsubscribe" })
+            table.add(subscribe, { Metric::CMD_SUBSCRIBE, true, false, [](CClientSession &s, const string &msg){ s.on_subscribe(msg); } });
+
+        return table;
+    }();
+
+    return table;
+}
+
+void CClientSession::on_update_place_free(const string &msg)
+{
+    int progress = businessLogic_->getBackUpProgress();
+    string answer;
+
+    if(progress > -1 && progress <100) {
+        answer = "'UPDATE Config SET PlaceFree...'. Backup in progress [" + std::to_string(progress) + "%]";
+    }else{
+        businessLogic_->updatePlaceFree(db, msg, "select PlaceFree from Config;");
+        CNotifier::Publish(CNotifier::PLACE_FREE, businessLogic_->getCachedPlaceFree());
+        answer = "NONE";
     }
 
+    do_write(answer);
+}
+
+void CClientSession::on_get_place_free()
+{
+    try {
+        businessLogic_->checkPlaceFree(db, "select PlaceFree from Config;");
+        do_write(businessLogic_->getCachedPlaceFree());
+    } catch (BusinessLogicError &e){
+        // if an error occur, send last PlaceFree. If last PlaceFree == -1, send 0
+        do_write(businessLogic_->getCachedPlaceFree() == "-1" ? "0" : businessLogic_->getCachedPlaceFree());
+    }
+}
+
+void CClientSession::on_backup()
+{
+    // backup is long, so it is executed out of strand with own connection to db
+    auto self = shared_from_this();
+    background_.post([self, this](){ //async call
+        do_db_backup();
+    });
 }
 
 void CClientSession::on_login(const string &msg)
 {
-    boost::recursive_mutex::scoped_lock lk(cs_);
     std::istringstream in(msg);
+    string username;
+
+    in >> username >> username;
+    boost::atomic_store(&username_, boost::make_shared<const string>(username));
+
+    // login <user> [compress=<name>[,<name>...]]: big answers of queries are compressed, if server supports one of names
+    string option;
+    std::vector<string> names;
+    compressReplies_ = false;
+    while(in >> option){
+        if(0 != option.find("compress=") || compressMinBytes == 0)
+            continue;
+
+        const string requested = option.substr(9);
+        boost::split(names, requested, boost::is_any_of(","));
+        compressReplies_ = CDeflater::isAvailable() && names.end() != std::find(names.begin(), names.end(), CDeflater::NAME);
+    }
 
-    in >> username_ >> username_;
-
-    VLOG(1) << "DEBUG: logged in: " << username_ << std::endl;
+    VLOG(1) << "DEBUG: logged in: " << username << (compressReplies_ ? " with compression" : "") << std::endl;
 
-    do_write(string("login ok\n"));
-    //update_clients_changed(); // this caused bug with dead lock when restore or backup db, I didn't tested fixed it or not
+    do_write(compressReplies_ ? "login ok compress=" + string(CDeflater::NAME) + "\n" : string("login ok\n"));
+    clients.notifyChanged();
 }
 
 void CClientSession::on_ping()
 {
-    boost::recursive_mutex::scoped_lock lk(cs_);
-    do_write(clients_changed_ ? string("ping client_list_changed\n") : string(u8"ping OK\n"));
+    // we notify client, that clients list was changed,
+    // so next ping is OK until list is changed again
+    const uint64_t version = clients.version();
+    const bool changed = version != clients_version_;
+    clients_version_ = version;
 
-    // we have notified client, that clients list was changed yet,
-    // so clients_changed_ should be false
-    clients_changed_ = false;
+    do_write(changed ? string("ping client_list_changed\n") : string(u8"ping OK\n"));
 }
 
 void CClientSession::on_clients()
 {
-    cli_ptr_vector clients_copy;
-    {
-        boost::recursive_mutex::scoped_lock lk(clients_cs);
-        clients_copy = clients;
-    }
-
     string msg;
 
-    for(const auto &it : clients_copy )
+    for(const auto &it : clients.snapshot() )
         msg += it->username() + " ";
 
     do_write(string("clients: " + msg + "\n"));
 }
 
-void CClientSession::on_check_ping()
+
+
+void CClientSession::on_subscribe(const string &msg)
 {
-    boost::recursive_mutex::scoped_lock lk(cs_);
-    boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
-    time_duration::tick_type delay = (now - last_ping_).total_milliseconds();
+    if( ! CNotifier::isEnabled() ){
+        do_write(string("ERROR: notifications are disabled\n"));
+        return;
+    }
 
-    if( delay >= time_duration::tick_type(maxTimeout_ - 1) ){
-        VLOG(1) << "DEBUG: stopping: " << username_ << " - no ping in time " <<delay;
-        stop();
+    std::vector<string> topics;
+    const string arguments = CCommandTable<Command>::arguments(msg);
+    boost::split(topics, arguments, boost::is_space(), boost::token_compress_on);
+    topics.erase(std::remove(topics.begin(), topics.end(), string()), topics.end());
+
+    const bool subscribe = 0 == msg.find(u8"subscribe");
+    if(subscribe && topics.empty()){
+        do_write(string("ERROR: subscribe <table|PlaceFree> [...]\n"));
+        return;
     }
 
-    last_ping_ = boost::posix_time::microsec_clock::local_time();
-}
+    const size_t count = subscribe ? CNotifier::Subscribe(id_, shared_from_this(), topics)
+                                   : CNotifier::Unsubscribe(id_, topics);
 
-void CClientSession::post_check_ping()
-{
-    boost::recursive_mutex::scoped_lock lk(cs_);
-    timer_.expires_from_now(boost::posix_time::millisec(maxTimeout_));
-    timer_.async_wait(bind(&CClientSession::on_check_ping, shared_from_this()));
+    // sqlite3_update_hook isn't called for WITHOUT ROWID tables (see CSQLiteDB::setChangesFunction)
+    do_write("subscribed " + std::to_string(count) + (subscribe ? " (changes of WITHOUT ROWID tables aren't notified)\n" : "\n"));
 }
 
 void CClientSession::do_get_fibo(const size_t &n)
@@ -295,35 +371,48 @@ void CClientSession::on_fibo(const string &msg)
 {
     std::istringstream in(msg);
     in.ignore(5);
-    size_t n;
-    in >> n;
+    size_t n = 0;
+    if( ! (in >> n) || n > MAX_FIBO ){
+        do_write("ERROR: fibo <n>, n <= " + std::to_string(MAX_FIBO) + "\n");
+        return;
+    }
     //msg.substr()
     auto self = shared_from_this();
-    io_context_.post([self, this, &n](){ do_get_fibo(n); });
+    post(strand_, [self, this, n](){ do_get_fibo(n); });
 
     do_read();
 }
 
 
 
-void CClientSession::do_ask_db(string &query)
+void CClientSession::do_ask_db(const string &query, QueryKind kind, const CBackoff::ptr &backoff)
 {
     if( ! started() )
         return;
 
-    boost::recursive_mutex::scoped_lock bd_;
-
     string answer;
+    CMetrics::Command command = kind == QUERY_BATCH ? CMetrics::CMD_EXEC_BATCH : CMetrics::CMD_QUERY_WRITE;
 
     if(! db->isConnected()){
         if(! db->OpenConnection()){
             answer = "ERROR: " + db->GetLastError();
         }
+    }else if(kind == QUERY_STATEMENT && ! db->Prepare(query.c_str(), false)){
+        // don't block io thread, while db is busy. Try again later on timer
+        if(db->isBusy() && ! backoff->expired()){
+            post_ask_db(query, kind, backoff);
+            return;
+        }
+
+        answer = "ERROR: " + db->GetLastError();
+        LOG(WARNING) << answer;
     }else{
-        //check if query is 'select' or 'insert/update...'
-        if((query.find("select") < 10) || (query.find("SELECT") < 10)){
+        // statement is classified after prepare and the same statement is executed,
+        // so WITH/EXPLAIN/PRAGMA reads don't take write transaction. Batch is executed as write
+        if(kind == QUERY_STATEMENT && db->isReadOnly()){
+            command = CMetrics::CMD_QUERY_SELECT;
             //Get Data From DB
-            IResult *res = db->ExecuteSelect(query.c_str());
+            IResult *res = db->ExecuteSelect();
 
             if (nullptr == res){
                 answer = "ERROR: undefined";
@@ -349,7 +438,16 @@ void CClientSession::do_ask_db(string &query)
                 //release Result Data
                 res->ReleaseStatement();
 
-                if(answer.empty()){
+                // rows aren't sent yet, so query is executed again from the first row
+                if(db->isBusy() && ! backoff->expired()){
+                    post_ask_db(query, kind, backoff);
+                    return;
+                }
+
+                if(db->isBusy()){
+                    answer = "ERROR: " + db->GetLastError();
+                    LOG(WARNING) << answer;
+                }else if(answer.empty()){
                     answer = "NONE";
                 }else{
                     answer.erase(answer.size() - 1);
@@ -360,9 +458,21 @@ void CClientSession::do_ask_db(string &query)
             int effectedData = 0;
             int backUpProgress = businessLogic_->getBackUpProgress();
 
-            if(backUpProgress < 0 || backUpProgress == 100){
-                effectedData =  db->Execute(query.c_str());
+            // statements of explicit transaction must be executed in main db, even if backup is in progress
+            if(backUpProgress < 0 || backUpProgress == 100 || db->isInTransaction()){
+                // don't block io thread, while db is busy. Try again later on timer
+                effectedData = kind == QUERY_BATCH ? db->ExecuteBatch(query.c_str(), false)
+                                                   : db->Execute();
+
+                if(effectedData < 0 && db->isBusy() && ! backoff->expired()){
+                    post_ask_db(query, kind, backoff);
+                    return;
+                }
             }else{
+                // query is executed by main db after backup
+                if(kind == QUERY_STATEMENT)
+                    db->ReleasePrepared();
+
                 effectedData = businessLogic_->SaveQueryToTmpDb(query);
                 VLOG(1) <<"DEBUG: insert to tmp db while backuping. Effected data: " <<effectedData;
             }
@@ -379,17 +489,184 @@ void CClientSession::do_ask_db(string &query)
     }
 
     //VLOG(1) <<(int)answer[0]<<(int)answer[1];
-    do_write(answer, false);
+    CMetrics::record(command, CMetrics::clock::now() - queryStart_);
+
+    // next msg is read after answer, so queries of one client are never executed concurrently
+    if(compressReplies_ && answer.size() >= compressMinBytes)
+        do_write_compressed(std::move(answer));
+    else
+        do_write(std::move(answer));
 }
 
-void CClientSession::on_query(const string &msg)
+void CClientSession::on_query(const string &msg, QueryKind kind)
 {
     if( !started() )
         return;
 
-    io_context_.post(bind(&CClientSession::do_ask_db, shared_from_this(), msg));
+    // one query of client is executed at a time (next msg is read after answer)
+    queryStart_ = CMetrics::clock::now();
 
-    do_read();
+    CBackoff::ptr backoff = CBackoff::new_(sqlWaitTime, sqlCountOfAttempts, sqlBusyTimeout);
+    post(strand_, bind(&CClientSession::do_ask_db, shared_from_this(), msg, kind, backoff));
+}
+
+void CClientSession::post_ask_db(const string &query, QueryKind kind, const CBackoff::ptr &backoff)
+{
+    auto self = shared_from_this();
+    post_retry(backoff, [self, this, query, kind, backoff](){ do_ask_db(query, kind, backoff); });
+}
+
+void CClientSession::post_retry(const CBackoff::ptr &backoff, std::function<void()> retry)
+{
+    const size_t delay = backoff->nextDelay();
+    CMetrics::add(CMetrics::QUERY_RESCHEDULED);
+    VLOG(1) << "DEBUG: db is busy, query of '" << username() << "' rescheduled in " << delay << "ms. Tries: " << backoff->attempts();
+
+    auto timer = boost::make_shared<deadline_timer>(io_context_, boost::posix_time::millisec(delay));
+    auto self = shared_from_this();
+    timer->async_wait(bind_executor(strand_, [self, timer, retry = std::move(retry)](const error_code &err){
+        if( ! err )
+            retry();
+    }));
+}
+
+void CClientSession::on_bulk(const string &msg)
+{
+    do_bulk(msg, CBackoff::new_(sqlWaitTime, sqlCountOfAttempts, sqlBusyTimeout));
+}
+
+void CClientSession::do_bulk(const string &msg, const CBackoff::ptr &backoff)
+{
+    if( ! started() )
+        return;
+
+    string answer;
+    bool busy = false;
+
+    if(0 == msg.find(u8"bulk_rows ")){
+        // values would be inserted without removed line breaks
+        if(lineBreaksRemoved_){
+            answer = "ERROR: rows mustn't contain line breaks";
+        }else{
+            long inserted = bulkLoader_ ? bulkLoader_->insertRows(msg.substr(10)) : -1;
+
+            busy = (inserted < 0) && bulkLoader_ && bulkLoader_->isBusy();
+            answer = (inserted < 0) ? "ERROR: " + (bulkLoader_ ? bulkLoader_->getLastError() : string("bulk load is not started"))
+                                    : "bulk rows " + std::to_string(bulkLoader_->getTotalRows());
+        }
+
+    }else if(0 == msg.find(u8"bulk_begin ")){
+        int progress = businessLogic_->getBackUpProgress();
+
+        if(progress > -1 && progress < 100){
+            answer = "Bulk load can't be started. Backup in progress [" + std::to_string(progress) + "%]";
+        }else if(bulkLoader_ && bulkLoader_->isStarted()){
+            answer = "ERROR: bulk load is already started";
+        }else{
+            // bulk_begin <table> <column1,column2,...> [rows=N] [ms=M] [sync_off]
+            std::istringstream in(msg.substr(11));
+            string table, columnsList, option;
+            size_t commitRows = 0, commitMillisec = 0;
+            bool relaxSync = false;
+
+            in >> table >> columnsList;
+
+            while(in >> option){
+                if(0 == option.find("rows=")){
+                    commitRows = std::strtoul(option.c_str() + 5, nullptr, 10);
+                }else if(0 == option.find("ms=")){
+                    commitMillisec = std::strtoul(option.c_str() + 3, nullptr, 10);
+                }else if(option == "sync_off"){
+                    relaxSync = true;
+                }
+            }
+
+            std::vector<string> columns;
+            boost::split(columns, columnsList, boost::is_any_of(","), boost::token_compress_on);
+
+            bulkLoader_ = CBulkLoader::new_(db, strand_, commitRows, commitMillisec, relaxSync);
+            const bool begun = bulkLoader_->begin(table, columns);
+
+            busy = ! begun && bulkLoader_->isBusy();
+            answer = begun ? "bulk ok" : "ERROR: " + bulkLoader_->getLastError();
+        }
+
+    }else if(0 == msg.find(u8"bulk_end")){
+        if(bulkLoader_ && bulkLoader_->end()){
+            answer = "bulk done " + std::to_string(bulkLoader_->getTotalRows());
+        }else{
+            answer = "ERROR: " + (bulkLoader_ ? bulkLoader_->getLastError() : string("bulk load is not started"));
+        }
+        bulkLoader_.reset();
+
+    }else{
+        answer = "ERROR: unknown bulk command";
+    }
+
+    // don't block io thread, while db is busy. Try again later on timer (rows of frame weren't inserted)
+    if(busy && ! backoff->expired()){
+        auto self = shared_from_this();
+        post_retry(backoff, [self, this, msg, backoff](){ do_bulk(msg, backoff); });
+        return;
+    }
+
+    VLOG_IF(1, answer[0] == 'E') << "DEBUG: bulk load of '" << username() << "': " << answer;
+    do_write(answer);
+}
+
+void CClientSession::on_transaction(const string &msg)
+{
+    do_transaction(msg, CBackoff::new_(sqlWaitTime, sqlCountOfAttempts, sqlBusyTimeout));
+}
+
+void CClientSession::do_transaction(const string &msg, const CBackoff::ptr &backoff)
+{
+    if( ! started() )
+        return;
+
+    string answer;
+    bool ok = true;
+
+    if(0 == msg.find(u8"begin")){
+        int progress = businessLogic_->getBackUpProgress();
+
+        if(progress > -1 && progress < 100){
+            answer = "Transaction can't be started. Backup in progress [" + std::to_string(progress) + "%]";
+        }else{
+            CSQLiteDB::TransactionMode mode = CSQLiteDB::DEFERRED;
+
+            if(msg.find(u8"immediate") != string::npos){
+                mode = CSQLiteDB::IMMEDIATE;
+            }else if(msg.find(u8"exclusive") != string::npos){
+                mode = CSQLiteDB::EXCLUSIVE;
+            }
+
+            ok = db->Begin(mode, false);
+            answer = "begin ok";
+        }
+
+    }else if(0 == msg.find(u8"commit")){
+        ok = db->Commit(false);
+        answer = "commit ok";
+
+    }else{
+        ok = db->Rollback(false);
+        answer = "rollback ok";
+    }
+
+    // don't block io thread, while db is busy. Try again later on timer
+    if( ! ok ){
+        if(db->isBusy() && ! backoff->expired()){
+            auto self = shared_from_this();
+            post_retry(backoff, [self, this, msg, backoff](){ do_transaction(msg, backoff); });
+            return;
+        }
+
+        answer = "ERROR: " + db->GetLastError();
+    }
+
+    VLOG(1) << "DEBUG: transaction of '" << username() << "': " << answer;
+    do_write(answer);
 }
 
 
@@ -398,58 +675,178 @@ void CClientSession::do_read()
 {
     //VLOG(1) << "DEBUG: do read" << std::endl;
 
-    {
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        ZeroMemory(read_buffer_.get(), sizeof(char) * MAX_READ_BUFFER);
-    }
+    // only one reading at a time: read_buffer_ is shared by all readings
+    if( reading_ || ! started() )
+        return;
 
-    post_check_ping();
+    reading_ = true;
 
-    async_read(sock_, buffer(read_buffer_.get(), MAX_READ_BUFFER), boost::asio::transfer_at_least(1),
-                        bind(&CClientSession::on_read, shared_from_this(), _1, _2));
+    touch();
+
+    async_read_some(buffer(read_buffer_.get(), MAX_READ_BUFFER), &CClientSession::on_read);
 
 }
 
 
-void CClientSession::do_write(const string &msg, bool read_on_write)
+void CClientSession::do_write(string msg, bool read_on_write)
 {
     if( !started() )
         return;
 
-    {
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        ZeroMemory(write_buffer_.get(), sizeof(char) * MAX_WRITE_BUFFER);
+    auto self(shared_from_this());
+
+    dispatch(strand_, [this, self, msg = std::move(msg), read_on_write]() mutable {
+        CMetrics::add(CMetrics::WRITE_QUEUE_MESSAGES, 1);
+        CMetrics::add(CMetrics::WRITE_QUEUE_BYTES, static_cast<int64_t>(msg.size()));
+        const size_t size = msg.size();
+        write_queue_.push_back({ std::move(msg), read_on_write, size, nullptr, false });
+
+        if( ! writing_ )
+            do_write_next();
+    });
+}
+
+void CClientSession::do_write_next()
+{
+    if( write_queue_.empty() || ! started() ){
+        for(const auto &it : write_queue_){
+            CMetrics::add(CMetrics::WRITE_QUEUE_MESSAGES, -1);
+            CMetrics::add(CMetrics::WRITE_QUEUE_BYTES, -static_cast<int64_t>(it.size));
+        }
+        write_queue_.clear();
+        writing_ = false;
+        return;
     }
 
-    std::copy(msg.begin(), msg.end(), write_buffer_.get());
+    OutMsg &front = write_queue_.front();
 
-    auto self(shared_from_this());
+    if(front.backupFile){
+        writing_ = true;
+        do_backup_chunk_write();
+        return;
+    }
 
-    async_write(sock_, buffer(write_buffer_.get(), msg.size()),
-                [this, self, read_on_write](error_code, size_t){
-                    if(read_on_write){
-                        do_read();
-                    }
-                });
+    if(front.compressed){
+        // next part isn't compressed yet: do_write_compressed calls do_write_next, when it is ready
+        if(front.compressed->parts.empty()){
+            writing_ = false;
+            return;
+        }
+
+        front.data = std::move(front.compressed->parts.front());
+        front.compressed->parts.pop_front();
+    }
+
+    writing_ = true;
+
+    // front of queue isn't changed until write is completed, so its buffer stays valid
+    async_write_all(buffer(front.data), &CClientSession::on_write);
+}
+
+void CClientSession::on_write(const error_code &err, size_t bytes)
+{
+    (void)err;
+    CMetrics::add(CMetrics::BYTES_OUT, bytes);
+
+    // other messages wait, until all parts of compressed reply are written
+    const auto &compressed = write_queue_.front().compressed;
+    if(compressed && ! (compressed->complete && compressed->parts.empty())){
+        do_write_next();
+        return;
+    }
+
+    bool readOnWrite = pop_written();
+
+    if(readOnWrite){
+        do_read();
+    }
+
+    do_write_next();
+}
+
+bool CClientSession::pop_written()
+{
+    CMetrics::add(CMetrics::WRITE_QUEUE_MESSAGES, -1);
+    CMetrics::add(CMetrics::WRITE_QUEUE_BYTES, -static_cast<int64_t>(write_queue_.front().size));
 
+    const bool readOnWrite = write_queue_.front().readOnWrite;
+    write_queue_.pop_front();
+    return readOnWrite;
+}
+
+void CClientSession::do_write_compressed(string reply)
+{
+    if( !started() )
+        return;
+
+    auto compressed = boost::make_shared<CompressedReply>();
+    compressed->complete = false;
+    // client learns, that reply is compressed, by '\0': answers of queries never contain it
+    compressed->parts.push_back(string(1, '\0') + CDeflater::NAME + " " + std::to_string(reply.size()) + "\n");
+
+    CMetrics::add(CMetrics::WRITE_QUEUE_MESSAGES, 1);
+    CMetrics::add(CMetrics::WRITE_QUEUE_BYTES, static_cast<int64_t>(reply.size()));
+    write_queue_.push_back({ string(), true, reply.size(), compressed, false });
+
+    if( ! writing_ )
+        do_write_next();
+
+    // compression of big reply takes milliseconds, so io thread only sends parts, that are ready
+    auto self = shared_from_this();
+    background_.post([self, this, compressed, reply = std::move(reply)](){
+        CDeflater deflater(compressLevel);
+        size_t compressedSize = 0;
+
+        for(size_t offset = 0; offset < reply.size() && started(); offset += COMPRESS_PART){
+            const size_t size = std::min<size_t>(COMPRESS_PART, reply.size() - offset);
+            const bool last = offset + size == reply.size();
+
+            string part;
+            if( ! deflater.compress(reply.data() + offset, size, last, part) ){
+                // client can't find end of broken stream
+                LOG(WARNING) << "Compression of reply to '" << username() << "' failed: " << deflater.getLastError();
+                stop();
+                return;
+            }
+            compressedSize += part.size();
+
+            dispatch(strand_, [self, this, compressed, part = std::move(part), last]() mutable {
+                compressed->parts.push_back(std::move(part));
+                compressed->complete = last;
+
+                if( ! writing_ )
+                    do_write_next();
+            });
+        }
+
+        CMetrics::add(CMetrics::REPLIES_COMPRESSED);
+        CMetrics::add(CMetrics::COMPRESSION_INPUT_BYTES, reply.size());
+        CMetrics::add(CMetrics::COMPRESSION_OUTPUT_BYTES, compressedSize);
+        VLOG(1) << "DEBUG: reply to '" << username() << "' is compressed: " << reply.size() << " -> " << compressedSize << " bytes";
+    });
 }
 
 void CClientSession::do_db_backup() {
+    const CMetrics::clock::time_point started = CMetrics::clock::now();
     int backUpStatus = businessLogic_->getBackUpProgress();
+    string backupError;
 
     //check if if backuping is executing. (!= -1). If not, send 0% and start backup
     if(-1 == backUpStatus){
         string startBackupMsg = "backup in progress [0%]";
         VLOG(1) << "DEBUG: " <<startBackupMsg;
         do_write(startBackupMsg);
-        //block this async func and make backup
-        backUpStatus = businessLogic_->backupDb(db, bakDbPath);
+        //block this async func and make backup.
+        //Connection of session is used by its strand, so backup is made with own connection
+        CSQLiteDB::ptr backupDb = CConnectionFactory::NewConnection(dbPath, sqlCountOfAttempts, sqlWaitTime, sqlBusyTimeout);
+        backUpStatus = businessLogic_->backupDb(backupDb, bakDbPath);
+        backupError = backupDb->GetLastError();
     }
 
     string msg;
     if(-1 == backUpStatus){
         //this will be executed after backup is finished with error
-        msg = "ERROR: db was not backuped: " + db->GetLastError();
+        msg = "ERROR: db was not backuped: " + backupError;
         LOG(WARNING) << msg;
         do_write(msg, false);
         return;
@@ -458,11 +855,11 @@ void CClientSession::do_db_backup() {
 
         // start executing query from tmp db in background
         auto self = shared_from_this();
-        io_context_.post([self, this](){ //async call
+        background_.post([self, this](){ //async call
             try {
                     businessLogic_->SyncDbWithTmp(dbPath, [=](size_t ms) {
                         // Construct a timer without setting an expiry time.
-                        deadline_timer timer(io_context_);
+                        deadline_timer timer(background_);
                         // Set an expiry time relative to now.
                         timer.expires_from_now(boost::posix_time::millisec(ms));
                         // Wait for the timer to expire.
@@ -480,6 +877,7 @@ void CClientSession::do_db_backup() {
         //VLOG(1) << "DEBUG: " <<msg;
     }
 
+    CMetrics::record(CMetrics::CMD_BACKUP, CMetrics::clock::now() - started);
     do_write(msg);
 }
 
@@ -498,14 +896,18 @@ void CClientSession::do_ask_db_backup_progress() {
 }
 
 void CClientSession::on_backup_chunk_write(const CClientSession::error_code &err, size_t bytes) {
-    //VLOG(1) <<"sanded bytes: " <<bytes << " delay: " <<(boost::posix_time::microsec_clock::local_time() - last_ping_).total_milliseconds();
+    //VLOG(1) <<"sanded bytes: " <<bytes << " delay: " <<(CIdleWheel::now() - lastActivity_);
     if( err ){
         LOG(WARNING) <<"ERROR: can't send file to client: " <<err;
+        backupReader_.close();
+        pop_written();
+        writing_ = false;
         do_write("ERROR: " + err.message());
         return;
     }
 
-    post_check_ping();
+    CMetrics::add(CMetrics::BYTES_OUT, bytes);
+    touch();
 
     do_backup_chunk_write();
 }
@@ -516,12 +918,16 @@ void CClientSession::do_backup_chunk_write() {
 
     if( ! backupReader_.nextChunk() ){
         backupReader_.close();
-        do_read();
+        if(pop_written())
+            do_read();
+        // send messages, that were queued while file was sending
+        do_write_next();
         return;
     }
 
-    async_write(sock_, buffer(backupReader_.getCurrentChunk(), backupReader_.getCurrentChunkSize()),
-                           bind(&CClientSession::on_backup_chunk_write, shared_from_this(), _1, _2));
+    // file is the front of write_queue_, so other messages wait for the end of file
+    async_write_all(buffer(backupReader_.getCurrentChunk(), backupReader_.getCurrentChunkSize()),
+                    &CClientSession::on_backup_chunk_write);
 }
 
 void CClientSession::do_get_db_backup() {
@@ -544,7 +950,12 @@ void CClientSession::do_get_db_backup() {
         return;
     }
 
-    do_backup_chunk_write();
+    // notification can be written right now, so file waits in queue as other messages
+    CMetrics::add(CMetrics::WRITE_QUEUE_MESSAGES, 1);
+    write_queue_.push_back({ string(), true, 0, nullptr, true });
+
+    if( ! writing_ )
+        do_write_next();
 }
 
 void CClientSession::do_restore_db() {
@@ -560,21 +971,18 @@ void CClientSession::do_restore_db() {
             LOG(WARNING) <<msg;
         }else{
             auto self = shared_from_this();
-            cli_ptr_vector clients_copy;
-            {
-                boost::recursive_mutex::scoped_lock lk(clients_cs);
-                clients_copy = clients;
-            }
 
             // stop all clients except current
-            for(const auto &it : clients_copy ){
+            for(const auto &it : clients.snapshot() ){
                 if(it != self)
                     it->stop();
             }
 
-            io_context_.post([self, this](){ //async call
+            // stop() of other clients is executed in their strands, after their current call to db.
+            // Waiting is out of strand, so it doesn't block current client
+            background_.post([self, this](){ //async call
                 // wait, before all existing call to db will be complete, and clients go away
-                deadline_timer timer(io_context_);
+                deadline_timer timer(background_);
                 timer.expires_from_now(boost::posix_time::millisec(5000));
                 timer.wait();
 
@@ -590,15 +998,3 @@ void CClientSession::do_restore_db() {
 
     do_write(msg);
 }
-
-void update_clients_changed()
-{
-    cli_ptr_vector clients_copy;
-    {
-        boost::recursive_mutex::scoped_lock lk(clients_cs);
-        clients_copy = clients;
-    }
-
-    for(const auto &it : clients_copy )
-        it->set_clients_changed();
-}
@@ -7,16 +7,28 @@
 #include "glog/logging.h"
 #include "CBusinessLogic.h"
 #include "CBinaryFileReader.h"
+#include "CBackoff.h"
+#include "CBulkLoader.h"
+#include "CConnectionFactory.h"
+#include "CClientRegistry.h"
+#include "CIdleWheel.h"
+#include "CMetrics.h"
+#include "CTrace.h"
+#include "CCommandTable.h"
 
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/algorithm/string.hpp>
 
 #include <string>
 #include <algorithm>
 #include <utility>
+#include <atomic>
+#include <deque>
 
 using namespace boost::asio;
 using namespace boost::posix_time;
@@ -24,15 +36,45 @@ using boost::scoped_array;
 using std::string;
 using std::move;
 
-void update_clients_changed();
-
+// Protocol of client and work with db. Transport is implemented by CSocketSession<Socket>
 class CClientSession : public boost::enable_shared_from_this<CClientSession>
 							, boost::noncopyable{
-private:
+protected:
 	typedef boost::system::error_code error_code;
 	using businessLogic_ptr = boost::shared_ptr<CBusinessLogic>;
 
-    explicit CClientSession(io_context &io_context, size_t maxTimeout, businessLogic_ptr businessLogic);
+	// command of client, that is found by the first word of message (see commands())
+	struct Command {
+		CMetrics::Command metric;
+		bool measured;              // FALSE, if command is finished asynchronously and measures itself
+		bool needsArguments;        // command without arguments gets error instead of handler
+		void (*handler)(CClientSession &session, const string &msg);
+	};
+
+	// QUERY_STATEMENT is prepared and executed as read or write by db->isReadOnly()
+	enum QueryKind { QUERY_STATEMENT, QUERY_BATCH };
+
+	// member, that is called in strand with result of transport operation
+	typedef void (CClientSession::*io_handler)(const error_code &err, size_t bytes);
+
+	// Long blocking jobs (backup, restore) are executed in background context.
+	// Client is stopped by idleWheel, if it has no activity during timeout of wheel
+    explicit CClientSession(io_context &io_context, boost::asio::io_context &background, CIdleWheel::ptr idleWheel, businessLogic_ptr businessLogic);
+
+	// read at least one byte to buf
+	virtual void async_read_some(mutable_buffer buf, io_handler handler) = 0;
+
+	// write all bytes of buf
+	virtual void async_write_all(const_buffer buf, io_handler handler) = 0;
+
+	// cancel reading and writing. Transport is closed by destructor
+	virtual void cancel_io() = 0;
+
+	io_context &io_context_;
+	// all handlers of the session are executed in strand, so members below aren't locked.
+	// Only started_ and username_ are read from other threads
+	io_context::strand strand_;
+
 public:
 
     virtual ~CClientSession();
@@ -42,37 +84,50 @@ public:
 	// init and start do_read()
 	void start();
 
-	// class factory. scoped_array = Return ptr to this class
-	static ptr new_(io_context& io_context, size_t maxTimeout, businessLogic_ptr businessLogic);
+	// count of started clients
+	static size_t count();
 
-	// stop working with current client and remove it from clients
+	// stop working with current client and remove it from clients.
+	// Can be called from any thread: stopping is executed in strand of the session
 	void stop();
 
 	// return started
 	bool started() const;
 
-	// return link to socket of current client
-	ip::tcp::socket& sock();
-
 	// get user name
 	string username() const;
-	
-	// set flag clients changed to true, then client session notify	
-	// its client, that clients list was changed
-	void set_clients_changed();
+
+	// time of last read or write (CIdleWheel::now())
+	int64_t lastActivity() const;
+
+	// push notification of CNotifier. Can be called from any thread
+	void notify(string msg);
 
 private:
+	void do_stop();
+
 	void on_read(const error_code &err, size_t bytes);
 
+	// all commands of clients. New command is registered here, on_read isn't changed
+	static const CCommandTable<Command> &commands();
+
+	void on_update_place_free(const string &msg);
+
+	void on_get_place_free();
+
+	void on_backup();
+
+	// login <user> [compress=deflate]
 	void on_login(const string &msg);
 
 	void on_ping();
 
 	void on_clients();
 
-	void on_check_ping();
+	// subscribe <topic> [<topic>...], unsubscribe [<topic>...]. Topic is name of table or PlaceFree
+	void on_subscribe(const string &msg);
 
-	void post_check_ping();
+	void touch();
 
     void on_backup_chunk_write(const CClientSession::error_code &err, size_t bytes);
 
@@ -80,13 +135,44 @@ private:
 
 		void on_fibo(const string &msg);
 
-	void do_ask_db(string &query);
+	// QUERY_BATCH: query contains several statements, that must be executed in one transaction
+	void do_ask_db(const string &query, QueryKind kind, const CBackoff::ptr &backoff);
+
+	// wait for busy db on timer and call do_ask_db again
+	void post_ask_db(const string &query, QueryKind kind, const CBackoff::ptr &backoff);
+
+	// wait for busy db on timer (delay of backoff) and call retry in strand
+	void post_retry(const CBackoff::ptr &backoff, std::function<void()> retry);
+
+	void on_query(const string &msg, QueryKind kind);
+
+	// begin [deferred|immediate|exclusive], commit, rollback
+	void on_transaction(const string &msg);
+
+	// doesn't block io thread, while db is busy: tries again by post_retry()
+	void do_transaction(const string &msg, const CBackoff::ptr &backoff);
 
-	void on_query(const string &msg);
+	// bulk_begin <table> <column1,column2,...> [rows=N] [ms=M] [sync_off], bulk_rows <rows>, bulk_end
+	void on_bulk(const string &msg);
+
+	// doesn't block io thread, while db is busy: tries again by post_retry()
+	void do_bulk(const string &msg, const CBackoff::ptr &backoff);
 
 	void do_read();
 
-	void do_write(const string &msg, bool read_on_write = true);
+	// can be called from any thread. Messages are sent one by one in order of calls
+	void do_write(string msg, bool read_on_write = true);
+
+	// in strand. Reply is compressed in background context by parts, each part is sent as soon as it is ready.
+	// Client gets "\0deflate <size of reply>\n" and zlib stream (see CDeflater)
+	void do_write_compressed(string reply);
+
+	void do_write_next();
+
+	void on_write(const error_code &err, size_t bytes);
+
+	// remove front of write_queue_, that is written. Return its readOnWrite
+	bool pop_written();
 
 	void do_backup_chunk_write();
 
@@ -98,29 +184,49 @@ private:
 
 private:
 
-	mutable boost::recursive_mutex cs_;
-	enum{ MAX_WRITE_BUFFER = 20971520, MAX_READ_BUFFER = 500*1024 };
-	const size_t maxTimeout_;
+	// parts of reply, that is compressed in background (see do_write_compressed)
+	struct CompressedReply {
+		std::deque<string> parts;   // ready, but not written yet
+		bool complete;              // the last part is in parts
+	};
+
+	struct OutMsg {
+		string data;
+		bool readOnWrite;
+		size_t size;                // counted in WRITE_QUEUE_BYTES
+		boost::shared_ptr<CompressedReply> compressed; // if set, data is the next part of compressed
+		bool backupFile;            // backupReader_ is sent by chunks instead of data (see do_backup_chunk_write)
+	};
+
+	enum{ MAX_READ_BUFFER = 500*1024, COMPRESS_PART = 256*1024,
+		  MAX_FIBO = 93 };                 // the largest fibo, that fits in 64 bits
+	CIdleWheel::ptr idleWheel_;
     //const char endOfMsg[0] = {};
 	const size_t sizeEndOfMsg = 1;
 	scoped_array<char> read_buffer_;
-	scoped_array<char>  write_buffer_;
-	io_context &io_context_;
-	ip::tcp::socket sock_;
-	bool started_;
+	io_context &background_;
+	std::atomic<bool> started_;
+
+	bool reading_;
+	bool writing_;                  // write to transport isn't completed yet
+	bool compressReplies_;          // client asked for compression in login
+	bool lineBreaksRemoved_;        // line breaks were removed from inside of current message (see on_read)
+	std::deque<OutMsg> write_queue_;
+	CMetrics::clock::time_point queryStart_;
+
+	std::atomic<int64_t> lastActivity_;
 
-	boost::posix_time::ptime last_ping_;
-	deadline_timer timer_;
+	boost::shared_ptr<const string> username_; // access by boost::atomic_load/atomic_store
 
-	string username_;
-	bool clients_changed_;
+	uint64_t id_;              // id in registry of clients
+	uint64_t clients_version_; // version of clients list, that client knows
 
-	mutable  boost::recursive_mutex db_;
 	CSQLiteDB::ptr db;
 	const char separator = '|';
 
     businessLogic_ptr businessLogic_;
     CBinaryFileReader backupReader_;
+    CBulkLoader::ptr bulkLoader_;
 
     void do_restore_db();
 };
@@ -0,0 +1,70 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CCOMMANDTABLE_H
+#define CS_MINISQLITESERVER_CCOMMANDTABLE_H
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::string;
+
+/*Table of text commands of clients.
+  Command is found by the first word of message with one hash lookup, so it doesn't depend on order
+  of registration, and 'get_db_backup' doesn't match 'get_db_backup_progress'.
+  Command can be registered with several words (e.g. 'UPDATE Config SET PlaceFree'): message with the same
+  first word, but other beginning, isn't matched (e.g. it is usual SQL)*/
+template<class Handler>
+class CCommandTable {
+public:
+    /*Register command. If prefixes have the same first word, the longest matching one wins*/
+    void add(const string &prefix, Handler handler) {
+        auto &entries = commands_[firstWord(prefix)];
+        entries.emplace_back(prefix, handler);
+
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b){
+            return a.first.size() > b.first.size();
+        });
+    }
+
+    /*Return handler of command or nullptr, if msg isn't command*/
+    const Handler *find(const string &msg) const {
+        auto it = commands_.find(firstWord(msg));
+        if(it == commands_.end())
+            return nullptr;
+
+        for(const Entry &entry : it->second){
+            // the first word is equal, so only multi-word prefix must be compared
+            if(entry.first.size() <= it->first.size() || 0 == msg.compare(0, entry.first.size(), entry.first))
+                return &entry.second;
+        }
+
+        return nullptr;
+    }
+
+    /*The first word of msg. Command starts at the beginning of message, so leading spaces aren't skipped*/
+    static string firstWord(const string &msg) {
+        const auto end = std::find_if(msg.begin(), msg.end(), [](char c){ return std::isspace(static_cast<unsigned char>(c)); });
+        return string(msg.begin(), end);
+    }
+
+    /*Rest of msg after the first word and one space*/
+    static string arguments(const string &msg) {
+        const size_t end = firstWord(msg).size();
+        return end == msg.size() ? string() : msg.substr(end + 1);
+    }
+
+private:
+    using Entry = std::pair<string, Handler>;
+
+    std::unordered_map<string, std::vector<Entry>> commands_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CCOMMANDTABLE_H
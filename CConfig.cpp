@@ -5,6 +5,7 @@
 #include <ctime>
 #include <sys/stat.h>
 #include "glog/logging.h"
+#include "CAsyncLog.h"
 
 using INIWriter = samilton::INIWriter;
 
@@ -21,15 +22,40 @@ CConfig::KeyBindings::KeyBindings(const string exePath)
 	blockOrClusterSize = 4096;
 	waitTimeMillisec = 50;
 	countOfEttempts = 200;
+	busyTimeoutMillisec = 10 * 1000; //10 sec
+	checkpointIntervalMillisec = 1000;
+	walSizeLimitKb = 16 * 1024; //16 Mb
+	cacheSizeKb = 3000;
+	mmapSizeKb = 64 * 1024; //64 Mb
+	tempStore = 0;
+	pageCachePoolKb = 0;
+	softHeapLimitKb = 0;
+	poolAllocator = false;
+	foreignKeys = false;
+	slowQueryMillisec = 200;
+	slowQueryReportIntervalMillisec = 10 * 60 * 1000; //10 min
 
 	ipAdress = "127.0.0.1";
 	port = 65043;
+	localSocketPath = "";
 	threads = 10;
+	ioContextPerCore = false;
+	pinThreads = false;
+	listenBacklog = 1024;
+	pendingAccepts = 4;
+	maxConnections = 0;
+	metricsPort = 0;
+	notifyWindowMillisec = 50;
+	compressMinBytes = 64 * 1024; //64 Kb
+	compressLevel = 1;
     timeoutToDropConnection = 5 * 60 * 1000; //5 min
 
 	logDir = exeFolderPath_ + "logs";
 	logToStdErr = false;
 	stopLoggingIfFullDisk = true;
+	asyncLogging = true;
+	asyncLogBufferSize = 8192;
+	traceFile = "";
 	verbousLog = 0;
 	minLogLevel = 0;
 
@@ -128,6 +154,9 @@ void CConfig::initGlog()
 	#endif // WIN32
 
 	google::InitGoogleLogging(defaultKeyBindings.exeName_.c_str());
+
+	if(keyBindings.asyncLogging && ! keyBindings.logToStdErr)
+		CAsyncLog::Install(static_cast<size_t>(keyBindings.asyncLogBufferSize));
 }
 
 void CConfig::updateKeyBindings() {
@@ -139,10 +168,22 @@ void CConfig::updateKeyBindings() {
 		LOG(WARNING) << "Can't load '" << pathToSettings << "', creating default bindings";
 		saveKeyBindings();
 	} else {
+		// keys, that were added in later versions, can be absent in settings of deployed server: they get defaults.
+		// Only present values, that are out of range, make settings incorrect
 		//Server settings
 		keyBindings.port = settings.GetInteger("ServerSettings", "Port", -1L);
 		keyBindings.threads = settings.GetInteger("ServerSettings", "Threads", -1L);
+		keyBindings.ioContextPerCore = settings.GetBoolean("ServerSettings", "IoContextPerCore", defaultKeyBindings.ioContextPerCore);
+		keyBindings.pinThreads = settings.GetBoolean("ServerSettings", "PinThreads", defaultKeyBindings.pinThreads);
+		keyBindings.listenBacklog = settings.GetInteger("ServerSettings", "ListenBacklog", defaultKeyBindings.listenBacklog);
+		keyBindings.pendingAccepts = settings.GetInteger("ServerSettings", "PendingAccepts", defaultKeyBindings.pendingAccepts);
+		keyBindings.maxConnections = settings.GetInteger("ServerSettings", "MaxConnections", defaultKeyBindings.maxConnections);
+		keyBindings.metricsPort = settings.GetInteger("ServerSettings", "MetricsPort", defaultKeyBindings.metricsPort);
+		keyBindings.notifyWindowMillisec = settings.GetInteger("ServerSettings", "NotifyWindowMillisec", defaultKeyBindings.notifyWindowMillisec);
+		keyBindings.compressMinBytes = settings.GetInteger("ServerSettings", "CompressMinBytes", defaultKeyBindings.compressMinBytes);
+		keyBindings.compressLevel = settings.GetInteger("ServerSettings", "CompressLevel", defaultKeyBindings.compressLevel);
 		keyBindings.ipAdress = settings.Get("ServerSettings", "IpAddress", "0");
+		keyBindings.localSocketPath = settings.Get("ServerSettings", "LocalSocketPath", defaultKeyBindings.localSocketPath);
 		keyBindings.timeoutToDropConnection = settings.GetInteger("ServerSettings", "TimeoutToDropConnection", -1L);
 		//DB settings
 		keyBindings.dbPath = settings.Get("DatabaseSettings", "PathToDatabaseFile", "_a");
@@ -152,19 +193,48 @@ void CConfig::updateKeyBindings() {
 		keyBindings.blockOrClusterSize = settings.GetInteger("DatabaseSettings", "BlockOrClusterSize", -1L);
 		keyBindings.waitTimeMillisec = settings.GetInteger("DatabaseSettings", "WaitTimeMillisec", -1L);
 		keyBindings.countOfEttempts = settings.GetInteger("DatabaseSettings", "CountOfAttempts", -1L);
+		keyBindings.busyTimeoutMillisec = settings.GetInteger("DatabaseSettings", "BusyTimeoutMillisec", defaultKeyBindings.busyTimeoutMillisec);
+		keyBindings.checkpointIntervalMillisec = settings.GetInteger("DatabaseSettings", "CheckpointIntervalMillisec", defaultKeyBindings.checkpointIntervalMillisec);
+		keyBindings.walSizeLimitKb = settings.GetInteger("DatabaseSettings", "WalSizeLimitKb", defaultKeyBindings.walSizeLimitKb);
+		keyBindings.cacheSizeKb = settings.GetInteger("DatabaseSettings", "CacheSizeKb", defaultKeyBindings.cacheSizeKb);
+		keyBindings.mmapSizeKb = settings.GetInteger("DatabaseSettings", "MmapSizeKb", defaultKeyBindings.mmapSizeKb);
+		keyBindings.tempStore = settings.GetInteger("DatabaseSettings", "TempStore", defaultKeyBindings.tempStore);
+		keyBindings.pageCachePoolKb = settings.GetInteger("DatabaseSettings", "PageCachePoolKb", defaultKeyBindings.pageCachePoolKb);
+		keyBindings.softHeapLimitKb = settings.GetInteger("DatabaseSettings", "SoftHeapLimitKb", defaultKeyBindings.softHeapLimitKb);
+		keyBindings.poolAllocator = settings.GetBoolean("DatabaseSettings", "PoolAllocator", defaultKeyBindings.poolAllocator);
+		keyBindings.foreignKeys = settings.GetBoolean("DatabaseSettings", "ForeignKeys", defaultKeyBindings.foreignKeys);
+		keyBindings.slowQueryMillisec = settings.GetInteger("DatabaseSettings", "SlowQueryMillisec", defaultKeyBindings.slowQueryMillisec);
+		keyBindings.slowQueryReportIntervalMillisec = settings.GetInteger("DatabaseSettings", "SlowQueryReportIntervalMillisec", defaultKeyBindings.slowQueryReportIntervalMillisec);
 		//Log settings
 		keyBindings.logDir = settings.Get("LogSettings", "LogDir", "_a");
 		keyBindings.logToStdErr = settings.GetBoolean("LogSettings", "LogToStdErr", false);
 		keyBindings.stopLoggingIfFullDisk = settings.GetBoolean("LogSettings", "StopLoggingIfFullDisk", false);
+		keyBindings.asyncLogging = settings.GetBoolean("LogSettings", "AsyncLogging", defaultKeyBindings.asyncLogging);
+		keyBindings.asyncLogBufferSize = settings.GetInteger("LogSettings", "AsyncLogBufferSize", defaultKeyBindings.asyncLogBufferSize);
+		keyBindings.traceFile = settings.Get("LogSettings", "TraceFile", defaultKeyBindings.traceFile);
 		keyBindings.verbousLog = settings.GetInteger("LogSettings", "DeepLogging", 0L);
 		keyBindings.minLogLevel = settings.GetInteger("LogSettings", "MinLogLevel", 0L);
 		//Service settings (only for windows)
 		keyBindings.serviceName = settings.Get("ServiceSettings", "ServiceName", "_a");
 
 		if (keyBindings.port <= 0L || keyBindings.threads <= 0L || keyBindings.ipAdress == "0"
+			|| keyBindings.listenBacklog <= 0L || keyBindings.pendingAccepts <= 0L || keyBindings.maxConnections < 0L
+			|| keyBindings.metricsPort < 0L || keyBindings.metricsPort > 65535L
+			|| keyBindings.notifyWindowMillisec < 0L
+			|| keyBindings.compressMinBytes < 0L || keyBindings.compressLevel < 1L || keyBindings.compressLevel > 9L
 			|| keyBindings.blockOrClusterSize == -1L || keyBindings.countOfEttempts <= 0L
 			|| keyBindings.waitTimeMillisec <= 0L
+			|| keyBindings.busyTimeoutMillisec <= 0L
+			|| keyBindings.checkpointIntervalMillisec < 0L
+			|| keyBindings.walSizeLimitKb <= 0L
+			|| keyBindings.cacheSizeKb <= 0L
+			|| keyBindings.mmapSizeKb < 0L
+			|| keyBindings.tempStore < 0L || keyBindings.tempStore > 2L
+			|| keyBindings.pageCachePoolKb < 0L
+			|| keyBindings.softHeapLimitKb < 0L
+			|| keyBindings.slowQueryMillisec < 0L || keyBindings.slowQueryReportIntervalMillisec <= 0L
 			|| keyBindings.timeoutToDropConnection <= 0L
+			|| keyBindings.asyncLogBufferSize <= 0L
 			|| keyBindings.newBackupTimeoutMillisec <= 0L
 			|| keyBindings.dbPath == "_a"
 			|| keyBindings.restoreDbPath == "_a"
@@ -210,8 +280,18 @@ void CConfig::saveKeyBindings() {
 
 	//Server settings
 	settings["ServerSettings"]["Port"] = defaultKeyBindings.port;
-	settings["ServerSettings"]["Threads"] = defaultKeyBindings.threads;
+	settings["ServerSettings"]["Threads"]("Count of threads. If IoContextPerCore, each thread has own io_context and acceptor") = defaultKeyBindings.threads;
+	settings["ServerSettings"]["IoContextPerCore"]("Client is served only by thread, that accepted it (SO_REUSEPORT). Otherwise all threads serve all clients") = defaultKeyBindings.ioContextPerCore;
+	settings["ServerSettings"]["PinThreads"]("Bind thread of each io_context to own core. Works only with IoContextPerCore") = defaultKeyBindings.pinThreads;
+	settings["ServerSettings"]["ListenBacklog"]("Max count of connections, that wait for accepting (limited by OS)") = defaultKeyBindings.listenBacklog;
+	settings["ServerSettings"]["PendingAccepts"]("Count of connections, that each acceptor can accept at the same time") = defaultKeyBindings.pendingAccepts;
+	settings["ServerSettings"]["MaxConnections"]("Clients over this limit get 'Server is busy' and are disconnected. 0 - no limit") = defaultKeyBindings.maxConnections;
+	settings["ServerSettings"]["MetricsPort"]("Port on 127.0.0.1, that returns 'stats' by HTTP GET (Prometheus format). 0 - disabled") = defaultKeyBindings.metricsPort;
+	settings["ServerSettings"]["NotifyWindowMillisec"]("Changes of db during this time are sent to subscribed client by one notification. 0 - notifications are disabled") = defaultKeyBindings.notifyWindowMillisec;
+	settings["ServerSettings"]["CompressMinBytes"]("Answers of queries from this size are compressed for clients, that asked for it in login. 0 - disabled") = defaultKeyBindings.compressMinBytes;
+	settings["ServerSettings"]["CompressLevel"]("zlib level of compression: 1 - fastest, 9 - smallest") = defaultKeyBindings.compressLevel;
 	settings["ServerSettings"]["IpAddress"] = defaultKeyBindings.ipAdress;
+	settings["ServerSettings"]["LocalSocketPath"]("Unix domain socket for clients on the same host (besides TCP). Empty - disabled") = defaultKeyBindings.localSocketPath;
 	settings["ServerSettings"]["TimeoutToDropConnection"]("5 min") = defaultKeyBindings.timeoutToDropConnection;
 	//DB settings
 	settings["DatabaseSettings"]["PathToDatabaseFile"] = defaultKeyBindings.dbPath;
@@ -219,12 +299,27 @@ void CConfig::saveKeyBindings() {
 	settings["DatabaseSettings"]["PathToDatabaseRestoreFile"] = defaultKeyBindings.restoreDbPath;
 	settings["DatabaseSettings"]["NewBackupTimeMillisec"]("Timeout before next backup can be created") = defaultKeyBindings.newBackupTimeoutMillisec;
 	settings["DatabaseSettings"]["BlockOrClusterSize"]("Set, according to your file system block/cluster size. This make sqlite db more faster") = defaultKeyBindings.blockOrClusterSize;
-	settings["DatabaseSettings"]["WaitTimeMillisec"]("Time, that thread waiting before next attempt to begin 'write transaction'") = defaultKeyBindings.waitTimeMillisec;
+	settings["DatabaseSettings"]["WaitTimeMillisec"]("Time, that thread waiting before first retry to begin 'write transaction'. Each next wait is twice longer (with random jitter)") = defaultKeyBindings.waitTimeMillisec;
 	settings["DatabaseSettings"]["CountOfAttempts"]("Number of attempts to begin 'write transaction'") = defaultKeyBindings.countOfEttempts;
+	settings["DatabaseSettings"]["BusyTimeoutMillisec"]("Max time, that one query waits for busy db. After timeout client get error") = defaultKeyBindings.busyTimeoutMillisec;
+	settings["DatabaseSettings"]["CheckpointIntervalMillisec"]("How often background thread checks WAL file and makes checkpoint. 0 - checkpoints are made by sqlite on COMMIT") = defaultKeyBindings.checkpointIntervalMillisec;
+	settings["DatabaseSettings"]["WalSizeLimitKb"]("If WAL file grows over it, RESTART checkpoint is made (waits for readers and writers). When db is idle, WAL file is truncated") = defaultKeyBindings.walSizeLimitKb;
+	settings["DatabaseSettings"]["CacheSizeKb"]("Page cache of one connection (client)") = defaultKeyBindings.cacheSizeKb;
+	settings["DatabaseSettings"]["MmapSizeKb"]("Part of db file, that is read through memory-mapped I/O. 0 - disabled") = defaultKeyBindings.mmapSizeKb;
+	settings["DatabaseSettings"]["TempStore"]("Where temporary tables and indices are stored: 0 - default, 1 - file, 2 - memory") = defaultKeyBindings.tempStore;
+	settings["DatabaseSettings"]["PageCachePoolKb"]("Memory, that is reserved at start for page cache of all connections. 0 - page cache uses heap") = defaultKeyBindings.pageCachePoolKb;
+	settings["DatabaseSettings"]["SoftHeapLimitKb"]("Sqlite frees page cache, when all its memory exceeds this limit. 0 - no limit") = defaultKeyBindings.softHeapLimitKb;
+	settings["DatabaseSettings"]["PoolAllocator"]("Sqlite allocates memory from pools with per-thread caches instead of malloc") = defaultKeyBindings.poolAllocator;
+	settings["DatabaseSettings"]["ForeignKeys"]("Enforce FOREIGN KEY constraints (PRAGMA foreign_keys). Off by default, as in sqlite") = defaultKeyBindings.foreignKeys;
+	settings["DatabaseSettings"]["SlowQueryMillisec"]("Statements, that take longer, are logged with query plan. 0 - slow query log is disabled") = defaultKeyBindings.slowQueryMillisec;
+	settings["DatabaseSettings"]["SlowQueryReportIntervalMillisec"]("How often summary of slow queries (grouped by statement without literals) is logged") = defaultKeyBindings.slowQueryReportIntervalMillisec;
 	//Log settings
 	settings["LogSettings"]["LogDir"] = defaultKeyBindings.logDir;
 	settings["LogSettings"]["LogToStdErr"] = defaultKeyBindings.logToStdErr;
 	settings["LogSettings"]["StopLoggingIfFullDisk"] = defaultKeyBindings.stopLoggingIfFullDisk;
+	settings["LogSettings"]["AsyncLogging"]("Log files are written by background thread, so slow disk doesn't delay clients. Doesn't affect LogToStdErr") = defaultKeyBindings.asyncLogging;
+	settings["LogSettings"]["AsyncLogBufferSize"]("Count of messages, that wait for background thread. Messages over it are dropped (and counted in stats)") = defaultKeyBindings.asyncLogBufferSize;
+	settings["LogSettings"]["TraceFile"]("Every received message of clients is captured to this file for replay (CS_MiniSQLiteServer_replay). File of previous run is renamed with time suffix. Empty - disabled") = defaultKeyBindings.traceFile;
 	settings["LogSettings"]["DeepLogging"] = defaultKeyBindings.verbousLog;
 	settings["LogSettings"]["MinLogLevel"] = defaultKeyBindings.minLogLevel;
 	//Service settings (only for windows)
@@ -26,15 +26,40 @@ private:
 		long blockOrClusterSize;
 		long waitTimeMillisec;
 		long countOfEttempts;
+		long busyTimeoutMillisec;
+		long checkpointIntervalMillisec;
+		long walSizeLimitKb;
+		long cacheSizeKb;
+		long mmapSizeKb;
+		long tempStore;
+		long pageCachePoolKb;
+		long softHeapLimitKb;
+		bool poolAllocator;
+		bool foreignKeys;
+		long slowQueryMillisec;
+		long slowQueryReportIntervalMillisec;
 
 		string ipAdress;
 		long port;
+		string localSocketPath;
 		long threads;
+		bool ioContextPerCore;
+		bool pinThreads;
+		long listenBacklog;
+		long pendingAccepts;
+		long maxConnections;
+		long metricsPort;
+		long notifyWindowMillisec;
+		long compressMinBytes;
+		long compressLevel;
 		long  timeoutToDropConnection;
 
 		string logDir;
 		bool logToStdErr;
 		bool stopLoggingIfFullDisk;
+		bool asyncLogging;
+		long asyncLogBufferSize;
+		string traceFile;
 		long verbousLog;
 		long minLogLevel;
 
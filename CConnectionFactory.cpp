@@ -0,0 +1,172 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CConnectionFactory.h"
+#include "CSQLiteAllocator.h"
+#include "CNotifier.h"
+#include "CMetrics.h"
+
+#include <cstdlib>
+#include <mutex>
+
+// without Init() connections are set up as before: 3 Mb of cache, no mmap
+CConnectionFactory::Settings CConnectionFactory::settings_ = { 4096, 3000, 0, 0, 0, 0, true, false };
+std::unique_ptr<char[]> CConnectionFactory::pageCachePool_;
+
+bool CConnectionFactory::Init(const Settings &settings) {
+    settings_ = settings;
+
+    size_t slotSize = 0, slots = 0;
+
+    if(settings_.poolAllocator){
+        // sqlite counts memory under global mutex on each allocation, it makes thread caches of allocator useless.
+        // Without memory counting soft heap limit doesn't work
+        sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0);
+
+        if(! CSQLiteAllocator::Install())
+            LOG(WARNING) << "SQLITE: can't install pool allocator, sqlite is already initialized";
+
+        LOG_IF(WARNING, settings_.softHeapLimit > 0) << "SQLITE: soft heap limit is ignored, when pool allocator is used";
+    }
+
+    if(settings_.pageCacheSize > 0){
+        // each page in cache has header, size of it depends on sqlite version
+        int headerSize = 0;
+        sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &headerSize);
+
+        slotSize = (static_cast<size_t>(settings_.pageSize) + static_cast<size_t>(headerSize) + 7) & ~static_cast<size_t>(7);
+        slots = static_cast<size_t>(settings_.pageCacheSize) / slotSize;
+
+        pageCachePool_.reset(new char[slotSize * slots]);
+
+        // pages, that don't fit in pool, are allocated by sqlite3_malloc
+        if(SQLITE_OK != sqlite3_config(SQLITE_CONFIG_PAGECACHE, pageCachePool_.get(), static_cast<int>(slotSize), static_cast<int>(slots))){
+            LOG(WARNING) << "SQLITE: can't set page cache pool, sqlite is already initialized";
+            pageCachePool_.reset();
+            slots = 0;
+        }
+    }
+
+    int rc = sqlite3_initialize();
+    if(SQLITE_OK != rc){
+        LOG(WARNING) << "SQLITE: can't initialize sqlite: " << sqlite3_errstr(rc);
+        return false;
+    }
+
+    if(settings_.softHeapLimit > 0)
+        sqlite3_soft_heap_limit64(settings_.softHeapLimit);
+
+    const sqlite3_int64 softHeapLimit = sqlite3_soft_heap_limit64(-1);
+
+    LOG(INFO) << "SQLite memory: page cache pool " << (slots * slotSize / 1024) << "Kb (" << slots << " pages by " << slotSize << " bytes)"
+              << ", soft heap limit " << (softHeapLimit > 0 ? std::to_string(softHeapLimit / 1024) + "Kb" : string("none"))
+              << ". Per connection: cache " << settings_.cacheSizeKb << "Kb"
+              << ", mmap " << (settings_.mmapSize / 1024) << "Kb"
+              << ", temp_store " << settings_.tempStore
+              << ", foreign_keys " << settings_.foreignKeys
+              << ". Allocator: " << (CSQLiteAllocator::isInstalled() ? "pools" : "malloc");
+
+    return true;
+}
+
+CSQLiteDB::ptr CConnectionFactory::NewConnection(const string &dbPath, size_t sqlEttempts, size_t sqlWaitTime, size_t sqlBusyTimeout) {
+    static std::once_flag reported;
+
+    CSQLiteDB::ptr db = CSQLiteDB::new_(dbPath, sqlEttempts, sqlWaitTime, sqlBusyTimeout);
+    db->setOpenScript(GetOpenScript());
+    WatchChanges(db);
+
+    if(! db->OpenConnection()){
+        LOG(WARNING) << "ERROR: can't connect to db: " << db->GetLastError();
+        return db;
+    }
+
+    std::call_once(reported, [&db]{ ReportEffectiveSettings(db); });
+
+    return db;
+}
+
+void CConnectionFactory::WatchChanges(const CSQLiteDB::ptr &db) {
+    // without notifier hooks aren't installed, so writes don't pay for them
+    if( ! CNotifier::isEnabled() )
+        return;
+
+    db->setChangesFunction([](const std::vector<string> &tables){ CNotifier::Publish(tables); });
+}
+
+string CConnectionFactory::GetMemoryStats() {
+    sqlite3_int64 current = 0, highwater = 0;
+    string stats;
+
+    // without SQLITE_CONFIG_MEMSTATUS sqlite returns 0
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &current, &highwater, 0);
+    CMetrics::renderGauge(stats, "minisqlite_sqlite_memory_used_bytes", current);
+    CMetrics::renderGauge(stats, "minisqlite_sqlite_memory_highwater_bytes", highwater);
+
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_USED, &current, &highwater, 0);
+    CMetrics::renderGauge(stats, "minisqlite_sqlite_pagecache_pool_used_pages", current);
+
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &current, &highwater, 0);
+    CMetrics::renderGauge(stats, "minisqlite_sqlite_pagecache_overflow_bytes", current);
+
+    CMetrics::renderGauge(stats, "minisqlite_allocator_enabled", CSQLiteAllocator::isInstalled() ? 1 : 0);
+    if(! CSQLiteAllocator::isInstalled())
+        return stats;
+
+    const CSQLiteAllocator::Stats allocator = CSQLiteAllocator::GetStats();
+
+    CMetrics::renderCounter(stats, "minisqlite_allocator_alloc_total", allocator.allocCount);
+    CMetrics::renderCounter(stats, "minisqlite_allocator_free_total", allocator.freeCount);
+    CMetrics::renderGauge(stats, "minisqlite_allocator_in_use_bytes", allocator.inUseBytes);
+    CMetrics::renderGauge(stats, "minisqlite_allocator_pool_bytes", allocator.poolBytes);
+    CMetrics::renderCounter(stats, "minisqlite_allocator_large_alloc_total", allocator.largeAllocCount);
+    CMetrics::renderGauge(stats, "minisqlite_allocator_large_in_use_bytes", allocator.largeInUseBytes);
+    CMetrics::renderCounter(stats, "minisqlite_allocator_refill_total", allocator.refillCount);
+    CMetrics::renderCounter(stats, "minisqlite_allocator_flush_total", allocator.flushCount);
+    CMetrics::renderGauge(stats, "minisqlite_allocator_thread_caches", allocator.threadCaches);
+
+    return stats;
+}
+
+string CConnectionFactory::GetOpenScript() {
+    // page_size and encoding must be set before db is created
+    string script("PRAGMA page_size = " + std::to_string(settings_.pageSize) + "; PRAGMA encoding = \"UTF-8\"; "
+                  "PRAGMA journal_mode = WAL; PRAGMA foreign_keys = " + std::to_string(settings_.foreignKeys ? 1 : 0) + ";"
+                  " PRAGMA cache_size = -" + std::to_string(settings_.cacheSizeKb) + ";"
+                  " PRAGMA mmap_size = " + std::to_string(settings_.mmapSize) + ";"
+                  " PRAGMA temp_store = " + std::to_string(settings_.tempStore) + ";");
+
+    // checkpoints are made by CCheckpointScheduler, so COMMIT of client never runs checkpoint
+    if(! settings_.autoCheckpoint)
+        script += " PRAGMA wal_autocheckpoint = 0;";
+
+    return script;
+}
+
+void CConnectionFactory::ReportEffectiveSettings(const CSQLiteDB::ptr &db) {
+    auto pragma = [&db](const char *sqlQuery) -> long long {
+        long long value = -1;
+        IResult *res = db->ExecuteSelect(sqlQuery);
+        if(res){
+            if(res->Next() && res->ColomnData(0))
+                value = std::atoll(res->ColomnData(0));
+            res->ReleaseStatement();
+        }
+        return value;
+    };
+
+    const long long pageSize = pragma("PRAGMA page_size;");
+    const long long mmapSize = pragma("PRAGMA mmap_size;");
+
+    LOG(INFO) << "SQLite connection: page_size " << pageSize
+              << ", cache_size " << pragma("PRAGMA cache_size;")
+              << ", mmap_size " << mmapSize
+              << ", temp_store " << pragma("PRAGMA temp_store;");
+
+    LOG_IF(WARNING, mmapSize < settings_.mmapSize) << "SQLITE: mmap_size is limited to " << mmapSize
+                                                   << " bytes (see SQLITE_MAX_MMAP_SIZE)";
+
+    LOG_IF(WARNING, pageCachePool_ && pageSize > settings_.pageSize) << "SQLITE: page size of db (" << pageSize
+                                                                     << ") is bigger, than BlockOrClusterSize. Page cache pool won't be used";
+}
@@ -0,0 +1,60 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CCONNECTIONFACTORY_H
+#define CS_MINISQLITESERVER_CCONNECTIONFACTORY_H
+#pragma once
+
+#include "CSQLiteDB.h"
+
+#include <memory>
+#include <string>
+
+using std::string;
+
+/*Creates connections of clients with the same memory and journal settings.
+  Global settings (page cache pool, soft heap limit) are applied once by Init(),
+  per connection settings (cache_size, mmap_size, temp_store...) - on every (re)connect*/
+class CConnectionFactory {
+public:
+    struct Settings {
+        long pageSize;              // PRAGMA page_size (only for new db)
+        long cacheSizeKb;           // PRAGMA cache_size of one connection
+        long long mmapSize;         // PRAGMA mmap_size in bytes. 0 - memory-mapped I/O is disabled
+        long tempStore;             // PRAGMA temp_store: 0 - default, 1 - file, 2 - memory
+        long long pageCacheSize;    // size of page cache pool, shared by all connections (SQLITE_CONFIG_PAGECACHE). 0 - no pool
+        long long softHeapLimit;    // sqlite3_soft_heap_limit64. 0 - no limit
+        bool autoCheckpoint;        // FALSE, if WAL is checkpointed by CCheckpointScheduler
+        bool poolAllocator;         // use CSQLiteAllocator instead of malloc
+        bool foreignKeys;           // PRAGMA foreign_keys
+    };
+
+    CConnectionFactory() = delete;
+
+    /*Must be called before any connection is opened, because sqlite3_config() fails after sqlite3_initialize().
+    Logs report of reserved memory. Return FALSE, if sqlite can't be initialized*/
+    static bool Init(const Settings &settings);
+
+    /*Create connection and open it. Check isConnected() of result*/
+    static CSQLiteDB::ptr NewConnection(const string &dbPath, size_t sqlEttempts, size_t sqlWaitTime, size_t sqlBusyTimeout);
+
+    /*Tables, that are changed by db, are published to subscribers of clients (see CNotifier).
+    Connections of NewConnection() are already watched*/
+    static void WatchChanges(const CSQLiteDB::ptr &db);
+
+    /*Return memory stats of sqlite and its allocator in Prometheus text format (see CMetrics)*/
+    static string GetMemoryStats();
+
+private:
+    static string GetOpenScript();
+
+    /*Log values of PRAGMAs, that sqlite really uses (e.g. mmap_size is limited by SQLITE_MAX_MMAP_SIZE)*/
+    static void ReportEffectiveSettings(const CSQLiteDB::ptr &db);
+
+    static Settings settings_;
+    static std::unique_ptr<char[]> pageCachePool_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CCONNECTIONFACTORY_H
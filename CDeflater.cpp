@@ -0,0 +1,98 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CDeflater.h"
+
+#include <algorithm>
+#include <climits>
+
+const char *const CDeflater::NAME = "deflate";
+
+#ifdef HAVE_ZLIB
+
+bool CDeflater::isAvailable() {
+    return true;
+}
+
+CDeflater::CDeflater(int level)
+        : stream_()
+        , initialized_(false)
+{
+    const int res = deflateInit(&stream_, std::min(std::max(level, 1), 9));
+    if(res != Z_OK){
+        strLastError_ = "deflateInit failed: " + std::to_string(res);
+        return;
+    }
+
+    initialized_ = true;
+}
+
+CDeflater::~CDeflater() {
+    if(initialized_)
+        deflateEnd(&stream_);
+}
+
+bool CDeflater::compress(const char *data, size_t size, bool finish, string &out) {
+    if( ! initialized_ )
+        return false;
+
+    // avail_in is uInt, so huge part is given by pieces
+    while(size > 0 || finish){
+        const uInt in = static_cast<uInt>(std::min<size_t>(size, UINT_MAX));
+        const bool last = finish && in == size;
+
+        stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream_.avail_in = in;
+
+        int res;
+        do {
+            const size_t used = out.size();
+            out.resize(used + OUT_CHUNK);
+            stream_.next_out = reinterpret_cast<Bytef *>(&out[used]);
+            stream_.avail_out = OUT_CHUNK;
+
+            res = deflate(&stream_, last ? Z_FINISH : Z_SYNC_FLUSH);
+            out.resize(used + OUT_CHUNK - stream_.avail_out);
+
+            if(res == Z_STREAM_ERROR){
+                strLastError_ = "deflate failed: " + string(stream_.msg ? stream_.msg : "stream error");
+                return false;
+            }
+        // output buffer was filled, so there can be more output
+        } while(stream_.avail_out == 0 || (last && res != Z_STREAM_END));
+
+        data += in;
+        size -= in;
+        if(last)
+            break;
+    }
+
+    return true;
+}
+
+#else
+
+bool CDeflater::isAvailable() {
+    return false;
+}
+
+CDeflater::CDeflater(int level)
+        : initialized_(false)
+        , strLastError_("server is built without zlib")
+{
+    (void)level;
+}
+
+CDeflater::~CDeflater() = default;
+
+bool CDeflater::compress(const char *data, size_t size, bool finish, string &out) {
+    (void)data, (void)size, (void)finish, (void)out;
+    return false;
+}
+
+#endif
+
+const string &CDeflater::getLastError() const {
+    return strLastError_;
+}
@@ -0,0 +1,52 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CDEFLATER_H
+#define CS_MINISQLITESERVER_CDEFLATER_H
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using std::string;
+
+/*Streaming zlib (RFC 1950) compression of one reply.
+  Reply is given by parts, compressed data of each part are returned at once (Z_SYNC_FLUSH),
+  so they can be sent, while next part is compressed. The last part finishes zlib stream:
+  client inflates until Z_STREAM_END and knows, where compressed reply ends.
+  Without HAVE_ZLIB server is built without compression: isAvailable() returns FALSE*/
+class CDeflater : boost::noncopyable {
+public:
+    static const char *const NAME;  // name of compression in login
+
+    /*Return FALSE, if server is built without zlib. Then replies aren't compressed*/
+    static bool isAvailable();
+
+    // level: 1 (fastest) - 9 (smallest)
+    explicit CDeflater(int level);
+
+    ~CDeflater();
+
+    /*Append compressed data of part to out. finish - part is the last one.
+      Return FALSE on error (see getLastError())*/
+    bool compress(const char *data, size_t size, bool finish, string &out);
+
+    const string &getLastError() const;
+
+private:
+    enum { OUT_CHUNK = 16 * 1024 };
+
+#ifdef HAVE_ZLIB
+    z_stream stream_;
+#endif
+    bool initialized_;
+    string strLastError_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CDEFLATER_H
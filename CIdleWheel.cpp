@@ -0,0 +1,118 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CIdleWheel.h"
+#include "CClientSession.h"
+
+#include <algorithm>
+#include <chrono>
+
+CIdleWheel::ptr CIdleWheel::new_(boost::asio::io_context &io_context, size_t timeoutMs) {
+    return boost::make_shared<CIdleWheel>(io_context, timeoutMs);
+}
+
+CIdleWheel::CIdleWheel(boost::asio::io_context &io_context, size_t timeoutMs)
+        : timeout_(static_cast<int64_t>(timeoutMs))
+        , tick_(std::min<int64_t>(std::max<int64_t>(timeout_ / SLOTS_PER_TIMEOUT, MIN_TICK), MAX_TICK))
+        , timer_(io_context)
+        // +1 slot for rounding of expiry up to tick and +1 for current slot
+        , slots_(static_cast<size_t>(timeout_ / tick_ + 2))
+        , currentSlot_(0)
+        , currentSlotTime_(now() + tick_)
+{}
+
+void CIdleWheel::start() {
+    post_tick();
+}
+
+void CIdleWheel::add(const client_ptr &client) {
+    const int64_t expiry = client->lastActivity() + timeout_;
+
+    boost::mutex::scoped_lock lk(cs_);
+    slots_[slot_of(expiry)].push_back(client);
+}
+
+int64_t CIdleWheel::now() {
+    using std::chrono::steady_clock;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+size_t CIdleWheel::timeout() const {
+    return static_cast<size_t>(timeout_);
+}
+
+void CIdleWheel::post_tick() {
+    // currentSlotTime_ is changed only by on_tick(), that is called by this timer
+    const int64_t delay = std::max<int64_t>(currentSlotTime_ - now(), 0);
+
+    timer_.expires_from_now(boost::posix_time::millisec(delay));
+    timer_.async_wait(boost::bind(&CIdleWheel::on_tick, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void CIdleWheel::on_tick(const boost::system::error_code &err) {
+    if( err )
+        return;
+
+    const int64_t time = now();
+    std::vector<client_weak_ptr> due;
+
+    {
+        boost::mutex::scoped_lock lk(cs_);
+
+        // timer can be late, so check all passed slots
+        for(size_t i = 0; i < slots_.size() && currentSlotTime_ <= time; ++i){
+            std::vector<client_weak_ptr> &slot = slots_[currentSlot_];
+            due.insert(due.end(), slot.begin(), slot.end());
+            slot.clear();
+
+            currentSlot_ = (currentSlot_ + 1) % slots_.size();
+            currentSlotTime_ += tick_;
+        }
+
+        // all slots were checked (e.g. after sleep of OS)
+        if(currentSlotTime_ <= time)
+            currentSlotTime_ = time + tick_;
+    }
+
+    std::vector<client_ptr> expired;
+    std::vector<std::pair<client_weak_ptr, int64_t>> active;
+
+    for(const auto &it : due){
+        client_ptr client = it.lock();
+        if( ! client || ! client->started() )
+            continue;
+
+        const int64_t lastActivity = client->lastActivity();
+
+        if(time - lastActivity >= timeout_){
+            expired.push_back(client);
+        }else{
+            active.emplace_back(it, lastActivity + timeout_);
+        }
+    }
+
+    {
+        boost::mutex::scoped_lock lk(cs_);
+        for(const auto &it : active)
+            slots_[slot_of(it.second)].push_back(it.first);
+    }
+
+    for(const auto &client : expired){
+        VLOG(1) << "DEBUG: stopping: " << client->username() << " - no ping in time " << (time - client->lastActivity());
+        client->stop();
+    }
+
+    post_tick();
+}
+
+size_t CIdleWheel::slot_of(int64_t expiry) const {
+    // slot, that is checked not earlier than expiry
+    int64_t ticks = 0;
+    if(expiry > currentSlotTime_)
+        ticks = (expiry - currentSlotTime_ + tick_ - 1) / tick_;
+
+    ticks = std::min<int64_t>(ticks, static_cast<int64_t>(slots_.size()) - 1);
+
+    return (currentSlot_ + static_cast<size_t>(ticks)) % slots_.size();
+}
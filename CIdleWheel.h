@@ -0,0 +1,71 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CIDLEWHEEL_H
+#define CS_MINISQLITESERVER_CIDLEWHEEL_H
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <vector>
+
+class CClientSession;
+
+/*Timing wheel, that stops clients without activity during timeout.
+  Client only stores time of its last activity (atomic), so activity costs nothing for the wheel.
+  Wheel has slots for one timeout period, client is put in slot of its expected expiry.
+  On each tick clients of current slot are checked: idle clients are stopped,
+  active ones are moved to slot of their new expiry. So each client is checked about once per timeout*/
+class CIdleWheel : public boost::enable_shared_from_this<CIdleWheel>
+                 , boost::noncopyable {
+    enum { SLOTS_PER_TIMEOUT = 16, MIN_TICK = 10, MAX_TICK = 1000 };
+    using client_ptr = boost::shared_ptr<CClientSession>;
+    using client_weak_ptr = boost::weak_ptr<CClientSession>;
+
+public:
+    typedef boost::shared_ptr<CIdleWheel> ptr;
+
+    /*Class factory. Clients are stopped after timeoutMs (+ one tick) without activity*/
+    static ptr new_(boost::asio::io_context &io_context, size_t timeoutMs);
+
+    explicit CIdleWheel(boost::asio::io_context &io_context, size_t timeoutMs);
+
+    /*Start ticking in io_context*/
+    void start();
+
+    /*Track client until it is stopped. Client must return time of last activity by lastActivity()*/
+    void add(const client_ptr &client);
+
+    /*Monotonic time in ms, that clients use for activity*/
+    static int64_t now();
+
+    size_t timeout() const;
+
+private:
+    void post_tick();
+
+    void on_tick(const boost::system::error_code &err);
+
+    // index of slot, that will be checked after expiry. Must be called under lock
+    size_t slot_of(int64_t expiry) const;
+
+    const int64_t timeout_;
+    const int64_t tick_;
+
+    boost::asio::deadline_timer timer_;
+
+    boost::mutex cs_;
+    std::vector<std::vector<client_weak_ptr>> slots_;
+    size_t currentSlot_;
+    int64_t currentSlotTime_; // time, when current slot is checked
+};
+
+
+#endif //CS_MINISQLITESERVER_CIDLEWHEEL_H
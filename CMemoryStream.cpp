@@ -0,0 +1,166 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CMemoryStream.h"
+
+#include <algorithm>
+#include <cstring>
+
+CMemoryStream::Pipe::Pipe()
+        : head(0)
+        , closed(false)
+{}
+
+CMemoryStream::CMemoryStream(boost::asio::io_context &io_context)
+        : executor_(io_context.get_executor())
+{}
+
+CMemoryStream::~CMemoryStream() {
+    error_code err;
+    close(err);
+}
+
+CMemoryStream::executor_type CMemoryStream::get_executor() {
+    return executor_;
+}
+
+void CMemoryStream::Connect(CMemoryStream &first, CMemoryStream &second) {
+    first.out_ = second.in_ = std::make_shared<Pipe>();
+    first.in_ = second.out_ = std::make_shared<Pipe>();
+}
+
+bool CMemoryStream::is_open() const {
+    if( ! in_ )
+        return false;
+
+    std::lock_guard<std::mutex> lock(in_->cs);
+    return ! in_->closed;
+}
+
+void CMemoryStream::cancel(error_code &err) {
+    err = error_code();
+    if( ! in_ )
+        return;
+
+    completion reader;
+    {
+        std::lock_guard<std::mutex> lock(in_->cs);
+        reader.swap(in_->reader);
+    }
+
+    if(reader)
+        reader(boost::asio::error::operation_aborted, 0);
+}
+
+void CMemoryStream::close(error_code &err) {
+    cancel(err);
+    if( ! in_ )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(in_->cs);
+        in_->closed = true;
+        in_->data.clear();
+        in_->head = 0;
+    }
+
+    // reading of other side waits for data, that won't be written
+    completion reader;
+    {
+        std::lock_guard<std::mutex> lock(out_->cs);
+        out_->closed = true;
+        if(out_->head == out_->data.size())
+            reader.swap(out_->reader);
+    }
+
+    if(reader)
+        reader(boost::asio::error::eof, 0);
+}
+
+void CMemoryStream::read(std::vector<boost::asio::mutable_buffer> buffers, completion done) {
+    if( ! in_ ){
+        done(boost::asio::error::not_connected, 0);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(in_->cs);
+
+    if(in_->reader){
+        lock.unlock();
+        done(boost::asio::error::in_progress, 0);
+        return;
+    }
+
+    if(in_->head < in_->data.size() || boost::asio::buffer_size(buffers) == 0){
+        const size_t bytes = take(*in_, buffers);
+        lock.unlock();
+        done(error_code(), bytes);
+        return;
+    }
+
+    if(in_->closed){
+        lock.unlock();
+        done(boost::asio::error::eof, 0);
+        return;
+    }
+
+    in_->buffers = std::move(buffers);
+    in_->reader = std::move(done);
+}
+
+void CMemoryStream::write(std::vector<boost::asio::const_buffer> buffers, completion done) {
+    if( ! out_ ){
+        done(boost::asio::error::not_connected, 0);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(out_->cs);
+
+    if(out_->closed){
+        lock.unlock();
+        done(boost::asio::error::broken_pipe, 0);
+        return;
+    }
+
+    size_t written = 0;
+    for(const auto &buffer : buffers){
+        out_->data.append(static_cast<const char *>(buffer.data()), buffer.size());
+        written += buffer.size();
+    }
+
+    // reading of other side waits for these data
+    completion reader;
+    size_t read = 0;
+    if(out_->reader && written > 0){
+        read = take(*out_, out_->buffers);
+        reader.swap(out_->reader);
+        out_->buffers.clear();
+    }
+
+    lock.unlock();
+
+    if(reader)
+        reader(error_code(), read);
+
+    done(error_code(), written);
+}
+
+size_t CMemoryStream::take(Pipe &pipe, const std::vector<boost::asio::mutable_buffer> &buffers) {
+    size_t bytes = 0;
+
+    for(const auto &buffer : buffers){
+        const size_t size = std::min(buffer.size(), pipe.data.size() - pipe.head);
+        std::memcpy(buffer.data(), pipe.data.data() + pipe.head, size);
+        pipe.head += size;
+        bytes += size;
+    }
+
+    // data are kept until all of them are read, so big answer isn't moved on every reading
+    if(pipe.head == pipe.data.size()){
+        pipe.data.clear();
+        pipe.head = 0;
+    }
+
+    return bytes;
+}
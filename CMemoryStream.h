@@ -0,0 +1,102 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CMEMORYSTREAM_H
+#define CS_MINISQLITESERVER_CMEMORYSTREAM_H
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*In-process transport with interface of asio stream (AsyncReadStream, AsyncWriteStream), so it can be used
+  by async_read/async_write and by CSocketSession instead of socket. Two streams are connected by Connect():
+  bytes, written to one of them, are read from other. It's used to embed server in other process
+  and by benchmarks to measure protocol and db without sockets.
+  Writing always completes at once: data is buffered until other side reads it (there is no flow control).
+  Only one reading at a time is allowed, as for socket. Completion handlers are posted to their executors*/
+class CMemoryStream : boost::noncopyable {
+public:
+    typedef boost::asio::io_context::executor_type executor_type;
+    typedef boost::system::error_code error_code;
+
+    explicit CMemoryStream(boost::asio::io_context &io_context);
+
+    // other side gets eof
+    ~CMemoryStream();
+
+    executor_type get_executor();
+
+    /*Connect two streams. Streams can be served by different io_contexts*/
+    static void Connect(CMemoryStream &first, CMemoryStream &second);
+
+    bool is_open() const;
+
+    template<class MutableBufferSequence, class ReadHandler>
+    void async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler) {
+        read(std::vector<boost::asio::mutable_buffer>(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers)),
+             wrap(std::forward<ReadHandler>(handler)));
+    }
+
+    template<class ConstBufferSequence, class WriteHandler>
+    void async_write_some(const ConstBufferSequence &buffers, WriteHandler &&handler) {
+        write(std::vector<boost::asio::const_buffer>(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers)),
+              wrap(std::forward<WriteHandler>(handler)));
+    }
+
+    /*Waiting reading is completed with operation_aborted*/
+    void cancel(error_code &err);
+
+    /*Other side reads the rest of data and gets eof, its writing fails*/
+    void close(error_code &err);
+
+private:
+    typedef std::function<void(const error_code &, size_t)> completion;
+
+    // bytes of one direction
+    struct Pipe {
+        Pipe();
+
+        std::mutex cs;
+        std::string data;
+        size_t head;                                    // data before head is read
+        std::vector<boost::asio::mutable_buffer> buffers;  // of waiting reading
+        completion reader;                              // waiting reading, if there is no data
+        bool closed;
+    };
+
+    // handler is moved to heap, so it can be move-only. It's called by its associated executor (e.g. strand),
+    // io_context has work, until handler is called
+    template<class Handler>
+    completion wrap(Handler &&handler) {
+        typedef typename std::decay<Handler>::type handler_type;
+        auto h = std::make_shared<handler_type>(std::forward<Handler>(handler));
+        auto work = std::make_shared<boost::asio::executor_work_guard<executor_type>>(executor_);
+        auto executor = boost::asio::get_associated_executor(*h, executor_);
+
+        return [h, work, executor](const error_code &err, size_t bytes){
+            boost::asio::post(executor, [h, work, err, bytes](){ (*h)(err, bytes); });
+        };
+    }
+
+    void read(std::vector<boost::asio::mutable_buffer> buffers, completion done);
+
+    void write(std::vector<boost::asio::const_buffer> buffers, completion done);
+
+    // copy data of pipe to buffers. Must be called under lock of pipe
+    static size_t take(Pipe &pipe, const std::vector<boost::asio::mutable_buffer> &buffers);
+
+    executor_type executor_;
+    std::shared_ptr<Pipe> in_;
+    std::shared_ptr<Pipe> out_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CMEMORYSTREAM_H
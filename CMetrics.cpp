@@ -0,0 +1,238 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CMetrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+    const char *const commandNames[CMetrics::COMMANDS_COUNT] = {
+            "select", "write", "exec_batch", "transaction", "bulk",
+            "update_place_free", "get_place_free", "backup_db", "get_db_backup_progress", "get_db_backup", "restore_db",
+            "stats", "login", "ping", "who", "fibo", "exit", "subscribe", "unknown"
+    };
+
+    const char *const timingNames[CMetrics::TIMINGS_COUNT] = { "prepare", "step" };
+
+    const char *const counterNames[CMetrics::COUNTERS_COUNT] = {
+            "minisqlite_received_bytes_total", "minisqlite_sent_bytes_total",
+            "minisqlite_sqlite_busy_waits_total",
+            "minisqlite_queries_rescheduled_total",
+            "minisqlite_connections_accepted_total", "minisqlite_connections_rejected_total", "minisqlite_accept_errors_total",
+            "minisqlite_slow_queries_total",
+            "minisqlite_sqlite_fullscan_steps_total", "minisqlite_sqlite_fullscan_statements_total",
+            "minisqlite_sqlite_sorts_total", "minisqlite_sqlite_autoindexes_total", "minisqlite_sqlite_vm_steps_total",
+            "minisqlite_sqlite_cache_hits_total", "minisqlite_sqlite_cache_misses_total", "minisqlite_sqlite_cache_writes_total",
+            "minisqlite_log_messages_dropped_total",
+            "minisqlite_trace_records_dropped_total",
+            "minisqlite_notifications_sent_total",
+            "minisqlite_replies_compressed_total", "minisqlite_compression_input_bytes_total", "minisqlite_compression_output_bytes_total"
+    };
+
+    const char *const gaugeNames[CMetrics::GAUGES_COUNT] = {
+            "minisqlite_active_sessions", "minisqlite_write_queue_messages", "minisqlite_write_queue_bytes",
+            "minisqlite_sqlite_connections", "minisqlite_sqlite_connections_memory_bytes"
+    };
+
+    unsigned highestBit(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long index = 0;
+        _BitScanReverse64(&index, value);
+        return static_cast<unsigned>(index);
+#else
+        return 63u - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+    }
+
+    // microseconds as seconds
+    string seconds(uint64_t value) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6f", static_cast<double>(value) / 1e6);
+        return buf;
+    }
+}
+
+CHistogram::CHistogram()
+        : sum_(0)
+        , max_(0)
+{
+    for(auto &bucket : buckets_)
+        bucket = 0;
+}
+
+void CHistogram::record(uint64_t value) {
+    buckets_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while(value > max && ! max_.compare_exchange_weak(max, value, std::memory_order_relaxed));
+}
+
+CHistogram::Snapshot CHistogram::snapshot() const {
+    Snapshot snapshot{};
+    snapshot.buckets.resize(BUCKETS);
+
+    // buckets are read one by one, so count is calculated from them to be consistent
+    for(size_t i = 0; i < BUCKETS; ++i){
+        snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.buckets[i];
+    }
+
+    snapshot.sum = sum_.load(std::memory_order_relaxed);
+    snapshot.max = max_.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+size_t CHistogram::bucketOf(uint64_t value) {
+    if(value < SUB_BUCKETS)
+        return static_cast<size_t>(value);
+
+    // top SUB_BUCKET_BITS + 1 bits of value select bucket inside its power of 2
+    const unsigned shift = highestBit(value) - SUB_BUCKET_BITS;
+    const size_t subBucket = static_cast<size_t>(value >> shift) - SUB_BUCKETS;
+
+    return std::min<size_t>((shift + 1) * SUB_BUCKETS + subBucket, BUCKETS - 1);
+}
+
+uint64_t CHistogram::upperBound(size_t bucket) {
+    if(bucket < SUB_BUCKETS)
+        return bucket + 1;
+
+    const size_t shift = bucket / SUB_BUCKETS - 1;
+    const uint64_t subBucket = bucket % SUB_BUCKETS;
+
+    return (SUB_BUCKETS + subBucket + 1) << shift;
+}
+
+uint64_t CHistogram::Snapshot::quantile(double q) const {
+    if(count == 0)
+        return 0;
+
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+    uint64_t seen = 0;
+
+    for(size_t i = 0; i < buckets.size(); ++i){
+        seen += buckets[i];
+        if(seen >= rank)
+            return std::min(upperBound(i), max);
+    }
+
+    return max;
+}
+
+CHistogram CMetrics::commands_[CMetrics::COMMANDS_COUNT];
+CHistogram CMetrics::timings_[CMetrics::TIMINGS_COUNT];
+std::atomic<uint64_t> CMetrics::counters_[CMetrics::COUNTERS_COUNT] = {};
+std::atomic<int64_t> CMetrics::gauges_[CMetrics::GAUGES_COUNT] = {};
+
+void CMetrics::record(Command command, clock::duration duration) {
+    commands_[command].record(toMicroseconds(duration));
+}
+
+void CMetrics::record(Timing timing, clock::duration duration) {
+    timings_[timing].record(toMicroseconds(duration));
+}
+
+void CMetrics::add(Counter counter, uint64_t value) {
+    counters_[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+void CMetrics::add(Gauge gauge, int64_t value) {
+    gauges_[gauge].fetch_add(value, std::memory_order_relaxed);
+}
+
+string CMetrics::Render() {
+    string out;
+
+    renderHistograms(out, "minisqlite_command_duration_seconds", "command", commandNames, commands_, COMMANDS_COUNT);
+    renderHistograms(out, "minisqlite_sqlite_call_duration_seconds", "call", timingNames, timings_, TIMINGS_COUNT);
+
+    for(size_t i = 0; i < COUNTERS_COUNT; ++i)
+        renderCounter(out, counterNames[i], counters_[i].load(std::memory_order_relaxed));
+
+    for(size_t i = 0; i < GAUGES_COUNT; ++i)
+        renderGauge(out, gaugeNames[i], gauges_[i].load(std::memory_order_relaxed));
+
+    return out;
+}
+
+void CMetrics::renderCounter(string &out, const char *name, uint64_t value) {
+    renderMetric(out, name, "counter", std::to_string(value));
+}
+
+void CMetrics::renderCounter(string &out, const char *name, clock::duration value) {
+    renderMetric(out, name, "counter", seconds(toMicroseconds(value)));
+}
+
+void CMetrics::renderGauge(string &out, const char *name, int64_t value) {
+    renderMetric(out, name, "gauge", std::to_string(value));
+}
+
+void CMetrics::renderGauge(string &out, const char *name, clock::duration value) {
+    renderMetric(out, name, "gauge", seconds(toMicroseconds(value)));
+}
+
+void CMetrics::renderMetric(string &out, const char *name, const char *type, const string &value) {
+    out += string("# TYPE ") + name + " " + type + "\n";
+    out += string(name) + " " + value + "\n";
+}
+
+uint64_t CMetrics::toMicroseconds(clock::duration duration) {
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    return us > 0 ? static_cast<uint64_t>(us) : 0;
+}
+
+void CMetrics::renderHistograms(string &out, const char *name, const char *labelName, const char *const *labels,
+                                const CHistogram *histograms, size_t count) {
+    std::vector<CHistogram::Snapshot> snapshots;
+    for(size_t i = 0; i < count; ++i)
+        snapshots.push_back(histograms[i].snapshot());
+
+    // series of one metric must be together, so quantiles and max are separate metrics after histogram
+    string quantiles = string("# TYPE ") + name + "_quantile gauge\n";
+    string max = string("# TYPE ") + name + "_max gauge\n";
+
+    out += string("# TYPE ") + name + " histogram\n";
+
+    for(size_t i = 0; i < count; ++i){
+        const CHistogram::Snapshot &snapshot = snapshots[i];
+
+        // series without values are skipped to keep output short
+        if(snapshot.count == 0)
+            continue;
+
+        const string label = string(labelName) + "=\"" + labels[i] + "\"";
+        const string prefix = string(name) + "_bucket{" + label + ",le=\"";
+        const size_t lastBucket = CHistogram::bucketOf(snapshot.max);
+        uint64_t cumulative = 0;
+
+        // only powers of 2 are exported as bounds: precise buckets are used for quantiles
+        for(size_t j = 0; j < CHistogram::BUCKETS; ++j){
+            cumulative += snapshot.buckets[j];
+
+            if((j + 1) % CHistogram::SUB_BUCKETS == 0){
+                out += prefix + seconds(CHistogram::upperBound(j)) + "\"} " + std::to_string(cumulative) + "\n";
+                if(j >= lastBucket)
+                    break;
+            }
+        }
+
+        out += prefix + "+Inf\"} " + std::to_string(snapshot.count) + "\n";
+        out += string(name) + "_sum{" + label + "} " + seconds(snapshot.sum) + "\n";
+        out += string(name) + "_count{" + label + "} " + std::to_string(snapshot.count) + "\n";
+
+        for(const char *q : { "0.5", "0.9", "0.99" })
+            quantiles += string(name) + "_quantile{" + label + ",quantile=\"" + q + "\"} " + seconds(snapshot.quantile(std::atof(q))) + "\n";
+
+        max += string(name) + "_max{" + label + "} " + seconds(snapshot.max) + "\n";
+    }
+
+    out += quantiles + max;
+}
@@ -0,0 +1,131 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CMETRICS_H
+#define CS_MINISQLITESERVER_CMETRICS_H
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*Log-linear histogram (like HdrHistogram): each power of 2 is split into SUB_BUCKETS linear buckets,
+  so relative error of value is less than 1/SUB_BUCKETS. Recording is lock-free*/
+class CHistogram {
+public:
+    enum { SUB_BUCKET_BITS = 3, SUB_BUCKETS = 1 << SUB_BUCKET_BITS, MAGNITUDES = 42, BUCKETS = SUB_BUCKETS * MAGNITUDES };
+
+    struct Snapshot {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        std::vector<uint64_t> buckets;
+
+        /*Upper bound of bucket, that contains quantile q (0..1)*/
+        uint64_t quantile(double q) const;
+    };
+
+    CHistogram();
+
+    void record(uint64_t value);
+
+    Snapshot snapshot() const;
+
+    static size_t bucketOf(uint64_t value);
+
+    /*Values of bucket are less than this bound*/
+    static uint64_t upperBound(size_t bucket);
+
+private:
+    std::atomic<uint64_t> buckets_[BUCKETS];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+/*Counters and latency histograms of server. All methods are static and thread-safe.
+  Render() returns metrics in Prometheus text format*/
+class CMetrics {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // commands of client (see CClientSession::on_read)
+    enum Command {
+        CMD_QUERY_SELECT, CMD_QUERY_WRITE, CMD_EXEC_BATCH, CMD_TRANSACTION, CMD_BULK,
+        CMD_UPDATE_PLACE_FREE, CMD_GET_PLACE_FREE, CMD_BACKUP, CMD_BACKUP_PROGRESS, CMD_GET_BACKUP, CMD_RESTORE,
+        CMD_STATS, CMD_LOGIN, CMD_PING, CMD_WHO, CMD_FIBO, CMD_EXIT, CMD_SUBSCRIBE, CMD_UNKNOWN,
+        COMMANDS_COUNT
+    };
+
+    // sqlite calls
+    enum Timing { SQL_PREPARE, SQL_STEP, TIMINGS_COUNT };
+
+    enum Counter {
+        BYTES_IN, BYTES_OUT,
+        SQL_BUSY_WAITS,         // waits of busy handler (CSQLiteDB::WaitOnBusy)
+        QUERY_RESCHEDULED,      // queries, that were postponed on timer, because db was busy
+        CONNECTIONS_ACCEPTED, CONNECTIONS_REJECTED, ACCEPT_ERRORS,
+        SLOW_QUERIES,           // statements, that were logged by CSlowQueryLog
+        // sqlite3_stmt_status of finished statements
+        SQL_FULLSCAN_STEPS, SQL_FULLSCAN_STATEMENTS, SQL_SORTS, SQL_AUTOINDEXES, SQL_VM_STEPS,
+        // sqlite3_db_status of connections
+        SQL_CACHE_HITS, SQL_CACHE_MISSES, SQL_CACHE_WRITES,
+        LOG_MESSAGES_DROPPED,   // buffer of CAsyncLog was full
+        TRACE_RECORDS_DROPPED,  // buffer of CTrace was full
+        NOTIFICATIONS_SENT,     // messages of CNotifier to subscribed clients
+        // answers, that were compressed for clients, and their size before and after compression
+        REPLIES_COMPRESSED, COMPRESSION_INPUT_BYTES, COMPRESSION_OUTPUT_BYTES,
+        COUNTERS_COUNT
+    };
+
+    enum Gauge {
+        ACTIVE_SESSIONS, WRITE_QUEUE_MESSAGES, WRITE_QUEUE_BYTES,
+        SQL_CONNECTIONS, SQL_CONNECTIONS_MEMORY, // open sqlite connections and memory of their caches and statements
+        GAUGES_COUNT
+    };
+
+    CMetrics() = delete;
+
+    static void record(Command command, clock::duration duration);
+
+    static void record(Timing timing, clock::duration duration);
+
+    static void add(Counter counter, uint64_t value = 1);
+
+    static void add(Gauge gauge, int64_t value);
+
+    /*All metrics in Prometheus text format. Latencies are in seconds*/
+    static string Render();
+
+    /*Append metric, that is kept outside of CMetrics (e.g. stats of CCheckpointScheduler or sqlite3_status),
+      in the same format as Render(). Durations are rendered in seconds*/
+    static void renderCounter(string &out, const char *name, uint64_t value);
+
+    static void renderCounter(string &out, const char *name, clock::duration value);
+
+    static void renderGauge(string &out, const char *name, int64_t value);
+
+    static void renderGauge(string &out, const char *name, clock::duration value);
+
+private:
+    static uint64_t toMicroseconds(clock::duration duration);
+
+    // '# TYPE' line and value of metric without labels
+    static void renderMetric(string &out, const char *name, const char *type, const string &value);
+
+    // histogram of each label (if it has values), then their quantiles and max
+    static void renderHistograms(string &out, const char *name, const char *labelName, const char *const *labels,
+                                 const CHistogram *histograms, size_t count);
+
+    static CHistogram commands_[COMMANDS_COUNT];
+    static CHistogram timings_[TIMINGS_COUNT];
+    static std::atomic<uint64_t> counters_[COUNTERS_COUNT];
+    static std::atomic<int64_t> gauges_[GAUGES_COUNT];
+};
+
+
+#endif //CS_MINISQLITESERVER_CMETRICS_H
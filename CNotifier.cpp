@@ -0,0 +1,202 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CNotifier.h"
+#include "CClientSession.h"
+#include "CMetrics.h"
+#include "glog/logging.h"
+
+#include <algorithm>
+#include <cctype>
+
+const char *const CNotifier::PLACE_FREE = "PlaceFree";
+
+std::atomic<bool> CNotifier::enabled_(false);
+std::atomic<size_t> CNotifier::subscriptions_(0);
+size_t CNotifier::windowMs_ = 0;
+std::mutex CNotifier::subscribersCs_;
+std::unordered_map<string, std::unordered_map<uint64_t, boost::weak_ptr<CClientSession>>> CNotifier::subscribers_;
+std::unordered_map<uint64_t, std::set<string>> CNotifier::topicsOf_;
+std::mutex CNotifier::cs_;
+std::condition_variable CNotifier::cv_;
+std::map<string, string> CNotifier::pending_;
+bool CNotifier::stopping_ = false;
+boost::thread CNotifier::thread_;
+
+void CNotifier::Start(size_t windowMs) {
+    if(enabled_)
+        return;
+
+    windowMs_ = windowMs;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        stopping_ = false;
+    }
+
+    thread_ = boost::thread(&CNotifier::run);
+    enabled_ = true;
+}
+
+void CNotifier::Stop() {
+    if( ! enabled_.exchange(false) )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+size_t CNotifier::Subscribe(uint64_t id, const client_ptr &client, const std::vector<string> &topics) {
+    std::lock_guard<std::mutex> lock(subscribersCs_);
+    std::set<string> &topicsOfClient = topicsOf_[id];
+
+    for(const string &topic : topics){
+        const string k = key(topic);
+        if(k.empty() || ! topicsOfClient.insert(k).second)
+            continue;
+
+        subscribers_[k][id] = client;
+        ++subscriptions_;
+    }
+
+    const size_t count = topicsOfClient.size();
+    if(count == 0)
+        topicsOf_.erase(id);
+
+    return count;
+}
+
+size_t CNotifier::Unsubscribe(uint64_t id, const std::vector<string> &topics) {
+    std::lock_guard<std::mutex> lock(subscribersCs_);
+    auto client = topicsOf_.find(id);
+    if(client == topicsOf_.end())
+        return 0;
+
+    std::set<string> removed;
+    if(topics.empty()){
+        removed.swap(client->second);
+    }else{
+        for(const string &topic : topics){
+            const string k = key(topic);
+            if(client->second.erase(k))
+                removed.insert(k);
+        }
+    }
+
+    for(const string &k : removed){
+        auto it = subscribers_.find(k);
+        if(it == subscribers_.end())
+            continue;
+
+        it->second.erase(id);
+        if(it->second.empty())
+            subscribers_.erase(it);
+        --subscriptions_;
+    }
+
+    const size_t count = client->second.size();
+    if(count == 0)
+        topicsOf_.erase(client);
+
+    return count;
+}
+
+void CNotifier::Publish(const string &topic, const string &value) {
+    if( ! isEnabled() || subscriptions_ == 0 )
+        return;
+
+    bool wakeUp;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        wakeUp = pending_.empty();
+        pending_[topic] = value;
+    }
+
+    // thread sleeps until the first change, then waits for the window
+    if(wakeUp)
+        cv_.notify_one();
+}
+
+void CNotifier::Publish(const std::vector<string> &topics) {
+    if( ! isEnabled() || subscriptions_ == 0 || topics.empty() )
+        return;
+
+    bool wakeUp;
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        wakeUp = pending_.empty();
+        for(const string &topic : topics)
+            pending_[topic];
+    }
+
+    if(wakeUp)
+        cv_.notify_one();
+}
+
+string CNotifier::key(const string &topic) {
+    string k(topic);
+    std::transform(k.begin(), k.end(), k.begin(), [](char c){ return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+    return k;
+}
+
+void CNotifier::run() {
+    std::map<string, string> changes;
+
+    for(;;){
+        {
+            std::unique_lock<std::mutex> lock(cs_);
+            cv_.wait(lock, []{ return stopping_ || ! pending_.empty(); });
+            if(stopping_)
+                break;
+
+            // changes of the next transactions are coalesced with the first one
+            cv_.wait_for(lock, std::chrono::milliseconds(windowMs_), []{ return stopping_; });
+            if(stopping_)
+                break;
+
+            changes.swap(pending_);
+        }
+
+        deliver(changes);
+        changes.clear();
+    }
+}
+
+void CNotifier::deliver(const std::map<string, string> &changes) {
+    // one message per client with all its topics, that were changed
+    std::unordered_map<uint64_t, std::pair<boost::weak_ptr<CClientSession>, string>> messages;
+
+    {
+        std::lock_guard<std::mutex> lock(subscribersCs_);
+
+        for(const auto &change : changes){
+            auto it = subscribers_.find(key(change.first));
+            if(it == subscribers_.end())
+                continue;
+
+            for(const auto &client : it->second){
+                auto &message = messages[client.first];
+                message.first = client.second;
+                message.second += ' ' + change.first;
+                if( ! change.second.empty() )
+                    message.second += '=' + change.second;
+            }
+        }
+    }
+
+    // sessions are called out of lock: stopped session unsubscribes itself
+    for(const auto &it : messages){
+        const client_ptr client = it.second.first.lock();
+        if( ! client )
+            continue;
+
+        client->notify("notify" + it.second.second + "\n");
+        CMetrics::add(CMetrics::NOTIFICATIONS_SENT);
+    }
+
+    VLOG(1) << "DEBUG: notified clients: " << messages.size() << ", changed topics: " << changes.size();
+}
@@ -0,0 +1,88 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CNOTIFIER_H
+#define CS_MINISQLITESERVER_CNOTIFIER_H
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+
+class CClientSession;
+
+/*Push notifications about changes of db instead of polling by clients.
+  Client subscribes to topics: names of tables (case-insensitive) or PLACE_FREE.
+  Connections of clients publish tables, that were changed by committed transaction (see CSQLiteDB::setChangesFunction),
+  'UPDATE Config SET PlaceFree' publishes PLACE_FREE with new value.
+  Background thread coalesces changes during window and sends to each subscriber one message:
+    "notify <topic>[=<value>] <topic>...\n"
+  Notification means, that data could be changed, client must select it again.
+  Changes of WITHOUT ROWID tables aren't notified: sqlite3_update_hook isn't called for them*/
+class CNotifier {
+public:
+    typedef boost::shared_ptr<CClientSession> client_ptr;
+
+    static const char *const PLACE_FREE;
+
+    CNotifier() = delete;
+
+    /*Start background thread, that sends changes, published during windowMs, by one message*/
+    static void Start(size_t windowMs);
+
+    static void Stop();
+
+    static bool isEnabled() {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    /*Subscribe client to topics. Return count of topics of client*/
+    static size_t Subscribe(uint64_t id, const client_ptr &client, const std::vector<string> &topics);
+
+    /*Unsubscribe client from topics (from all, if topics are empty). Return count of remaining topics of client*/
+    static size_t Unsubscribe(uint64_t id, const std::vector<string> &topics = std::vector<string>());
+
+    /*Topic was changed. If topic is published several times during window, the last value is sent*/
+    static void Publish(const string &topic, const string &value = string());
+
+    static void Publish(const std::vector<string> &topics);
+
+private:
+    static string key(const string &topic);
+
+    static void run();
+
+    static void deliver(const std::map<string, string> &changes);
+
+    static std::atomic<bool> enabled_;
+    static std::atomic<size_t> subscriptions_;   // publishing is skipped, while nobody is subscribed
+    static size_t windowMs_;
+
+    // subscribers: topic (lower case) -> clients and client -> its topics
+    static std::mutex subscribersCs_;
+    static std::unordered_map<string, std::unordered_map<uint64_t, boost::weak_ptr<CClientSession>>> subscribers_;
+    static std::unordered_map<uint64_t, std::set<string>> topicsOf_;
+
+    // changes, that weren't sent yet: topic -> value
+    static std::mutex cs_;
+    static std::condition_variable cv_;
+    static std::map<string, string> pending_;
+    static bool stopping_;
+    static boost::thread thread_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CNOTIFIER_H
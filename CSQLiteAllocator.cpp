@@ -0,0 +1,405 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CSQLiteAllocator.h"
+#include "sqlite3/sqlite3.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+    // each block starts with header, so sqlite3 gets memory aligned as by malloc
+    struct BlockHeader {
+        size_t size;        // size of block with header
+        size_t sizeClass;   // index of size class or LARGE_BLOCK
+    };
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    const size_t LARGE_BLOCK = static_cast<size_t>(-1);
+    const size_t HEADER_SIZE = sizeof(BlockHeader);
+    const size_t GRANULARITY = 16;
+    const size_t MAX_BLOCK_SIZE = CSQLiteAllocator::MAX_BLOCK_SIZE;
+
+    // sizes of blocks grow by 1/4 of power of 2, so not more than 25% of block is wasted
+    struct SizeClasses {
+        std::vector<size_t> sizes;      // size of block with header
+        std::vector<size_t> cacheLimit; // max count of free blocks in thread cache
+        std::vector<uint8_t> lookup;    // (size + GRANULARITY - 1) / GRANULARITY -> index of class
+
+        SizeClasses() {
+            for (size_t base = 32; base <= MAX_BLOCK_SIZE; base *= 2) {
+                for (size_t quarter = 4; quarter < 8; ++quarter) {
+                    const size_t size = (base * quarter / 4 + GRANULARITY - 1) & ~(GRANULARITY - 1);
+
+                    if(size > MAX_BLOCK_SIZE)
+                        break;
+
+                    if(sizes.empty() || sizes.back() < size){
+                        sizes.push_back(size);
+                        // thread keeps up to 32 Kb of free blocks of each class
+                        cacheLimit.push_back(std::min<size_t>(std::max<size_t>(32 * 1024 / size, 4), 256));
+                    }
+                }
+            }
+
+            lookup.resize(MAX_BLOCK_SIZE / GRANULARITY + 1);
+
+            for (size_t i = 0, cls = 0; i < lookup.size(); ++i) {
+                while(sizes[cls] < i * GRANULARITY)
+                    ++cls;
+                lookup[i] = static_cast<uint8_t>(cls);
+            }
+        }
+
+        size_t classOf(size_t size) const {
+            return lookup[(size + GRANULARITY - 1) / GRANULARITY];
+        }
+    };
+
+    struct GlobalList {
+        std::mutex mtx;
+        FreeBlock *head = nullptr;
+    };
+
+    struct ThreadCache;
+
+    struct Pools {
+        SizeClasses classes;
+        std::unique_ptr<GlobalList[]> lists{new GlobalList[classes.sizes.size()]};
+
+        std::atomic<uint64_t> poolBytes{0};
+        std::atomic<uint64_t> largeAllocCount{0};
+        std::atomic<int64_t> largeInUseBytes{0};
+        std::atomic<uint64_t> refillCount{0};
+        std::atomic<uint64_t> flushCount{0};
+
+        // caches of live threads and stats of finished ones
+        std::mutex cachesMtx;
+        std::vector<ThreadCache *> caches;
+        uint64_t retiredAllocCount = 0;
+        uint64_t retiredFreeCount = 0;
+        int64_t retiredInUseBytes = 0;
+    };
+
+    // sqlite can free memory while static objects are destroyed, so pools are never destroyed
+    Pools &pools() {
+        static Pools *pools_ = new Pools;
+        return *pools_;
+    }
+
+    std::atomic<bool> installed{false};
+
+    /*Take up to count blocks from global list of class. Global list is filled from new slab, if it is empty*/
+    FreeBlock *takeFromGlobal(size_t cls, size_t count, size_t &taken) {
+        Pools &p = pools();
+        GlobalList &list = p.lists[cls];
+        std::lock_guard<std::mutex> lock(list.mtx);
+
+        if(! list.head){
+            const size_t blockSize = p.classes.sizes[cls];
+            const size_t slabSize = std::max<size_t>(CSQLiteAllocator::SLAB_SIZE, blockSize * 4);
+            char *slab = static_cast<char *>(std::malloc(slabSize));
+
+            if(! slab)
+                return nullptr;
+
+            p.poolBytes.fetch_add(slabSize, std::memory_order_relaxed);
+
+            for (size_t offset = 0; offset + blockSize <= slabSize; offset += blockSize) {
+                FreeBlock *block = reinterpret_cast<FreeBlock *>(slab + offset);
+                block->next = list.head;
+                list.head = block;
+            }
+        }
+
+        FreeBlock *first = list.head, *last = list.head;
+        taken = 1;
+
+        while(taken < count && last->next){
+            last = last->next;
+            ++taken;
+        }
+
+        list.head = last->next;
+        last->next = nullptr;
+        return first;
+    }
+
+    void returnToGlobal(size_t cls, FreeBlock *first, FreeBlock *last) {
+        GlobalList &list = pools().lists[cls];
+        std::lock_guard<std::mutex> lock(list.mtx);
+        last->next = list.head;
+        list.head = first;
+    }
+
+    thread_local bool cacheDestroyed = false;
+
+    struct ThreadCache {
+        struct Bin {
+            FreeBlock *head;
+            size_t count;
+        };
+
+        std::vector<Bin> bins;
+
+        // only owner thread writes these, other threads read them for stats
+        std::atomic<uint64_t> allocCount{0};
+        std::atomic<uint64_t> freeCount{0};
+        std::atomic<int64_t> inUseBytes{0};
+
+        ThreadCache()
+                : bins(pools().classes.sizes.size(), Bin{nullptr, 0})
+        {
+            Pools &p = pools();
+            std::lock_guard<std::mutex> lock(p.cachesMtx);
+            p.caches.push_back(this);
+        }
+
+        ~ThreadCache() {
+            for (size_t cls = 0; cls < bins.size(); ++cls)
+                flush(cls, bins[cls].count);
+
+            Pools &p = pools();
+            {
+                std::lock_guard<std::mutex> lock(p.cachesMtx);
+                p.caches.erase(std::remove(p.caches.begin(), p.caches.end(), this), p.caches.end());
+                p.retiredAllocCount += allocCount.load(std::memory_order_relaxed);
+                p.retiredFreeCount += freeCount.load(std::memory_order_relaxed);
+                p.retiredInUseBytes += inUseBytes.load(std::memory_order_relaxed);
+            }
+
+            // sqlite can free memory later on this thread, then blocks go to global lists
+            cacheDestroyed = true;
+        }
+
+        /*Move count blocks from head of bin to global list*/
+        void flush(size_t cls, size_t count) {
+            Bin &bin = bins[cls];
+
+            if(! count || ! bin.head)
+                return;
+
+            FreeBlock *first = bin.head, *last = bin.head;
+            for (size_t i = 1; i < count && last->next; ++i)
+                last = last->next;
+
+            bin.head = last->next;
+            bin.count -= count;
+            returnToGlobal(cls, first, last);
+            pools().flushCount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void countAlloc(int64_t bytes) {
+            allocCount.store(allocCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            inUseBytes.store(inUseBytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+        }
+
+        void countFree(int64_t bytes) {
+            freeCount.store(freeCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            inUseBytes.store(inUseBytes.load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+        }
+    };
+
+    ThreadCache *threadCache() {
+        if(cacheDestroyed)
+            return nullptr;
+
+        thread_local ThreadCache cache;
+        return &cache;
+    }
+
+    void *allocLarge(size_t size) {
+        BlockHeader *header = static_cast<BlockHeader *>(std::malloc(size));
+
+        if(! header)
+            return nullptr;
+
+        header->size = size;
+        header->sizeClass = LARGE_BLOCK;
+
+        Pools &p = pools();
+        p.largeAllocCount.fetch_add(1, std::memory_order_relaxed);
+        p.largeInUseBytes.fetch_add(static_cast<int64_t>(size), std::memory_order_relaxed);
+
+        return header + 1;
+    }
+
+    void *xMalloc(int bytes) {
+        const size_t size = static_cast<size_t>(bytes) + HEADER_SIZE;
+
+        if(size > MAX_BLOCK_SIZE)
+            return allocLarge(size);
+
+        Pools &p = pools();
+        const size_t cls = p.classes.classOf(size);
+        ThreadCache *cache = threadCache();
+        FreeBlock *block = nullptr;
+
+        if(cache && cache->bins[cls].head){
+            ThreadCache::Bin &bin = cache->bins[cls];
+            block = bin.head;
+            bin.head = block->next;
+            --bin.count;
+        }else{
+            // refill half of thread cache at once, so global lock is taken rarely
+            size_t taken = 0;
+            const size_t batch = cache ? std::max<size_t>(p.classes.cacheLimit[cls] / 2, 1) : 1;
+
+            block = takeFromGlobal(cls, batch, taken);
+
+            if(! block)
+                return nullptr;
+
+            if(cache && block->next){
+                cache->bins[cls].head = block->next;
+                cache->bins[cls].count = taken - 1;
+            }
+
+            p.refillCount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        BlockHeader *header = reinterpret_cast<BlockHeader *>(block);
+        header->size = p.classes.sizes[cls];
+        header->sizeClass = cls;
+
+        if(cache)
+            cache->countAlloc(static_cast<int64_t>(header->size));
+
+        return header + 1;
+    }
+
+    void xFree(void *ptr) {
+        if(! ptr)
+            return;
+
+        BlockHeader *header = static_cast<BlockHeader *>(ptr) - 1;
+        Pools &p = pools();
+
+        if(header->sizeClass == LARGE_BLOCK){
+            p.largeInUseBytes.fetch_sub(static_cast<int64_t>(header->size), std::memory_order_relaxed);
+            std::free(header);
+            return;
+        }
+
+        const size_t cls = header->sizeClass;
+        const int64_t size = static_cast<int64_t>(header->size);
+        FreeBlock *block = reinterpret_cast<FreeBlock *>(header);
+        ThreadCache *cache = threadCache();
+
+        if(! cache){
+            block->next = nullptr;
+            returnToGlobal(cls, block, block);
+            return;
+        }
+
+        ThreadCache::Bin &bin = cache->bins[cls];
+        block->next = bin.head;
+        bin.head = block;
+        ++bin.count;
+
+        cache->countFree(size);
+
+        // keep half of blocks for next allocations of this thread
+        if(bin.count > p.classes.cacheLimit[cls])
+            cache->flush(cls, bin.count / 2);
+    }
+
+    int xSize(void *ptr) {
+        if(! ptr)
+            return 0;
+
+        return static_cast<int>((static_cast<BlockHeader *>(ptr) - 1)->size - HEADER_SIZE);
+    }
+
+    void *xRealloc(void *ptr, int bytes) {
+        if(! ptr)
+            return xMalloc(bytes);
+
+        const BlockHeader *header = static_cast<BlockHeader *>(ptr) - 1;
+        const size_t size = static_cast<size_t>(bytes) + HEADER_SIZE;
+
+        // block is already big enough and isn't much bigger, than needed
+        if(header->sizeClass != LARGE_BLOCK && size <= MAX_BLOCK_SIZE && pools().classes.classOf(size) == header->sizeClass)
+            return ptr;
+
+        void *newPtr = xMalloc(bytes);
+
+        if(! newPtr)
+            return nullptr;
+
+        std::memcpy(newPtr, ptr, std::min<size_t>(header->size - HEADER_SIZE, static_cast<size_t>(bytes)));
+        xFree(ptr);
+        return newPtr;
+    }
+
+    int xRoundup(int bytes) {
+        const size_t size = static_cast<size_t>(bytes) + HEADER_SIZE;
+
+        if(size > MAX_BLOCK_SIZE)
+            return (bytes + 7) & ~7;
+
+        const Pools &p = pools();
+        return static_cast<int>(p.classes.sizes[p.classes.classOf(size)] - HEADER_SIZE);
+    }
+
+    int xInit(void *) {
+        pools();
+        return SQLITE_OK;
+    }
+
+    void xShutdown(void *) {}
+}
+
+bool CSQLiteAllocator::Install() {
+    static const sqlite3_mem_methods methods = {
+            xMalloc, xFree, xRealloc, xSize, xRoundup, xInit, xShutdown, nullptr
+    };
+
+    if(SQLITE_OK != sqlite3_config(SQLITE_CONFIG_MALLOC, &methods))
+        return false;
+
+    installed = true;
+    return true;
+}
+
+bool CSQLiteAllocator::isInstalled() {
+    return installed;
+}
+
+CSQLiteAllocator::Stats CSQLiteAllocator::GetStats() {
+    Pools &p = pools();
+    Stats stats{};
+
+    {
+        std::lock_guard<std::mutex> lock(p.cachesMtx);
+
+        stats.allocCount = p.retiredAllocCount;
+        stats.freeCount = p.retiredFreeCount;
+        stats.inUseBytes = p.retiredInUseBytes;
+        stats.threadCaches = p.caches.size();
+
+        for(const ThreadCache *cache : p.caches){
+            stats.allocCount += cache->allocCount.load(std::memory_order_relaxed);
+            stats.freeCount += cache->freeCount.load(std::memory_order_relaxed);
+            stats.inUseBytes += cache->inUseBytes.load(std::memory_order_relaxed);
+        }
+    }
+
+    stats.poolBytes = p.poolBytes;
+    stats.largeAllocCount = p.largeAllocCount;
+    stats.largeInUseBytes = p.largeInUseBytes;
+    stats.refillCount = p.refillCount;
+    stats.flushCount = p.flushCount;
+
+    return stats;
+}
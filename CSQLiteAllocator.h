@@ -0,0 +1,45 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CSQLITEALLOCATOR_H
+#define CS_MINISQLITESERVER_CSQLITEALLOCATOR_H
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*Memory allocator for sqlite (SQLITE_CONFIG_MALLOC).
+  Small blocks are taken from size-class pools: each thread has own cache of free blocks,
+  so most of allocations and frees don't take any lock. When thread cache of a class is
+  empty (or full), blocks are moved from (to) global list of this class by batches.
+  Memory of pools isn't returned to the system, it is reused by all threads.
+  Blocks bigger than MAX_BLOCK_SIZE are allocated by malloc.*/
+class CSQLiteAllocator {
+public:
+    enum { MAX_BLOCK_SIZE = 16384, SLAB_SIZE = 64 * 1024 };
+
+    struct Stats {
+        uint64_t allocCount;        // count of allocations from pools
+        uint64_t freeCount;         // count of frees to pools
+        int64_t inUseBytes;         // bytes of pool blocks, that are in use (with headers)
+        uint64_t poolBytes;         // bytes, reserved by pools
+        uint64_t largeAllocCount;   // count of allocations by malloc
+        int64_t largeInUseBytes;    // bytes, allocated by malloc and not freed yet
+        uint64_t refillCount;       // how many times thread cache took blocks from global list
+        uint64_t flushCount;        // how many times thread cache returned blocks to global list
+        size_t threadCaches;        // count of threads, that have cache
+    };
+
+    CSQLiteAllocator() = delete;
+
+    /*Install allocator into sqlite. Must be called before sqlite3_initialize()*/
+    static bool Install();
+
+    static bool isInstalled();
+
+    static Stats GetStats();
+};
+
+
+#endif //CS_MINISQLITESERVER_CSQLITEALLOCATOR_H
@@ -1,4 +1,9 @@
 #include "CSQLiteDB.h"
+#include "CMetrics.h"
+#include "CSlowQueryLog.h"
+
+#include <cstring>
+#include <map>
 
 CSQLiteDB::SQLLITEConnection::~SQLLITEConnection()
 {
@@ -6,35 +11,94 @@ CSQLiteDB::SQLLITEConnection::~SQLLITEConnection()
 
     ReleaseStmt();
 
-    if(pCon)
+    if(pCon){
+        SampleDbStatus();
+        CMetrics::add(CMetrics::SQL_CONNECTIONS_MEMORY, -sampledMemory);
+        CMetrics::add(CMetrics::SQL_CONNECTIONS, -1);
+
         sqlite3_close(pCon), pCon = nullptr;
+    }
     //VLOG(1) <<"after ~SQLLITEConnection pStmt: "<<pStmt <<" pCon: " <<pCon;
 }
 
 void CSQLiteDB::SQLLITEConnection::ReleaseStmt() {
     if(pStmt){
+        SampleStmtStatus();
         sqlite3_finalize(pStmt);
         pStmt = nullptr;
+
+        if(++statements >= DB_STATUS_PERIOD)
+            SampleDbStatus();
     }
 }
 
-CSQLiteDB::SQLLITEConnection::SQLLITEConnection(string databasePath, size_t sqlEttempts, size_t sqlWaitTime)
+void CSQLiteDB::SQLLITEConnection::SampleStmtStatus() {
+    const int fullscanSteps = sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+
+    // full scan of small table is ok, but growth of these counters usually means, that index is missed
+    if(fullscanSteps > 0){
+        CMetrics::add(CMetrics::SQL_FULLSCAN_STEPS, static_cast<uint64_t>(fullscanSteps));
+        CMetrics::add(CMetrics::SQL_FULLSCAN_STATEMENTS);
+    }
+
+    CMetrics::add(CMetrics::SQL_SORTS, static_cast<uint64_t>(sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_SORT, 0)));
+    CMetrics::add(CMetrics::SQL_AUTOINDEXES, static_cast<uint64_t>(sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_AUTOINDEX, 0)));
+    CMetrics::add(CMetrics::SQL_VM_STEPS, static_cast<uint64_t>(sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_VM_STEP, 0)));
+}
+
+void CSQLiteDB::SQLLITEConnection::SampleDbStatus() {
+    int current = 0, highwater = 0;
+    statements = 0;
+
+    // cache counters are reset, so each sample adds only new hits/misses
+    sqlite3_db_status(pCon, SQLITE_DBSTATUS_CACHE_HIT, &current, &highwater, 1);
+    CMetrics::add(CMetrics::SQL_CACHE_HITS, static_cast<uint64_t>(current));
+    sqlite3_db_status(pCon, SQLITE_DBSTATUS_CACHE_MISS, &current, &highwater, 1);
+    CMetrics::add(CMetrics::SQL_CACHE_MISSES, static_cast<uint64_t>(current));
+    sqlite3_db_status(pCon, SQLITE_DBSTATUS_CACHE_WRITE, &current, &highwater, 1);
+    CMetrics::add(CMetrics::SQL_CACHE_WRITES, static_cast<uint64_t>(current));
+
+    // SQLITE_DBSTATUS_SCHEMA_USED isn't sampled: it measures whole schema on each call
+    long long memory = 0;
+    sqlite3_db_status(pCon, SQLITE_DBSTATUS_CACHE_USED, &current, &highwater, 0);
+    memory += current;
+    sqlite3_db_status(pCon, SQLITE_DBSTATUS_STMT_USED, &current, &highwater, 0);
+    memory += current;
+
+    CMetrics::add(CMetrics::SQL_CONNECTIONS_MEMORY, memory - sampledMemory);
+    sampledMemory = memory;
+}
+
+void CSQLiteDB::SQLLITEConnection::Opened() {
+    statements = 0;
+    sampledMemory = 0;
+    CMetrics::add(CMetrics::SQL_CONNECTIONS, 1);
+}
+
+CSQLiteDB::SQLLITEConnection::SQLLITEConnection(string databasePath)
         : pCon(nullptr)
         , pStmt(nullptr)
+        , statements(0)
+        , sampledMemory(0)
         , dbPath(std::move(databasePath))
-        , iSQLEttempts_(sqlEttempts)
-        , iSQLWaitTime_(sqlWaitTime)
 {}
 
-CSQLiteDB::CSQLiteDB(string databasePath, size_t sqlEttempts, size_t sqlWaitTime)
-        : pSQLiteConn(new SQLLITEConnection(std::move(databasePath), sqlEttempts, sqlWaitTime))
+CSQLiteDB::CSQLiteDB(string databasePath, size_t sqlEttempts, size_t sqlWaitTime, size_t sqlBusyTimeout)
+        : pSQLiteConn(new SQLLITEConnection(std::move(databasePath)))
         , bConnected_(false)
+        , bWaitOnBusy_(true)
+        , bBusy_(false)
+        , bCommitPending_(false)
         , iColumnCount_(0)
+        , bStmtMeasured_(false)
+        , stmtRows_(0)
+        , stmtBusyWaits_(0)
         , fWaitFunction_([](const size_t ms){boost::this_thread::sleep(boost::posix_time::milliseconds(ms));})
+        , busyBackoff_(sqlWaitTime, sqlEttempts, sqlBusyTimeout)
 {}
 
-CSQLiteDB::ptr CSQLiteDB::new_(string databasePath, size_t sqlEttempts, size_t sqlWaitTime) {
-    ptr new_ = ptr(new CSQLiteDB(std::move(databasePath), sqlEttempts, sqlWaitTime));
+CSQLiteDB::ptr CSQLiteDB::new_(string databasePath, size_t sqlEttempts, size_t sqlWaitTime, size_t sqlBusyTimeout) {
+    ptr new_ = ptr(new CSQLiteDB(std::move(databasePath), sqlEttempts, sqlWaitTime, sqlBusyTimeout));
     return new_;
 }
 
@@ -52,6 +116,11 @@ bool CSQLiteDB::isConnected()
     return bConnected_;
 }
 
+bool CSQLiteDB::isBusy() const
+{
+    return bBusy_;
+}
+
 bool CSQLiteDB::OpenConnection(int flags)
 {
     if(bConnected_)
@@ -74,70 +143,232 @@ bool CSQLiteDB::OpenConnection(int flags)
 
     //VLOG(1) <<"OpenCon pStmt: "<<pSQLiteConn->pStmt <<" pCon: " <<pSQLiteConn->pCon;
 
-    //sqlite3_busy_timeout(pSQLiteConn->pCon, busyTimeout);
+    // sqlite will call BusyHandler instead of returning SQLITE_BUSY immediately
+    if(bConnected_){
+        pSQLiteConn->Opened();
+        sqlite3_busy_handler(pSQLiteConn->pCon, &CSQLiteDB::BusyHandler, this);
+
+        if(fChangesFunction_)
+            InstallChangesHooks();
+    }
+
+    if(bConnected_ && ! strOpenScript_.empty()){
+        BeginOperation(true);
+
+        // connection is usable without these settings, so only warn
+        if(StepAll(strOpenScript_.c_str()) != SQLITE_DONE)
+            LOG(WARNING) << "SQLITE: can't set up connection: " << strLastError_;
+    }
 
     return bConnected_;
 }
 
 IResult *CSQLiteDB::ExecuteSelect(const char *sqlQuery)
 {
-    if( ! isConnected())
-        return nullptr;
+    return Prepare(sqlQuery) ? ExecuteSelect() : nullptr;
+}
+
+IResult *CSQLiteDB::ExecuteSelect()
+{
+    iColumnCount_ = sqlite3_column_count(pSQLiteConn->pStmt);
+
+    return static_cast<IResult *>(this);
+}
 
+
+int CSQLiteDB::Execute(const char *sqlQuery, bool waitOnBusy)
+{
+    return Prepare(sqlQuery, waitOnBusy) ? Execute() : -1;
+}
+
+int CSQLiteDB::Execute()
+{
+    // inside explicit transaction statement is committed/rolled back by client
+    const bool ownTransaction = ! isInTransaction();
+
+    if( ownTransaction ){
+        // BEGIN is executed by its own statement, prepared one waits for it
+        sqlite3_stmt *stmt = pSQLiteConn->pStmt;
+        pSQLiteConn->pStmt = nullptr;
+        const bool begun = BeginImplicitTransaction();
+        pSQLiteConn->pStmt = stmt;
+
+        if( ! begun ){
+            EndStatement(0);
+            pSQLiteConn->ReleaseStmt();
+            return -1;
+        }
+    }
+
+    int rc = StepSql();
+    if( (rc != SQLITE_DONE) &&  (rc != SQLITE_ROW) ) {
+        /** Timeout or error --> exit **/
+        strLastError_ = "while executing statement, sqlite3_step returned with error_code(" + std::to_string(rc) +"): " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+        LOG_IF(WARNING, bWaitOnBusy_ || ! bBusy_) << "SQLITE: sqlite3_step returned with error_code(" << rc <<") on handle(" << pSQLiteConn->pStmt <<"): " << sqlite3_errmsg(pSQLiteConn->pCon) << std::endl
+                     << "Statement: " << (pSQLiteConn->pStmt ? sqlite3_sql(pSQLiteConn->pStmt) : "");
+        EndStatement(0);
+        pSQLiteConn->ReleaseStmt();
+        if( ownTransaction )
+            EndTransaction(false);
+        return -1;
+    }
+
+    EndStatement(sqlite3_changes(pSQLiteConn->pCon));
+    pSQLiteConn->ReleaseStmt();
+
+    if( ownTransaction && ! EndTransaction() )
+        return -1;
+
+    return sqlite3_total_changes(pSQLiteConn->pCon);
+}
+
+bool CSQLiteDB::Prepare(const char *sqlQuery, bool waitOnBusy)
+{
+    if( ! isConnected() )
+        return false;
+
+    BeginOperation(waitOnBusy);
+    BeginStatement();
     strLastError_.clear();
     iColumnCount_ = 0;
 
     if( ! PrepareSql(sqlQuery) ) {
+        /** Timeout or error --> exit **/
         strLastError_ = "prepare statement error/timeout: " + string(sqlite3_errmsg(pSQLiteConn->pCon));
-        LOG(WARNING) << "SQLITE: prepare statement error/timeout on handle(" << pSQLiteConn->pStmt <<") (" << sqlite3_errmsg(pSQLiteConn->pCon) <<")";
-        return nullptr;
+        LOG_IF(WARNING, bWaitOnBusy_ || ! bBusy_) << "SQLITE: prepare statement error/timeout on handle(" << pSQLiteConn->pStmt <<") (" << sqlite3_errmsg(pSQLiteConn->pCon) <<")";
+        EndStatement(0);
+        return false;
     }
 
-    iColumnCount_ = sqlite3_column_count(pSQLiteConn->pStmt);
-
-    return static_cast<IResult *>(this);
+    return true;
 }
 
+void CSQLiteDB::ReleasePrepared()
+{
+    ReleaseStatement();
+}
 
-int CSQLiteDB::Execute(const char *sqlQuery)
+int CSQLiteDB::ExecuteBatch(const char *sqlQueries, bool waitOnBusy)
 {
     if(!isConnected())
         return -1;
 
-    //Waiting, while DB become not busy
-    for (size_t triesToBeginTrans = 0; ! BeginTransaction(); ++triesToBeginTrans) {
-        if(! isConnected())
-            return -1;
+    BeginOperation(waitOnBusy);
 
-        VLOG(1) << "DEBUG: DB is busy! tries to begin transaction = " << triesToBeginTrans << ". Handle(" << pSQLiteConn->pStmt <<")";
-        fWaitFunction_(128);
+    // inside explicit transaction only this batch must be rolled back on error, so use savepoint
+    const bool ownTransaction = ! isInTransaction();
+
+    if( ownTransaction ){
+        if( ! BeginImplicitTransaction() )
+            return -1;
+    }else if( ! StepControlSql("SAVEPOINT exec_batch;") ){
+        strLastError_ = "can't create savepoint: " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+        return -1;
     }
 
+    if( StepAll(sqlQueries) != SQLITE_DONE ){
+        // keep error of failed statement, it is more useful for client
+        const string lastError = strLastError_;
+        const bool busy = bBusy_;
 
-    if( !PrepareSql(sqlQuery) ) {
-        /** Timeout or error --> exit **/
-        strLastError_ = "error while executing statement, (prepare statement error/timeout): " + string(sqlite3_errmsg(pSQLiteConn->pCon));
-        LOG(WARNING) << "SQLITE: error while executing statement (" << sqlite3_errmsg(pSQLiteConn->pCon) <<")";
-        EndTransaction();
+        if( ownTransaction ){
+            EndTransaction(false);
+        }else{
+            StepControlSql("ROLLBACK TO exec_batch;");
+            StepControlSql("RELEASE exec_batch;");
+        }
+
+        strLastError_ = lastError;
+        bBusy_ = busy;
         return -1;
     }
 
-    int rc = StepSql();
-    if( (rc != SQLITE_DONE) &&  (rc != SQLITE_ROW) ) {
-        /** Timeout or error --> exit **/
-        strLastError_ = "while executing statement, sqlite3_step returned with error_code(" + std::to_string(rc) +"): " + string(sqlite3_errmsg(pSQLiteConn->pCon));
-        LOG(WARNING) << "SQLITE: sqlite3_step returned with error_code(" << rc <<") on handle(" << pSQLiteConn->pStmt <<"): " << sqlite3_errmsg(pSQLiteConn->pCon) << std::endl
-                     << "Statement: " <<sqlQuery;
-        pSQLiteConn->ReleaseStmt();
-        EndTransaction();
+    if( ownTransaction ? ! EndTransaction() : ! StepControlSql("RELEASE exec_batch;") )
         return -1;
+
+    return sqlite3_total_changes(pSQLiteConn->pCon);
+}
+
+bool CSQLiteDB::ExecuteScript(const char *sqlQueries)
+{
+    if(!isConnected())
+        return false;
+
+    BeginOperation(true);
+    strLastError_.clear();
+
+    return StepAll(sqlQueries) == SQLITE_DONE;
+}
+
+bool CSQLiteDB::WalCheckpoint(int mode, int *logFrames, int *checkpointedFrames)
+{
+    if(!isConnected())
+        return false;
+
+    BeginOperation(true);
+    strLastError_.clear();
+
+    // RESTART and TRUNCATE modes call BusyHandler, while waiting for readers and writers
+    int rc = sqlite3_wal_checkpoint_v2(pSQLiteConn->pCon, nullptr, mode, logFrames, checkpointedFrames);
+    bBusy_ = (rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED);
+
+    if( rc != SQLITE_OK ){
+        strLastError_ = "checkpoint returned with error_code(" + std::to_string(rc) +"): " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+        return false;
     }
 
-    pSQLiteConn->ReleaseStmt();
+    return true;
+}
 
-    EndTransaction();
+bool CSQLiteDB::Begin(TransactionMode mode, bool waitOnBusy)
+{
+    if( isInTransaction() ){
+        strLastError_ = "transaction is already started";
+        return false;
+    }
 
-    return sqlite3_total_changes(pSQLiteConn->pCon);
+    BeginOperation(waitOnBusy);
+    strLastError_.clear();
+
+    // BeginTransaction tries to reconnect, if connection was lost. So we can try again
+    if( ! BeginTransaction(mode) && ( bBusy_ || ! isConnected() || ! BeginTransaction(mode) ) ){
+        strLastError_ = "can't begin transaction: " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+        return false;
+    }
+
+    return true;
+}
+
+bool CSQLiteDB::Commit(bool waitOnBusy)
+{
+    if( ! isInTransaction() ){
+        strLastError_ = "transaction is not started";
+        return false;
+    }
+
+    BeginOperation(waitOnBusy);
+    strLastError_.clear();
+
+    return EndTransaction(true, false);
+}
+
+bool CSQLiteDB::Rollback(bool waitOnBusy)
+{
+    if( ! isInTransaction() ){
+        strLastError_ = "transaction is not started";
+        return false;
+    }
+
+    BeginOperation(waitOnBusy);
+    strLastError_.clear();
+
+    return EndTransaction(false, false);
+}
+
+bool CSQLiteDB::isInTransaction()
+{
+    // sqlite is in autocommit mode, if there is no active transaction
+    return isConnected() && sqlite3_get_autocommit(pSQLiteConn->pCon) == 0;
 }
 
 /*Result Set Definations*/
@@ -156,23 +387,30 @@ const char *CSQLiteDB::NextColomnName(int iClmnCount)
 
 bool CSQLiteDB::Next()
 {
+    // waitOnBusy of Prepare() is kept: caller, that doesn't wait, checks isBusy() after the last row
+    BeginOperation(bWaitOnBusy_);
+
     int rc = 0;
     if( (rc = StepSql()) == SQLITE_MISUSE ){
         strLastError_ = "sqlite3_step returned missuse!";
         LOG(WARNING) << "SQLITE: sqlite3_step returned missuse on handle(" << pSQLiteConn->pStmt <<")";
+        EndStatement(stmtRows_);
         pSQLiteConn->ReleaseStmt();
         return false;
 
     }else if( rc == SQLITE_DONE ){
+        EndStatement(stmtRows_);
         return false;
 
     }else if( rc != SQLITE_ROW ){
         strLastError_ = "sqlite3_step returned with error_code(" + std::to_string(rc) +")";
-        LOG(WARNING) << "SQLITE: " + strLastError_ + " on handle(" << pSQLiteConn->pStmt <<")";
+        LOG_IF(WARNING, bWaitOnBusy_ || ! bBusy_) << "SQLITE: " + strLastError_ + " on handle(" << pSQLiteConn->pStmt <<")";
+        EndStatement(stmtRows_);
         pSQLiteConn->ReleaseStmt();
         return false;
     }
 
+    ++stmtRows_;
     return true;
 }
 
@@ -187,6 +425,8 @@ const char *CSQLiteDB::ColomnData(int clmNum)
 void CSQLiteDB::ReleaseStatement()
 {
     //VLOG(1) <<"before Release() pStmt: "<<pSQLiteConn->pStmt <<" pCon: " <<pSQLiteConn->pCon;
+    // client can stop reading rows before the end
+    EndStatement(stmtRows_);
     pSQLiteConn->ReleaseStmt();
     //VLOG(1) <<"after Release() pStmt: "<<pSQLiteConn->pStmt <<" pCon: " <<pSQLiteConn->pCon;
 }
@@ -195,8 +435,100 @@ void CSQLiteDB::setWaitFunction(std::function<void(const size_t)> waitFunc) {
     fWaitFunction_ = std::move(waitFunc);
 }
 
-bool CSQLiteDB::PrepareSql(const char *sqlQuery) {
-    int rc = 0; size_t n = 0;
+void CSQLiteDB::setOpenScript(string sqlQueries) {
+    strOpenScript_ = std::move(sqlQueries);
+}
+
+void CSQLiteDB::setChangesFunction(std::function<void(const std::vector<string> &)> changesFunc) {
+    fChangesFunction_ = std::move(changesFunc);
+
+    if(fChangesFunction_ && isConnected())
+        InstallChangesHooks();
+}
+
+void CSQLiteDB::InstallChangesHooks() {
+    changedTables_.clear();
+    sqlite3_update_hook(pSQLiteConn->pCon, &CSQLiteDB::UpdateHook, this);
+    sqlite3_commit_hook(pSQLiteConn->pCon, &CSQLiteDB::CommitHook, this);
+    sqlite3_rollback_hook(pSQLiteConn->pCon, &CSQLiteDB::RollbackHook, this);
+    sqlite3_set_authorizer(pSQLiteConn->pCon, &CSQLiteDB::Authorizer, this);
+}
+
+void CSQLiteDB::UpdateHook(void *pThis, int operation, const char *dbName, const char *table, sqlite3_int64 rowid) {
+    (void)operation, (void)rowid;
+    auto *db = static_cast<CSQLiteDB *>(pThis);
+
+    // temp tables are seen only by this connection
+    if(0 == std::strcmp(dbName, "temp"))
+        return;
+
+    // hook is called for every row, but transaction usually changes few tables
+    for(const string &changed : db->changedTables_){
+        if(changed == table)
+            return;
+    }
+
+    db->changedTables_.emplace_back(table);
+}
+
+int CSQLiteDB::CommitHook(void *pThis) {
+    // hook is called before commit is durable: changes are published by PublishChanges after step
+    static_cast<CSQLiteDB *>(pThis)->bCommitPending_ = true;
+
+    // 0 - commit isn't turned into rollback
+    return 0;
+}
+
+void CSQLiteDB::RollbackHook(void *pThis) {
+    auto *db = static_cast<CSQLiteDB *>(pThis);
+    db->changedTables_.clear();
+    db->bCommitPending_ = false;
+}
+
+int CSQLiteDB::Authorizer(void *pThis, int action, const char *arg1, const char *arg2, const char *dbName, const char *trigger) {
+    (void)pThis, (void)arg1, (void)arg2, (void)dbName, (void)trigger;
+
+    // SQLITE_IGNORE for DELETE doesn't skip it: rows are deleted one by one, so UpdateHook sees the table
+    return action == SQLITE_DELETE ? SQLITE_IGNORE : SQLITE_OK;
+}
+
+void CSQLiteDB::PublishChanges(int rc) {
+    if( ! bCommitPending_ )
+        return;
+
+    bCommitPending_ = false;
+
+    // failed COMMIT (e.g. SQLITE_BUSY) leaves transaction active: changes are kept for the next try
+    if( rc != SQLITE_DONE || ! sqlite3_get_autocommit(pSQLiteConn->pCon) || changedTables_.empty() )
+        return;
+
+    fChangesFunction_(changedTables_);
+    changedTables_.clear();
+}
+
+int CSQLiteDB::BusyHandler(void *pThis, int count) {
+    (void)count;
+    return static_cast<CSQLiteDB *>(pThis)->WaitOnBusy() ? 1 : 0;
+}
+
+bool CSQLiteDB::WaitOnBusy() {
+    if( ! bWaitOnBusy_ || busyBackoff_.expired() )
+        return false;
+
+    CMetrics::add(CMetrics::SQL_BUSY_WAITS);
+    ++stmtBusyWaits_;
+    fWaitFunction_(busyBackoff_.nextDelay());
+    return true;
+}
+
+void CSQLiteDB::BeginOperation(bool waitOnBusy) {
+    bWaitOnBusy_ = waitOnBusy;
+    bBusy_ = false;
+    busyBackoff_.restart();
+}
+
+bool CSQLiteDB::PrepareSql(const char *sqlQuery, const char **tail) {
+    int rc = 0;
 
     do
     {
@@ -206,17 +538,23 @@ bool CSQLiteDB::PrepareSql(const char *sqlQuery) {
             return false;
         }
 
-        rc = sqlite3_prepare_v2(pSQLiteConn->pCon, sqlQuery, -1, &pSQLiteConn->pStmt, nullptr);
+        const CMetrics::clock::time_point started = CMetrics::clock::now();
+        rc = sqlite3_prepare_v2(pSQLiteConn->pCon, sqlQuery, -1, &pSQLiteConn->pStmt, tail);
+        CMetrics::record(CMetrics::SQL_PREPARE, CMetrics::clock::now() - started);
 
-        if( (rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED) )
-        {
-            n++;
-            fWaitFunction_(pSQLiteConn->iSQLWaitTime_);
-        }
-    }while( (n < pSQLiteConn->iSQLEttempts_) && ((rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED)));
+        // usually SQLITE_BUSY is returned after BusyHandler has refused to wait, so WaitOnBusy() refuses too.
+        // But sqlite doesn't call BusyHandler in some cases (e.g. deadlock in WAL mode), so we wait here
+    }while( ((rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED)) && WaitOnBusy() );
+
+    bBusy_ = (rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED);
 
     if( rc != SQLITE_OK)
     {
+        if( bBusy_ && ! bWaitOnBusy_ ){
+            VLOG(1) << "DEBUG: prepare statement: db is busy (" << rc << ")";
+            return false;
+        }
+
         LOG(WARNING) << "SQLITE: prepare statement error. Returned with error_code(" << rc <<") (" << sqlite3_errmsg(pSQLiteConn->pCon) << ")" << std::endl
                      << "Statement: " <<sqlQuery;
         return false;
@@ -226,41 +564,54 @@ bool CSQLiteDB::PrepareSql(const char *sqlQuery) {
 }
 
 int CSQLiteDB::StepSql() {
-    int rc = 0; size_t n = 0;
+    int rc = 0;
 
     do
     {
+        const CMetrics::clock::time_point started = CMetrics::clock::now();
         rc = sqlite3_step(pSQLiteConn->pStmt);
+        CMetrics::record(CMetrics::SQL_STEP, CMetrics::clock::now() - started);
 
         if( rc == SQLITE_LOCKED )
         {
             rc = sqlite3_reset(pSQLiteConn->pStmt); /** Note: This will return SQLITE_LOCKED as well... **/
-            n++;
-            fWaitFunction_(pSQLiteConn->iSQLWaitTime_);
-        }
-        else if( rc == SQLITE_BUSY )
-        {
-            fWaitFunction_(pSQLiteConn->iSQLWaitTime_);
-            n++;
         }
-    }while( (n < pSQLiteConn->iSQLEttempts_) && ((rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED)));
 
-    if( n == pSQLiteConn->iSQLEttempts_ ) {
-        VLOG(1) << "DEBUG: timeout on handle(" << pSQLiteConn->pStmt <<"): (" << rc << ")";
-    }
+        // usually SQLITE_BUSY is returned after BusyHandler has refused to wait, so WaitOnBusy() refuses too.
+        // But sqlite doesn't call BusyHandler in some cases (e.g. deadlock in WAL mode), so we wait here
+    }while( ((rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED)) && WaitOnBusy() );
+
+    bBusy_ = (rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED);
 
-    if( n > 2 ) {
-        VLOG(1) << "DEBUG: tries on handle(" << pSQLiteConn->pStmt <<"): (" << n << ")";
+    if( bBusy_ ) {
+        VLOG(1) << "DEBUG: busy on handle(" << pSQLiteConn->pStmt <<"): (" << rc << ") tries: " << busyBackoff_.attempts()
+                << " waited: " << busyBackoff_.elapsed() << "ms";
     }
 
     if( rc == SQLITE_MISUSE ){
         LOG(WARNING) << "SQLITE: missuse ?? on handle(" << pSQLiteConn->pStmt <<")";
     }
 
+    PublishChanges(rc);
+
     return(rc);
 }
 
-bool CSQLiteDB::BeginTransaction() {
+bool CSQLiteDB::BeginImplicitTransaction() {
+    // BeginTransaction tries to reconnect, if connection was lost. So we can try again
+    if( BeginTransaction(IMMEDIATE) || ( ! bBusy_ && isConnected() && BeginTransaction(IMMEDIATE) ) )
+        return true;
+
+    strLastError_ = bBusy_ ? "database is busy, tries to begin transaction = " + std::to_string(busyBackoff_.attempts())
+                           : "can't begin transaction: " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+    VLOG(1) << "DEBUG: " << strLastError_ << ". Handle(" << pSQLiteConn->pStmt <<")";
+    return false;
+}
+
+bool CSQLiteDB::BeginTransaction(TransactionMode mode) {
+    static const char *const beginSql[] = { "BEGIN DEFERRED TRANSACTION;",
+                                            "BEGIN IMMEDIATE TRANSACTION;",
+                                            "BEGIN EXCLUSIVE TRANSACTION;" };
 
     if( ! isConnected() ){
         strLastError_ = "no DB connection!";
@@ -269,8 +620,8 @@ bool CSQLiteDB::BeginTransaction() {
         return false;
     }
 
-    if( !PrepareSql("BEGIN EXCLUSIVE TRANSACTION;") ) {
-        LOG(WARNING) << "SQLITE: begin Transaction error/timeout";
+    if( !PrepareSql(beginSql[mode]) ) {
+        LOG_IF(WARNING, bWaitOnBusy_ || ! bBusy_) << "SQLITE: begin Transaction error/timeout";
         return false;
     }
 
@@ -279,14 +630,14 @@ bool CSQLiteDB::BeginTransaction() {
     pSQLiteConn->ReleaseStmt();
 
     if( rc != SQLITE_DONE ){
-        LOG(WARNING) << "SQLITE: begin Transaction error/timeout on handle(" << pSQLiteConn->pStmt <<"): (" << rc << ") " << sqlite3_errmsg(pSQLiteConn->pCon);
+        LOG_IF(WARNING, bWaitOnBusy_ || ! bBusy_) << "SQLITE: begin Transaction error/timeout on handle(" << pSQLiteConn->pStmt <<"): (" << rc << ") " << sqlite3_errmsg(pSQLiteConn->pCon);
         return false;
     }
 
     return true;
 }
 
-bool CSQLiteDB::EndTransaction() {
+bool CSQLiteDB::EndTransaction(bool commit, bool forceWait) {
 
     if( ! isConnected() ){
         strLastError_ = "no DB connection!";
@@ -294,23 +645,125 @@ bool CSQLiteDB::EndTransaction() {
         return false;
     }
 
-    if( ! PrepareSql("COMMIT;") ) {
-        strLastError_ = "end Transaction error";
-        LOG(WARNING) << "SQLITE: " << strLastError_ << " on handle(" << pSQLiteConn->pStmt <<")";
+    if( ! StepControlSql(commit ? "COMMIT;" : "ROLLBACK;", forceWait) ){
+        strLastError_ = commit ? "end Transaction error/timeout" : "rollback Transaction error/timeout";
+        LOG_IF(WARNING, bWaitOnBusy_ || ! bBusy_) << "SQLITE: " << strLastError_ << ": " << sqlite3_errmsg(pSQLiteConn->pCon);
         return false;
     }
 
-    int rc = StepSql();
+    return true;
+}
 
-    pSQLiteConn->ReleaseStmt();
+int CSQLiteDB::StepAll(const char *sqlQueries) {
+    // sqlite prepares only first statement from string and returns pointer to the rest of it (tail)
+    const char *nextQuery = sqlQueries;
+    int rc = SQLITE_DONE;
 
-    if( rc != SQLITE_DONE ){
-        strLastError_ = "end Transaction error/timeout";
-        LOG(WARNING) << "SQLITE: " << strLastError_ << " on handle(" << pSQLiteConn->pStmt <<"): (" << rc << ") " << sqlite3_errmsg(pSQLiteConn->pCon);
-        return false;
+    while( nextQuery && *nextQuery ){
+        const char *tail = nullptr;
+
+        if( ! PrepareSql(nextQuery, &tail) ){
+            strLastError_ = "error while executing batch, (prepare statement error/timeout): " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+            return SQLITE_ERROR;
+        }
+
+        nextQuery = tail;
+
+        // comment or whitespace
+        if( ! pSQLiteConn->pStmt )
+            continue;
+
+        while( (rc = StepSql()) == SQLITE_ROW );
+
+        pSQLiteConn->ReleaseStmt();
+
+        if( rc != SQLITE_DONE ){
+            strLastError_ = "while executing batch, sqlite3_step returned with error_code(" + std::to_string(rc) +"): " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+            LOG_IF(WARNING, bWaitOnBusy_ || ! bBusy_) << "SQLITE: " << strLastError_;
+            return rc;
+        }
     }
 
-    return true;
+    return rc;
+}
+
+bool CSQLiteDB::StepControlSql(const char *sqlQuery, bool forceWait) {
+    // transaction control statements must not give up on busy db (e.g. readers in rollback journal mode),
+    // we already hold the lock and must release it. Caller, that can try again later, doesn't force it
+    const bool waitOnBusy = bWaitOnBusy_;
+    bWaitOnBusy_ = bWaitOnBusy_ || forceWait;
+
+    int rc = SQLITE_ERROR;
+
+    if( PrepareSql(sqlQuery) ){
+        rc = StepSql();
+        pSQLiteConn->ReleaseStmt();
+    }
+
+    bWaitOnBusy_ = waitOnBusy;
+
+    return rc == SQLITE_DONE;
+}
+
+void CSQLiteDB::BeginStatement() {
+    bStmtMeasured_ = true;
+    stmtRows_ = 0;
+    stmtBusyWaits_ = 0;
+    stmtStarted_ = std::chrono::steady_clock::now();
+}
+
+void CSQLiteDB::EndStatement(int64_t rows) {
+    if( ! bStmtMeasured_ )
+        return;
+
+    bStmtMeasured_ = false;
+
+    const std::chrono::steady_clock::duration duration = std::chrono::steady_clock::now() - stmtStarted_;
+
+    if( ! CSlowQueryLog::isSlow(duration) || ! pSQLiteConn->pStmt )
+        return;
+
+    const CSlowQueryLog::Entry entry{ sqlite3_sql(pSQLiteConn->pStmt), duration, rows, stmtBusyWaits_ };
+    const string fingerprint = CSlowQueryLog::Fingerprint(entry.sql);
+
+    CSlowQueryLog::Record(fingerprint, entry, CSlowQueryLog::needsPlan(fingerprint) ? ExplainQueryPlan(entry.sql) : string());
+}
+
+bool CSQLiteDB::isReadOnly() {
+    sqlite3_stmt *stmt = pSQLiteConn->pStmt;
+
+    // comment or whitespace isn't prepared to statement
+    return stmt && sqlite3_stmt_readonly(stmt) && sqlite3_column_count(stmt) > 0;
+}
+
+string CSQLiteDB::ExplainQueryPlan(const char *sqlQuery) {
+    sqlite3_stmt *stmt = nullptr;
+    const string explainSql = "EXPLAIN QUERY PLAN " + string(sqlQuery);
+
+    if( SQLITE_OK != sqlite3_prepare_v2(pSQLiteConn->pCon, explainSql.c_str(), -1, &stmt, nullptr) ){
+        sqlite3_finalize(stmt);
+        return "can't explain: " + string(sqlite3_errmsg(pSQLiteConn->pCon));
+    }
+
+    // columns: id, parent, notused, detail. Steps are indented under their parent step
+    std::map<int, size_t> depth;
+    string plan;
+
+    while( sqlite3_step(stmt) == SQLITE_ROW ){
+        const int id = sqlite3_column_int(stmt, 0);
+        const int parent = sqlite3_column_int(stmt, 1);
+        const char *detail = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
+
+        depth[id] = depth.count(parent) ? depth[parent] + 1 : 0;
+
+        if( ! plan.empty() )
+            plan += '\n';
+        plan += string(depth[id] * 2, ' ') + (detail ? detail : "");
+    }
+
+    sqlite3_finalize(stmt);
+
+    return plan;
 }
 
 CSQLiteDB::~CSQLiteDB() {/*VLOG(1) <<"By, db!!!";//*/}
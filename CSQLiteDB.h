@@ -8,10 +8,14 @@
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <chrono>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 #include "sqlite3/sqlite3.h"
 #include "glog/logging.h"
+#include "CBackoff.h"
 
 using std::string;
 using boost::scoped_ptr;
@@ -45,8 +49,10 @@ public:
 //SQLite Wrapper Class
 class CSQLiteDB : public IResult
         , public boost::enable_shared_from_this<CSQLiteDB> {
+    friend class CBulkLoader;
+
 private:
-    explicit CSQLiteDB(string databasePath, size_t sqlEttempts, size_t sqlWaitTime);
+    explicit CSQLiteDB(string databasePath, size_t sqlEttempts, size_t sqlWaitTime, size_t sqlBusyTimeout);
 
 public:
 
@@ -54,8 +60,11 @@ public:
 
     typedef shared_ptr<CSQLiteDB> ptr;
 
+    /*Modes of explicit transaction (see 'BEGIN' in sqlite docs)*/
+    enum TransactionMode{ DEFERRED = 0, IMMEDIATE, EXCLUSIVE };
+
     /*Class factory. This method create shared pointer to CSQLiteDB.*/
-    static ptr new_(string databasePath, size_t sqlEttempts = 200, size_t sqlWaitTime = 50);
+    static ptr new_(string databasePath, size_t sqlEttempts = 200, size_t sqlWaitTime = 50, size_t sqlBusyTimeout = 10000);
 
     bool OpenConnection(int flags = SQLITE_OPEN_FULLMUTEX|SQLITE_OPEN_READWRITE);
 
@@ -64,8 +73,55 @@ public:
     IResult *ExecuteSelect(const char *sqlQuery);
 
     /*This Method called when INSERT/DELETE/UPDATE sqlQuery to be excuted.
-    Return int count of effected data on success*/
-    int Execute(const char *sqlQuery);
+    Return int count of effected data on success.
+    If waitOnBusy is FALSE, method doesn't wait for busy db, check isBusy() on fail*/
+    int Execute(const char *sqlQuery, bool waitOnBusy = true);
+
+    /*Prepare sqlQuery, so it can be classified by isReadOnly() before execution.
+    Prepared statement must be executed by ExecuteSelect() or Execute() or released by ReleasePrepared().
+    Return FALSE on error (if waitOnBusy is FALSE, check isBusy())*/
+    bool Prepare(const char *sqlQuery, bool waitOnBusy = true);
+
+    /*Release statement, prepared by Prepare(), without execution*/
+    void ReleasePrepared();
+
+    /*Same as ExecuteSelect(sqlQuery) and Execute(sqlQuery) for statement, prepared by Prepare()*/
+    IResult *ExecuteSelect();
+
+    int Execute();
+
+    /*This Method execute all statements from sqlQueries (separated by ';') in one transaction.
+    If one of statements failed, changes of all statements are rolled back.
+    Return int count of effected data on success else -1*/
+    int ExecuteBatch(const char *sqlQueries, bool waitOnBusy = true);
+
+    /*This Method execute all statements from sqlQueries one by one without transaction (e.g. PRAGMAs).
+    Rows returned by statements are skipped. Return FALSE on first failed statement*/
+    bool ExecuteScript(const char *sqlQueries);
+
+    /*Checkpoint WAL file (see sqlite3_wal_checkpoint_v2). Return FALSE on error or if db is busy.
+    logFrames and checkpointedFrames can be nullptr*/
+    bool WalCheckpoint(int mode, int *logFrames = nullptr, int *checkpointedFrames = nullptr);
+
+    /*Begin explicit transaction. Until Commit() or Rollback() Execute and ExecuteBatch
+    don't begin/commit own transaction.
+    If waitOnBusy is FALSE, method doesn't wait for busy db, check isBusy() on fail*/
+    bool Begin(TransactionMode mode = DEFERRED, bool waitOnBusy = true);
+
+    /*Commit explicit transaction. Failed COMMIT leaves transaction active, so it can be tried again.
+    If waitOnBusy is FALSE, method doesn't wait for busy db, check isBusy() on fail*/
+    bool Commit(bool waitOnBusy = true);
+
+    /*Rollback explicit transaction. If waitOnBusy is FALSE, method doesn't wait for busy db, check isBusy() on fail*/
+    bool Rollback(bool waitOnBusy = true);
+
+    /*Return TRUE if explicit transaction is started*/
+    bool isInTransaction();
+
+    /*Return TRUE if statement, prepared by Prepare(), only reads db and returns rows (see sqlite3_stmt_readonly),
+    so it can be executed by ExecuteSelect() without write transaction.
+    BEGIN/COMMIT/ATTACH... (they return no rows) aren't read-only*/
+    bool isReadOnly();
 
     /*This Method for backup Db*/
     bool BackupDb(
@@ -82,18 +138,38 @@ public:
     /*Return TRUE if databse is connected else FALSE*/
     bool  isConnected() ;
 
+    /*Return TRUE if last operation failed, because db was busy or locked by other connection*/
+    bool  isBusy() const;
+
     void setWaitFunction(std::function<void(size_t)> waitFunc);
 
+    /*Statements (e.g. PRAGMAs), that are executed every time connection is opened (also on reconnect)*/
+    void setOpenScript(string sqlQueries);
+
+    /*changesFunc is called with names of tables, that were changed by transaction, after its COMMIT succeeded
+    (see sqlite3_update_hook, sqlite3_commit_hook). It's called by thread of COMMIT, so it must be short.
+    Tables of rolled back savepoints are reported too. DELETE without WHERE deletes rows one by one (see Authorizer),
+    so it is reported. Changes of WITHOUT ROWID tables aren't seen by sqlite3_update_hook and aren't reported*/
+    void setChangesFunction(std::function<void(const std::vector<string> &)> changesFunc);
+
 protected:
     /*SQLite Connection Object*/
     struct SQLLITEConnection{
-        size_t          iSQLWaitTime_;
-        size_t          iSQLEttempts_;
+        enum { DB_STATUS_PERIOD = 64 };   //Statements between samples of sqlite3_db_status
+
         string          dbPath;    //Path to database
         sqlite3		    *pCon;     //SQLite Connection Object
         sqlite3_stmt    *pStmt;     //SQLite statement object
+        size_t          statements;     //Statements since last sample of db status
+        long long       sampledMemory;  //Memory of connection, that is counted in CMetrics
         void ReleaseStmt();
-        SQLLITEConnection(string databasePath, size_t sqlEttempts, size_t sqlWaitTime);
+        /*Add counters of finished statement (sqlite3_stmt_status) to CMetrics*/
+        void SampleStmtStatus();
+        /*Add cache hits/misses since last sample and change of memory (sqlite3_db_status) to CMetrics*/
+        void SampleDbStatus();
+        /*Count connection in CMetrics. Called after connection is opened*/
+        void Opened();
+        explicit SQLLITEConnection(string databasePath);
         virtual ~SQLLITEConnection();
     };
 
@@ -102,18 +178,83 @@ protected:
 
     std::function<void(const size_t)> fWaitFunction_;
 
-    bool PrepareSql(const char *sqlQuery);
+    std::function<void(const std::vector<string> &)> fChangesFunction_;
+
+    /*Tables, that were changed by current transaction*/
+    std::vector<string> changedTables_;
+
+    /*Commit hook was called by current step. Commit can still fail (e.g. SQLITE_BUSY), so changes are published after step*/
+    bool bCommitPending_;
+
+    /*Call fChangesFunction_, if step, that called commit hook, has committed transaction*/
+    void PublishChanges(int rc);
+
+    /*Register hooks of sqlite, that collect changedTables_*/
+    void InstallChangesHooks();
+
+    static void UpdateHook(void *pThis, int operation, const char *dbName, const char *table, sqlite3_int64 rowid);
+
+    static int CommitHook(void *pThis);
+
+    static void RollbackHook(void *pThis);
+
+    /*sqlite3_set_authorizer callback. Allows everything, but disables truncate optimization of DELETE,
+    which deletes all rows without calling UpdateHook*/
+    static int Authorizer(void *pThis, int action, const char *arg1, const char *arg2, const char *dbName, const char *trigger);
+
+    /*Backoff of current operation. Restarted by Prepare, Next and Execute*/
+    CBackoff busyBackoff_;
+
+    /*Called by sqlite, when db is busy. Return 0 to stop waiting*/
+    static int BusyHandler(void *pThis, int count);
+
+    /*Wait before next attempt. Return FALSE, if we shouldn't wait anymore*/
+    bool WaitOnBusy();
+
+    /*Restart busyBackoff_ before new operation*/
+    void BeginOperation(bool waitOnBusy);
+
+    bool PrepareSql(const char *sqlQuery, const char **tail = nullptr);
 
     int StepSql();
 
-    bool BeginTransaction();
+    /*Begin transaction for one Execute/ExecuteBatch. Reconnect and try again, if connection was lost*/
+    bool BeginImplicitTransaction();
+
+    bool BeginTransaction(TransactionMode mode);
+
+    /*Commit or rollback current transaction. If forceWait is FALSE, waitOnBusy of BeginOperation() is used*/
+    bool EndTransaction(bool commit = true, bool forceWait = true);
+
+    /*Prepare and step all statements from sqlQueries. Return SQLITE_DONE on success*/
+    int StepAll(const char *sqlQueries);
+
+    /*Execute BEGIN/COMMIT/ROLLBACK/SAVEPOINT... Waits on busy db, unless forceWait is FALSE
+    (then waitOnBusy of BeginOperation() is used)*/
+    bool StepControlSql(const char *sqlQuery, bool forceWait = true);
 
-    bool EndTransaction();
+    /*Start measuring statement of ExecuteSelect/Execute for slow query log*/
+    void BeginStatement();
+
+    /*Finish measuring, started by BeginStatement(). Must be called before statement is released.
+    If statement was slow, it's recorded in CSlowQueryLog*/
+    void EndStatement(int64_t rows);
+
+    /*Return plan of sqlQuery (EXPLAIN QUERY PLAN), one line per step. Current statement isn't touched*/
+    string ExplainQueryPlan(const char *sqlQuery);
 
     bool	bConnected_;      /*Is Connected To DB*/
+    bool    bWaitOnBusy_;     /*Wait or not, while db is busy in current operation*/
+    bool    bBusy_;           /*Last operation failed, because db was busy*/
     string  strLastError_;    /*Last Error String*/
+    string  strOpenScript_;   /*Executed after connection is opened*/
     int     iColumnCount_;    /*No.Of Column in Result*/
 
+    bool    bStmtMeasured_;   /*Statement is measured by BeginStatement()*/
+    int64_t stmtRows_;        /*Rows, returned by measured SELECT*/
+    size_t  stmtBusyWaits_;   /*Waits on busy db during measured statement*/
+    std::chrono::steady_clock::time_point stmtStarted_;
+
 private:
     /*This function return of count of column
       present in result set of last excueted sqlQuery*/
@@ -124,7 +265,8 @@ private:
 
     /*This function returns TRUE if still rows are
     der in result set of last excueted sqlQuery FALSE
-    if no row present*/
+    if no row present. Waits for busy db, if statement was prepared with waitOnBusy.
+    Otherwise returns FALSE on busy db and releases statement (check isBusy())*/
     bool  Next() override;
 
     /*Get the next coloumn data*/
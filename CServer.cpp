@@ -2,48 +2,451 @@
 
 #include <boost/asio/io_context.hpp>
 #include "glog/logging.h"
+#include "CSlowQueryLog.h"
+
+#include <csignal>
+#include <cstdio>
+#include <stdexcept>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#endif // WIN32
 
 void CServer::Start()
 {
-	LOG(INFO) << "Server started at: " << acceptor_.local_endpoint() << std::endl;
+	init_contexts();
+
+	LOG(INFO) << "Server started at: " << endpoint_ << " (" << thread_num_ << " threads, "
+			  << (contextPerCore_ ? std::to_string(contexts_.size()) + " io_contexts, " + std::to_string(acceptors_.size()) + " acceptors"
+								  : string("shared io_context"))
+			  << ", backlog " << acceptSettings_.backlog << ", pending accepts " << acceptSettings_.pendingAccepts
+			  << ", max connections " << acceptSettings_.maxConnections << ")" << std::endl;
+
+	for(auto &idleWheel : idleWheels_)
+		idleWheel->start();
+
+	if( ! acceptSettings_.localPath.empty() )
+		open_local_acceptor();
+
+	if(metricsPort != 0)
+		start_metrics_endpoint();
+
+	slowQueryTimer_.reset(new deadline_timer(io_context_));
+	post_slow_query_report();
+
+	signals_.reset(new signal_set(io_context_, SIGINT, SIGTERM));
+	signals_->async_wait([this](const boost::system::error_code &err, int signal){
+		if( ! err )
+			Stop(signal);
+	});
 
-	// init first client
-	VLOG(1) << "DEBUG: init first client";
-	CClientSession::ptr client = CClientSession::new_(io_context_, maxTimeout_, businessLogic_);
+	// checkpoints of WAL are made in background, instead of COMMIT of clients
+	businessLogic_->startCheckpointScheduler(dbPath, checkpointInterval, walSizeLimit);
 
 	// accept first client
 	VLOG(1) << "DEBUG: accept first client";
-	acceptor_.async_accept(client->sock(), bind(&CServer::do_accept, this, client, _1));
+	for( size_t i = 0; i < acceptors_.size(); ++i )
+		for( size_t j = 0; j < acceptSettings_.pendingAccepts; ++j )
+			accept_next(i);
 
 	// start listen
 	VLOG(1) << "DEBUG: start listening";
 	start_listen();
 
-	threads.join_all(); 
+	if(acceptSettings_.onStarted)
+		acceptSettings_.onStarted(*this);
+
+	threads.join_all();
 }
 
-void CServer::do_accept(CClientSession::ptr client, const boost::system::error_code & err)
+void CServer::Stop(int signal)
 {
-  // if err != 0, CHECK will write to log and exit with error.
-	CHECK(!err) << "\nAccepting client faild with error: " << err << ". Closing server...";
+	LOG(INFO) << "Server is stopping (signal " << signal << ")";
 
-	client->start();
-	CClientSession::ptr new_client = CClientSession::new_(io_context_, maxTimeout_, businessLogic_);
+	for(auto context : contexts_)
+		context->stop();
+
+	if(background_)
+		background_->stop();
+}
+
+void CServer::init_contexts()
+{
+	contexts_.push_back(&io_context_);
+	idleWheels_.push_back(CIdleWheel::new_(io_context_, maxTimeout_));
+
+	if( ! contextPerCore_ ){
+		acceptors_.emplace_back(new tcp::acceptor(io_context_));
+		acceptStrands_.emplace_back(new io_context::strand(io_context_));
+		open_acceptor(*acceptors_.back(), false);
+		return;
+	}
+
+	for( int i = 1; i < thread_num_; ++i ){
+		ownContexts_.emplace_back(new io_context(1));
+		contexts_.push_back(ownContexts_.back().get());
+		idleWheels_.push_back(CIdleWheel::new_(*contexts_.back(), maxTimeout_));
+	}
+
+	// contexts without acceptor and clients mustn't return from run()
+	for(auto context : contexts_)
+		workGuards_.push_back(make_work_guard(*context));
+
+	background_.reset(new io_context());
+	workGuards_.push_back(make_work_guard(*background_));
+
+#ifdef SO_REUSEPORT
+	// kernel spreads connections between acceptors
+	for(auto context : contexts_){
+		acceptors_.emplace_back(new tcp::acceptor(*context));
+		acceptStrands_.emplace_back(new io_context::strand(*context));
+		open_acceptor(*acceptors_.back(), true);
+	}
+#else
+	// one acceptor hands clients to contexts round-robin
+	acceptors_.emplace_back(new tcp::acceptor(io_context_));
+	acceptStrands_.emplace_back(new io_context::strand(io_context_));
+	open_acceptor(*acceptors_.back(), false);
+#endif
+}
+
+void CServer::open_acceptor(tcp::acceptor &acceptor, bool reusePort)
+{
+	acceptor.open(endpoint_.protocol());
+	acceptor.set_option(tcp::acceptor::reuse_address(true));
+
+#ifdef SO_REUSEPORT
+	if(reusePort)
+		acceptor.set_option(detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+
+	acceptor.bind(endpoint_);
+	acceptor.listen(acceptSettings_.backlog);
+}
+
+void CServer::do_accept(size_t acceptorIndex, CTcpSession::ptr client, size_t retryDelayMs, const boost::system::error_code & err)
+{
+	if(err == error::operation_aborted)
+		return;
+
+	if(err){
+		CMetrics::add(CMetrics::ACCEPT_ERRORS);
 
+		if(is_resource_error(err)){
+			// accepting right now fails again and loads CPU, so wait, while existing clients go away.
+			// Log only first error of series
+			LOG_IF(WARNING, retryDelayMs == 0) << "Accepting client failed with error: " << err.message() << ". Accepting is slowed down";
+			retryDelayMs = std::min<size_t>(std::max<size_t>(retryDelayMs * 2, MIN_RETRY_DELAY), MAX_RETRY_DELAY);
+			accept_later(acceptorIndex, retryDelayMs);
+		}else{
+			// e.g. client has reset connection before accept. It doesn't affect other clients
+			LOG(WARNING) << "Accepting client failed with error: " << err.message();
+			accept_next(acceptorIndex);
+		}
+		return;
+	}
+
+	// accept next client before starting current, so clients are started in parallel
 	VLOG(1) << "DEBUG: accept next client";
-	acceptor_.async_accept(new_client->sock(), bind(&CServer::do_accept, this, new_client, _1));
+	accept_next(acceptorIndex);
+
+	if( ! admit() ){
+		reject(client->sock());
+		return;
+	}
+
+	client->start();
+}
+
+bool CServer::admit()
+{
+	// limit isn't exact: clients, accepted at the same time, can exceed it a bit
+	if(acceptSettings_.maxConnections > 0 && CClientSession::count() >= acceptSettings_.maxConnections){
+		LOG_IF(WARNING, rejected_++ % 100 == 0) << "Client is rejected: max connections (" << acceptSettings_.maxConnections
+												<< ") are reached. Rejected clients: " << rejected_;
+		CMetrics::add(CMetrics::CONNECTIONS_REJECTED);
+		return false;
+	}
+
+	CMetrics::add(CMetrics::CONNECTIONS_ACCEPTED);
+	return true;
+}
+
+void CServer::accept_next(size_t acceptorIndex, size_t retryDelayMs)
+{
+	size_t contextIndex = acceptorIndex;
+
+	if(acceptors_.size() < contexts_.size())
+		contextIndex = nextContext_++ % contexts_.size();
+
+	io_context &background = background_ ? *background_ : io_context_;
+	CTcpSession::ptr new_client = CTcpSession::new_(*contexts_[contextIndex], background, idleWheels_[contextIndex], businessLogic_);
+
+	dispatch(*acceptStrands_[acceptorIndex], [this, acceptorIndex, new_client, retryDelayMs](){
+		acceptors_[acceptorIndex]->async_accept(new_client->sock(), bind(&CServer::do_accept, this, acceptorIndex, new_client, retryDelayMs, _1));
+	});
+}
+
+void CServer::accept_later(size_t acceptorIndex, size_t retryDelayMs)
+{
+	auto timer = boost::make_shared<deadline_timer>(*contexts_[acceptorIndex], boost::posix_time::millisec(retryDelayMs));
+	timer->async_wait([this, timer, acceptorIndex, retryDelayMs](const boost::system::error_code &err){
+		if( ! err )
+			accept_next(acceptorIndex, retryDelayMs);
+	});
+}
+
+template<class Socket>
+void CServer::reject(Socket &sock)
+{
+	static const string msg("Server is busy at the moment. Too many connections");
+	boost::system::error_code err;
+
+	// don't wait for slow client: if message doesn't fit in socket buffer, client gets only part of it
+	sock.non_blocking(true, err);
+	sock.write_some(buffer(msg), err);
+	sock.shutdown(Socket::shutdown_both, err);
+	sock.close(err);
+}
+
+void CServer::open_local_acceptor()
+{
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	const local::stream_protocol::endpoint endpoint(acceptSettings_.localPath);
+
+	// file of socket isn't removed, when server is killed, and bind fails on existing file.
+	// Only socket, that nobody listens, is removed: other files and socket of running server are kept
+	struct stat st;
+	if(0 == ::stat(acceptSettings_.localPath.c_str(), &st)){
+		const string error("Can't create local socket '" + acceptSettings_.localPath + "': ");
+
+		if( ! S_ISSOCK(st.st_mode) )
+			throw std::runtime_error(error + "file exists and isn't socket");
+
+		boost::system::error_code err;
+		local::stream_protocol::socket probe(io_context_);
+		probe.connect(endpoint, err);
+
+		if(err != boost::asio::error::connection_refused)
+			throw std::runtime_error(error + (err ? err.message() : string("it is used by other process")));
+
+		std::remove(acceptSettings_.localPath.c_str());
+	}
+
+	localAcceptor_.reset(new local::stream_protocol::acceptor(io_context_));
+	localStrand_.reset(new io_context::strand(io_context_));
+	localAcceptor_->open(endpoint.protocol());
+	localAcceptor_->bind(endpoint);
+	localAcceptor_->listen(acceptSettings_.backlog);
+
+	LOG(INFO) << "Server started at local socket: " << acceptSettings_.localPath;
+
+	for( size_t i = 0; i < acceptSettings_.pendingAccepts; ++i )
+		accept_local();
+#else
+	LOG(WARNING) << "Local socket '" << acceptSettings_.localPath << "' isn't supported on this platform";
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+}
+
+void CServer::accept_local(size_t retryDelayMs)
+{
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	const size_t contextIndex = nextContext_++ % contexts_.size();
+
+	io_context &background = background_ ? *background_ : io_context_;
+	CLocalSession::ptr new_client = CLocalSession::new_(*contexts_[contextIndex], background, idleWheels_[contextIndex], businessLogic_);
+
+	dispatch(*localStrand_, [this, new_client, retryDelayMs](){
+		localAcceptor_->async_accept(new_client->sock(), [this, new_client, retryDelayMs](const boost::system::error_code &err){
+			if(err == error::operation_aborted)
+				return;
+
+			if(err){
+				CMetrics::add(CMetrics::ACCEPT_ERRORS);
+
+				if( ! is_resource_error(err) ){
+					LOG(WARNING) << "Accepting local client failed with error: " << err.message();
+					accept_local();
+					return;
+				}
+
+				// the same as for TCP clients: wait, while existing clients go away
+				LOG_IF(WARNING, retryDelayMs == 0) << "Accepting local client failed with error: " << err.message() << ". Accepting is slowed down";
+				const size_t delay = std::min<size_t>(std::max<size_t>(retryDelayMs * 2, MIN_RETRY_DELAY), MAX_RETRY_DELAY);
+				auto timer = boost::make_shared<deadline_timer>(io_context_, boost::posix_time::millisec(delay));
+				timer->async_wait([this, timer, delay](const boost::system::error_code &err){
+					if( ! err )
+						accept_local(delay);
+				});
+				return;
+			}
+
+			accept_local();
+
+			if( ! admit() ){
+				reject(new_client->sock());
+				return;
+			}
+
+			new_client->start();
+		});
+	});
+#else
+	(void)retryDelayMs;
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+}
+
+bool CServer::ConnectInProcess(CMemoryStream &client)
+{
+	const size_t contextIndex = nextContext_++ % contexts_.size();
+
+	io_context &background = background_ ? *background_ : io_context_;
+	CMemorySession::ptr new_client = CMemorySession::new_(*contexts_[contextIndex], background, idleWheels_[contextIndex], businessLogic_);
+
+	CMemoryStream::Connect(client, new_client->sock());
+
+	// there is nothing to say to rejected client: destroyed session closes stream and client gets eof
+	if( ! admit() )
+		return false;
+
+	new_client->start();
+	return true;
+}
+
+bool CServer::is_resource_error(const boost::system::error_code &err)
+{
+	namespace errc = boost::system::errc;
+
+	return err == errc::too_many_files_open
+		|| err == errc::too_many_files_open_in_system
+		|| err == errc::no_buffer_space
+		|| err == errc::not_enough_memory;
+}
+
+void CServer::start_metrics_endpoint()
+{
+	// stats aren't protected, so they are available only locally
+	const tcp::endpoint endpoint(ip::address_v4::loopback(), metricsPort);
+
+	metricsAcceptor_.reset(new tcp::acceptor(io_context_));
+	metricsAcceptor_->open(endpoint.protocol());
+	metricsAcceptor_->set_option(tcp::acceptor::reuse_address(true));
+	metricsAcceptor_->bind(endpoint);
+	metricsAcceptor_->listen();
+
+	LOG(INFO) << "Metrics are available at: http://" << endpoint << "/metrics";
+
+	accept_metrics_client();
+}
+
+void CServer::accept_metrics_client()
+{
+	auto sock = boost::make_shared<tcp::socket>(io_context_);
+
+	metricsAcceptor_->async_accept(*sock, [this, sock](const boost::system::error_code &err){
+		if(err == error::operation_aborted)
+			return;
+
+		accept_metrics_client();
+
+		if(err){
+			LOG(WARNING) << "Accepting metrics client failed with error: " << err.message();
+			return;
+		}
+
+		// request isn't parsed: any request gets all metrics
+		auto request = boost::make_shared<boost::asio::streambuf>(MAX_METRICS_REQUEST);
+		async_read_until(*sock, *request, "\r\n\r\n", [this, sock, request](const boost::system::error_code &err, size_t){
+			if(err)
+				return;
+
+			auto response = boost::make_shared<string>("HTTP/1.0 200 OK\r\n"
+													   "Content-Type: text/plain; version=0.0.4\r\n"
+													   "Connection: close\r\n\r\n");
+			*response += businessLogic_->getStats();
+
+			async_write(*sock, buffer(*response), [sock, response](const boost::system::error_code &, size_t){
+				boost::system::error_code err;
+				sock->shutdown(tcp::socket::shutdown_both, err);
+			});
+		});
+	});
+}
+
+void CServer::post_slow_query_report()
+{
+	slowQueryTimer_->expires_from_now(boost::posix_time::millisec(slowQueryReportInterval));
+	slowQueryTimer_->async_wait([this](const boost::system::error_code &err){
+		if(err)
+			return;
+
+		CSlowQueryLog::Report();
+		post_slow_query_report();
+	});
 }
 
 void CServer::start_listen()
 {
-	// run io_context in thread_num_ of threads
-	for( int i = 0; i < thread_num_; ++i )
+	if( ! contextPerCore_ ){
+		// run io_context in thread_num_ of threads
+		for( int i = 0; i < thread_num_; ++i )
+		{
+			threads.create_thread(
+				[this]()
+				{
+					this->io_context_.run();
+				}
+			);
+		}
+		return;
+	}
+
+	// each context is run by one thread
+	for( size_t i = 0; i < contexts_.size(); ++i )
+	{
+		io_context *context = contexts_[i];
+		boost::thread *thread = threads.create_thread(
+			[context]()
+			{
+				context->run();
+			}
+		);
+
+		if(pinThreads_ && ! pin_thread(*thread, static_cast<unsigned>(i)))
+			LOG(WARNING) << "Can't pin thread " << i << " to core";
+	}
+
+	for( int i = 0; i < BACKGROUND_THREADS; ++i )
 	{
 		threads.create_thread(
 			[this]()
 			{
-				this->io_context_.run();
+				this->background_->run();
 			}
 		);
 	}
 }
+
+bool CServer::pin_thread(boost::thread &thread, unsigned core)
+{
+	const unsigned cores = boost::thread::hardware_concurrency();
+	if(cores == 0)
+		return false;
+
+	core %= cores;
+
+#ifdef WIN32
+	return 0 != SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(core, &cpuset);
+	return 0 == pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+#else
+	return false;
+#endif // WIN32
+}
@@ -2,53 +2,162 @@
 #ifndef CS_MINISQLITESERVER_CSERVER_H
 #define CS_MINISQLITESERVER_CSERVER_H
 
-#include "CClientSession.h"
+#include "CSocketSession.h"
 #include "CBusinessLogic.h"
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/signal_set.hpp>
 #include <boost/thread.hpp>
 #include <boost/make_shared.hpp>
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
 using namespace boost::asio;
 using boost::asio::ip::tcp;
 
 class CServer{
 public:
-	explicit CServer(io_context& io_context, const size_t maxTimeout, unsigned short port, unsigned short thread_num)
-		: acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
-		, io_context_(io_context)
+	struct AcceptSettings {
+		int backlog;                // length of queue of connections, that aren't accepted yet
+		size_t pendingAccepts;      // count of async_accept of one acceptor, that wait for connection at the same time
+		size_t maxConnections;      // clients over limit are disconnected right after accept. 0 - no limit
+		std::string localPath;      // unix domain socket for clients on the same host (besides TCP). Empty - disabled
+		// called, when server is listening (constructor doesn't return until exit), e.g. to connect in-process clients
+		std::function<void(CServer &)> onStarted;
+	};
+
+	// contextPerCore == false: one io_context is run by thread_num threads.
+	// contextPerCore == true: each of thread_num threads runs own io_context with own acceptor
+	// (SO_REUSEPORT) and clients stay in thread, that accepted them
+	explicit CServer(io_context& io_context, const size_t maxTimeout, unsigned short port, unsigned short thread_num,
+					 bool contextPerCore = false, bool pinThreads = false,
+					 const AcceptSettings &acceptSettings = { socket_base::max_listen_connections, 1, 0 })
+		: io_context_(io_context)
+		, endpoint_(tcp::v4(), port)
 		, thread_num_(thread_num)
+		, contextPerCore_(contextPerCore)
+		, pinThreads_(pinThreads)
+		, nextContext_(0)
+		, rejected_(0)
 		, maxTimeout_(maxTimeout)
+		, acceptSettings_(acceptSettings)
         , businessLogic_(boost::make_shared<CBusinessLogic>())
 	{ Start(); }
 
-	explicit CServer(io_context& io_context, const size_t maxTimeout, const std::string &ipAddress, unsigned short port, unsigned short thread_num)
-		: acceptor_(io_context, tcp::endpoint(ip::address::from_string(ipAddress), port))
-		, io_context_(io_context)
+	explicit CServer(io_context& io_context, const size_t maxTimeout, const std::string &ipAddress, unsigned short port, unsigned short thread_num,
+					 bool contextPerCore = false, bool pinThreads = false,
+					 const AcceptSettings &acceptSettings = { socket_base::max_listen_connections, 1, 0 })
+		: io_context_(io_context)
+		, endpoint_(ip::address::from_string(ipAddress), port)
 		, thread_num_(thread_num)
+		, contextPerCore_(contextPerCore)
+		, pinThreads_(pinThreads)
+		, nextContext_(0)
+		, rejected_(0)
 		, maxTimeout_(maxTimeout)
+		, acceptSettings_(acceptSettings)
         , businessLogic_(boost::make_shared<CBusinessLogic>())
 	{ Start(); }
 
 	CServer(CServer const&) = delete;
 	CServer operator=(CServer const&) = delete;
 
+	// serve client of the same process (see CMemoryStream): client is connected with new session of server.
+	// FALSE, if max connections are reached. Can be called from any thread after onStarted
+	bool ConnectInProcess(CMemoryStream &client);
+
 private:
+	typedef executor_work_guard<io_context::executor_type> work_guard;
+	enum { BACKGROUND_THREADS = 2, MIN_RETRY_DELAY = 10, MAX_RETRY_DELAY = 1000, MAX_METRICS_REQUEST = 8192 };
+
 	void Start();
 
-	void do_accept(CClientSession::ptr client, const boost::system::error_code& err);
+	// stop all contexts, so threads return from run() and constructor returns
+	void Stop(int signal);
+
+	// create io_contexts and acceptors, according to mode
+	void init_contexts();
+
+	// open acceptor and bind it to endpoint_. reusePort allows several acceptors on one port
+	void open_acceptor(tcp::acceptor &acceptor, bool reusePort);
+
+	// retryDelayMs - last delay after resource error, 0 if accepting is ok
+	void do_accept(size_t acceptorIndex, CTcpSession::ptr client, size_t retryDelayMs, const boost::system::error_code& err);
+
+	// create new client in context of acceptor (or next context, if only one acceptor) and wait for connection
+	void accept_next(size_t acceptorIndex, size_t retryDelayMs = 0);
+
+	void accept_later(size_t acceptorIndex, size_t retryDelayMs);
+
+	// FALSE, if client must be rejected, because max connections are reached
+	bool admit();
+
+	// say client, that server is overloaded, and close connection without waiting
+	template<class Socket>
+	static void reject(Socket &sock);
+
+	// listen acceptSettings_.localPath. Socket, left by previous run, is removed; throw, if path is used by other file or process
+	void open_local_acceptor();
+
+	void accept_local(size_t retryDelayMs = 0);
+
+	// errors, after which accepting can't succeed until some resources are freed (EMFILE, ENOBUFS...)
+	static bool is_resource_error(const boost::system::error_code &err);
 
 	void start_listen();
 
+	// listen 127.0.0.1:metricsPort and answer each HTTP request with stats of server
+	void start_metrics_endpoint();
+
+	void accept_metrics_client();
+
+	// log summary of slow queries every slowQueryReportInterval
+	void post_slow_query_report();
+
+	// bind thread to core. Return FALSE, if OS doesn't support it or core doesn't exist
+	static bool pin_thread(boost::thread &thread, unsigned core);
+
 private:
 	io_context &io_context_;
-	tcp::acceptor acceptor_;
+	tcp::endpoint endpoint_;
 	boost::thread_group threads;
 	short thread_num_;
+	const bool contextPerCore_;
+	const bool pinThreads_;
+
+	// contexts_[0] is io_context_, others are owned by server (only when contextPerCore_)
+	std::vector<io_context *> contexts_;
+	std::vector<std::unique_ptr<io_context>> ownContexts_;
+	std::vector<std::unique_ptr<tcp::acceptor>> acceptors_; // acceptors_[i] is in contexts_[i]
+	// several async_accept of one acceptor can be started from different threads
+	std::vector<std::unique_ptr<io_context::strand>> acceptStrands_;
+	// idleWheels_[i] stops idle clients of contexts_[i]
+	std::vector<CIdleWheel::ptr> idleWheels_;
+	std::vector<work_guard> workGuards_;
+	std::atomic<size_t> nextContext_;
+	std::atomic<size_t> rejected_;
+	std::unique_ptr<tcp::acceptor> metricsAcceptor_;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	// clients of unix domain socket are served by contexts_ round-robin, as clients of one TCP acceptor
+	std::unique_ptr<local::stream_protocol::acceptor> localAcceptor_;
+	std::unique_ptr<io_context::strand> localStrand_;
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+	std::unique_ptr<deadline_timer> slowQueryTimer_;
+	// SIGINT/SIGTERM stop server, then main calls SafeExit()
+	std::unique_ptr<signal_set> signals_;
+
+	// long blocking jobs of clients (backup, restore) mustn't stop other clients in thread of context,
+	// so in contextPerCore_ mode they are executed by separate threads
+	std::unique_ptr<io_context> background_;
+
 	const size_t maxTimeout_;
+	const AcceptSettings acceptSettings_;
 
     boost::shared_ptr<CBusinessLogic> businessLogic_;
 };
 
-#endif //CS_MINISQLITESERVER_CSERVER_H
\ No newline at end of file
+#endif //CS_MINISQLITESERVER_CSERVER_H
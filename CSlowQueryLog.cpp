@@ -0,0 +1,210 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CSlowQueryLog.h"
+#include "CMetrics.h"
+#include "glog/logging.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <regex>
+#include <vector>
+
+namespace {
+    const char *const otherFingerprints = "(other fingerprints)";
+
+    bool isIdentifierChar(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$' || (c & 0x80);
+    }
+
+    uint64_t toMicroseconds(CSlowQueryLog::clock::duration duration) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    }
+
+    string milliseconds(uint64_t us) {
+        return std::to_string(us / 1000) + "." + std::to_string(us % 1000 / 100) + "ms";
+    }
+}
+
+std::atomic<int64_t> CSlowQueryLog::thresholdUs_(0);
+std::mutex CSlowQueryLog::cs_;
+std::unordered_map<string, CSlowQueryLog::Stats> CSlowQueryLog::stats_;
+
+void CSlowQueryLog::Init(size_t thresholdMs) {
+    thresholdUs_ = static_cast<int64_t>(thresholdMs) * 1000;
+}
+
+bool CSlowQueryLog::isSlow(clock::duration duration) {
+    const int64_t threshold = thresholdUs_.load(std::memory_order_relaxed);
+    return threshold > 0 && std::chrono::duration_cast<std::chrono::microseconds>(duration).count() >= threshold;
+}
+
+bool CSlowQueryLog::needsPlan(const string &fingerprint) {
+    std::lock_guard<std::mutex> lock(cs_);
+
+    auto it = stats_.find(fingerprint);
+    if(it == stats_.end())
+        return stats_.size() < MAX_FINGERPRINTS;
+
+    return it->second.plan.empty();
+}
+
+void CSlowQueryLog::Record(const string &fingerprint, const Entry &entry, const string &plan) {
+    const uint64_t us = toMicroseconds(entry.duration);
+
+    CMetrics::add(CMetrics::SLOW_QUERIES);
+
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+
+        auto it = stats_.find(fingerprint);
+        if(it == stats_.end())
+            it = stats_.emplace(stats_.size() < MAX_FINGERPRINTS ? fingerprint : string(otherFingerprints), Stats{}).first;
+
+        Stats &stats = it->second;
+        ++stats.count;
+        stats.totalUs += us;
+        stats.maxUs = std::max(stats.maxUs, us);
+        stats.rows += entry.rows;
+        stats.busyWaits += entry.busyWaits;
+
+        if(stats.plan.empty() && ! plan.empty())
+            stats.plan = plan;
+    }
+
+    const string sql(entry.sql, std::min<size_t>(std::strlen(entry.sql), MAX_LOGGED_SQL));
+
+    LOG(WARNING) << "Slow query: " << milliseconds(us) << ", rows " << entry.rows << ", busy waits " << entry.busyWaits
+                 << ". Statement: " << sql;
+
+    LOG_IF(WARNING, ! plan.empty()) << "Query plan of '" << fingerprint << "':\n" << plan;
+}
+
+void CSlowQueryLog::Report() {
+    std::vector<std::pair<string, Stats>> report;
+
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+
+        // fingerprints, that weren't slow during last period, are forgotten to give place for new ones
+        const bool full = stats_.size() >= MAX_FINGERPRINTS;
+
+        for(auto it = stats_.begin(); it != stats_.end(); ){
+            Stats &stats = it->second;
+
+            if(stats.count == 0){
+                it = full ? stats_.erase(it) : std::next(it);
+                continue;
+            }
+
+            report.emplace_back(it->first, stats);
+
+            stats.count = 0;
+            stats.totalUs = stats.maxUs = 0;
+            stats.rows = 0;
+            stats.busyWaits = 0;
+            ++it;
+        }
+    }
+
+    if(report.empty())
+        return;
+
+    std::sort(report.begin(), report.end(), [](const std::pair<string, Stats> &a, const std::pair<string, Stats> &b){
+        return a.second.totalUs > b.second.totalUs;
+    });
+
+    size_t count = 0;
+    for(const auto &it : report)
+        count += it.second.count;
+
+    string msg = "Slow queries since last report: " + std::to_string(count) + " statements of "
+                 + std::to_string(report.size()) + " fingerprints";
+
+    for(size_t i = 0; i < report.size() && i < REPORT_TOP; ++i){
+        const Stats &stats = report[i].second;
+        msg += "\n  total " + milliseconds(stats.totalUs) + ", count " + std::to_string(stats.count)
+               + ", avg " + milliseconds(stats.totalUs / stats.count) + ", max " + milliseconds(stats.maxUs)
+               + ", rows " + std::to_string(stats.rows) + ", busy waits " + std::to_string(stats.busyWaits)
+               + ": " + report[i].first;
+    }
+
+    LOG(INFO) << msg;
+}
+
+string CSlowQueryLog::Fingerprint(const char *sql) {
+    string fingerprint;
+    bool space = false;
+
+    for(const char *c = sql; *c; ){
+        if(std::isspace(static_cast<unsigned char>(*c))){
+            space = true;
+            ++c;
+            continue;
+        }
+
+        // comments
+        if(c[0] == '-' && c[1] == '-'){
+            while(*c && *c != '\n')
+                ++c;
+            continue;
+        }
+        if(c[0] == '/' && c[1] == '*'){
+            const char *end = std::strstr(c + 2, "*/");
+            c = end ? end + 2 : c + std::strlen(c);
+            space = true;
+            continue;
+        }
+
+        if(space && ! fingerprint.empty())
+            fingerprint += ' ';
+        space = false;
+
+        const bool afterIdentifier = c != sql && isIdentifierChar(c[-1]);
+
+        if(*c == '\'' || ((*c == 'x' || *c == 'X') && c[1] == '\'' && ! afterIdentifier)){
+            // string or blob literal ('' is escaped quote)
+            c = std::strchr(c, '\'') + 1;
+            while(*c && ! (c[0] == '\'' && c[1] != '\''))
+                c += (c[0] == '\'') ? 2 : 1;
+            if(*c)
+                ++c;
+            fingerprint += '?';
+
+        }else if(std::isdigit(static_cast<unsigned char>(*c)) && ! afterIdentifier){
+            // number (also hex and with exponent)
+            while(isIdentifierChar(*c) || *c == '.' || ((*c == '+' || *c == '-') && (c[-1] == 'e' || c[-1] == 'E')))
+                ++c;
+            fingerprint += '?';
+
+        }else if(*c == '"' || *c == '`' || *c == '['){
+            // quoted identifier is kept as is
+            const char close = (*c == '[') ? ']' : *c;
+            const char *end = std::strchr(c + 1, close);
+            end = end ? end + 1 : c + std::strlen(c);
+            fingerprint.append(c, end);
+            c = end;
+
+        }else if(isIdentifierChar(*c)){
+            for(; isIdentifierChar(*c); ++c)
+                fingerprint += static_cast<char>(std::tolower(static_cast<unsigned char>(*c)));
+
+        }else{
+            fingerprint += *c++;
+        }
+    }
+
+    while( ! fingerprint.empty() && (fingerprint.back() == ';' || fingerprint.back() == ' ') )
+        fingerprint.pop_back();
+
+    // "IN (1, 2, 3)" and "VALUES (1, 'a'), (2, 'b')" don't depend on count of values
+    static const std::regex list("\\?( ?, ?\\?)+");
+    static const std::regex rows("\\(\\?,\\.\\.\\.\\)( ?, ?\\(\\?,\\.\\.\\.\\))+");
+
+    fingerprint = std::regex_replace(fingerprint, list, "?,...");
+    fingerprint = std::regex_replace(fingerprint, rows, "(?,...),...");
+
+    return fingerprint;
+}
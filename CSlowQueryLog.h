@@ -0,0 +1,75 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CSLOWQUERYLOG_H
+#define CS_MINISQLITESERVER_CSLOWQUERYLOG_H
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+using std::string;
+
+/*Log of statements (CSQLiteDB::ExecuteSelect, Execute), that took longer than threshold.
+  Statements are grouped by fingerprint - text of statement without literals, so
+  "SELECT * FROM t WHERE id = 5" and "... id = 7" are the same query.
+  Each slow statement is logged at once, EXPLAIN QUERY PLAN is logged once per fingerprint.
+  Report() logs aggregates of fingerprints since last report (the slowest first). All methods are thread-safe*/
+class CSlowQueryLog {
+public:
+    using clock = std::chrono::steady_clock;
+
+    /*Statement, that finished slower than threshold*/
+    struct Entry {
+        const char *sql;
+        clock::duration duration;
+        int64_t rows;            // rows returned by SELECT or changed by INSERT/UPDATE/DELETE
+        size_t busyWaits;        // waits of busy handler during statement
+    };
+
+    CSlowQueryLog() = delete;
+
+    /*thresholdMs == 0 disables log*/
+    static void Init(size_t thresholdMs);
+
+    static bool isSlow(clock::duration duration);
+
+    /*Return TRUE, if plan of fingerprint isn't captured yet*/
+    static bool needsPlan(const string &fingerprint);
+
+    /*plan can be empty, if it's already captured*/
+    static void Record(const string &fingerprint, const Entry &entry, const string &plan);
+
+    /*Log aggregates since last report and reset them*/
+    static void Report();
+
+    /*Replace literals (strings, numbers, blobs) with '?', lists of literals with '?,...',
+      collapse whitespace and lower case keywords*/
+    static string Fingerprint(const char *sql);
+
+private:
+    // aggregates of one fingerprint since last report
+    struct Stats {
+        string plan;
+        size_t count;
+        uint64_t totalUs;
+        uint64_t maxUs;
+        int64_t rows;
+        size_t busyWaits;
+    };
+
+    // MAX_FINGERPRINTS - fingerprints, that are kept between reports (with their plans), others are counted as one
+    enum { MAX_FINGERPRINTS = 1000, REPORT_TOP = 10, MAX_LOGGED_SQL = 1000 };
+
+    static std::atomic<int64_t> thresholdUs_;
+    static std::mutex cs_;
+    static std::unordered_map<string, Stats> stats_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CSLOWQUERYLOG_H
@@ -0,0 +1,63 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CSOCKETSESSION_H
+#define CS_MINISQLITESERVER_CSOCKETSESSION_H
+#pragma once
+
+#include "CClientSession.h"
+#include "CMemoryStream.h"
+
+/*Session of client, that is connected by asio stream socket (ip::tcp::socket, local::stream_protocol::socket)
+  or by CMemoryStream in the same process. Protocol is the same for all transports, only reading and writing are done by Socket.
+  Socket is any asio AsyncReadStream and AsyncWriteStream, that is constructed from io_context and has cancel(error_code &)*/
+template<class Socket>
+class CSocketSession : public CClientSession {
+public:
+    typedef boost::shared_ptr<CSocketSession> ptr;
+
+    // class factory. Session is started by start(), after socket is accepted
+    static ptr new_(io_context &io_context, boost::asio::io_context &background, CIdleWheel::ptr idleWheel, businessLogic_ptr businessLogic) {
+        return ptr(new CSocketSession(io_context, background, std::move(idleWheel), std::move(businessLogic)));
+    }
+
+    // return link to socket of current client
+    Socket &sock() {
+        return sock_;
+    }
+
+protected:
+    void async_read_some(mutable_buffer buf, io_handler handler) override {
+        async_read(sock_, buf, boost::asio::transfer_at_least(1),
+                   bind_executor(strand_, boost::bind(handler, shared_from_this(), _1, _2)));
+    }
+
+    void async_write_all(const_buffer buf, io_handler handler) override {
+        async_write(sock_, buf, bind_executor(strand_, boost::bind(handler, shared_from_this(), _1, _2)));
+    }
+
+    void cancel_io() override {
+        error_code err;
+        sock_.cancel(err);
+    }
+
+private:
+    explicit CSocketSession(io_context &io_context, boost::asio::io_context &background, CIdleWheel::ptr idleWheel, businessLogic_ptr businessLogic)
+            : CClientSession(io_context, background, std::move(idleWheel), std::move(businessLogic))
+            , sock_(io_context)
+    {}
+
+    Socket sock_;
+};
+
+typedef CSocketSession<ip::tcp::socket> CTcpSession;
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+typedef CSocketSession<local::stream_protocol::socket> CLocalSession;
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+typedef CSocketSession<CMemoryStream> CMemorySession;
+
+
+#endif //CS_MINISQLITESERVER_CSOCKETSESSION_H
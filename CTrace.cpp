@@ -0,0 +1,246 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CTrace.h"
+#include "CMetrics.h"
+#include "glog/logging.h"
+
+#include <cstring>
+#include <ctime>
+
+namespace {
+    const char magic[8] = { 'C', 'S', 'T', 'R', 'A', 'C', 'E', '1' };
+
+    void appendUint64(std::vector<char> &out, uint64_t value) {
+        for(int i = 0; i < 8; ++i)
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+std::atomic<bool> CTrace::enabled_(false);
+FILE *CTrace::file_ = nullptr;
+std::mutex CTrace::cs_;
+std::condition_variable CTrace::cv_;
+std::vector<char> CTrace::pending_;
+CTrace::clock::time_point CTrace::last_;
+bool CTrace::stopping_ = false;
+boost::thread CTrace::thread_;
+
+bool CTrace::Start(const string &path) {
+    if(enabled_)
+        return true;
+
+    if( ! rotate(path) )
+        return false;
+
+    file_ = std::fopen(path.c_str(), "wb");
+    if( ! file_ ){
+        LOG(WARNING) << "Can't open trace file '" << path << "': " << std::strerror(errno);
+        return false;
+    }
+
+    const uint64_t startTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        pending_.assign(magic, magic + sizeof(magic));
+        appendUint64(pending_, startTime);
+        last_ = clock::now();
+        stopping_ = false;
+    }
+
+    thread_ = boost::thread(&CTrace::run);
+    enabled_ = true;
+
+    LOG(INFO) << "Client traffic is captured to '" << path << "'";
+    return true;
+}
+
+void CTrace::Stop() {
+    if( ! enabled_.exchange(false) )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(cs_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+
+    std::fclose(file_);
+    file_ = nullptr;
+}
+
+void CTrace::Record(Kind kind, uint64_t session, const char *data, size_t size) {
+    if( ! isEnabled() )
+        return;
+
+    std::unique_lock<std::mutex> lock(cs_);
+
+    if(pending_.size() + size > MAX_PENDING){
+        lock.unlock();
+        CMetrics::add(CMetrics::TRACE_RECORDS_DROPPED);
+        return;
+    }
+
+    // time is taken under lock, so records are ordered by time
+    const clock::time_point now = clock::now();
+    const uint64_t delta = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - last_).count());
+    // fraction of microsecond isn't lost between records
+    last_ += std::chrono::microseconds(delta);
+
+    pending_.push_back(static_cast<char>(kind));
+    appendVarint(pending_, delta);
+    appendVarint(pending_, session);
+
+    if(kind == MESSAGE){
+        appendVarint(pending_, size);
+        pending_.insert(pending_.end(), data, data + size);
+    }
+
+    const bool flush = pending_.size() >= FLUSH_SIZE;
+    lock.unlock();
+
+    if(flush)
+        cv_.notify_one();
+}
+
+void CTrace::run() {
+    std::vector<char> buffer;
+
+    for(;;){
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(cs_);
+            cv_.wait_for(lock, std::chrono::milliseconds(static_cast<long>(FLUSH_INTERVAL)), []{
+                return stopping_ || pending_.size() >= FLUSH_SIZE;
+            });
+
+            buffer.swap(pending_);
+            stopping = stopping_;
+        }
+
+        if( ! buffer.empty() ){
+            LOG_IF(WARNING, std::fwrite(buffer.data(), 1, buffer.size(), file_) != buffer.size())
+                    << "Can't write trace file: " << std::strerror(errno);
+            std::fflush(file_);
+            buffer.clear();
+        }
+
+        if(stopping)
+            break;
+    }
+}
+
+bool CTrace::rotate(const string &path) {
+    FILE *old = std::fopen(path.c_str(), "rb");
+    if( ! old )
+        return true;
+    std::fclose(old);
+
+    const std::time_t t = std::time(nullptr);
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::localtime(&t));
+
+    // server can be restarted several times per second
+    string rotated = path + "." + stamp;
+    for(int i = 1; (old = std::fopen(rotated.c_str(), "rb")) != nullptr; ++i){
+        std::fclose(old);
+        rotated = path + "." + stamp + "-" + std::to_string(i);
+    }
+
+    if(std::rename(path.c_str(), rotated.c_str()) != 0){
+        LOG(WARNING) << "Can't rename previous trace file '" << path << "' to '" << rotated << "': " << std::strerror(errno);
+        return false;
+    }
+
+    LOG(INFO) << "Previous trace file is renamed to '" << rotated << "'";
+    return true;
+}
+
+void CTrace::appendVarint(std::vector<char> &out, uint64_t value) {
+    while(value >= 0x80){
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+CTrace::Reader::Reader(const string &path)
+        : file_(std::fopen(path.c_str(), "rb"))
+        , startTime_(0)
+        , timeUs_(0)
+{
+    char header[sizeof(magic)];
+    unsigned char time[8];
+
+    if(file_ && std::fread(header, 1, sizeof(header), file_) == sizeof(header) && 0 == std::memcmp(header, magic, sizeof(magic))
+       && std::fread(time, 1, sizeof(time), file_) == sizeof(time)){
+        for(int i = 0; i < 8; ++i)
+            startTime_ |= static_cast<uint64_t>(time[i]) << (8 * i);
+        return;
+    }
+
+    if(file_){
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+CTrace::Reader::~Reader() {
+    if(file_)
+        std::fclose(file_);
+}
+
+bool CTrace::Reader::isOpen() const {
+    return file_ != nullptr;
+}
+
+uint64_t CTrace::Reader::startTime() const {
+    return startTime_;
+}
+
+bool CTrace::Reader::Next(Event &event) {
+    if( ! file_ )
+        return false;
+
+    const int kind = std::fgetc(file_);
+    uint64_t delta = 0, size = 0;
+
+    if(kind < SESSION_START || kind > MESSAGE || ! readVarint(delta) || ! readVarint(event.session))
+        return false;
+
+    event.kind = static_cast<Kind>(kind);
+    timeUs_ += delta;
+    event.timeUs = timeUs_;
+    event.data.clear();
+
+    if(event.kind == MESSAGE){
+        if( ! readVarint(size) || size > MAX_PENDING )
+            return false;
+
+        event.data.resize(size);
+        if(std::fread(&event.data[0], 1, size, file_) != size)
+            return false;
+    }
+
+    return true;
+}
+
+bool CTrace::Reader::readVarint(uint64_t &value) {
+    value = 0;
+
+    for(int shift = 0; shift < 64; shift += 7){
+        const int c = std::fgetc(file_);
+        if(c == EOF)
+            return false;
+
+        value |= static_cast<uint64_t>(c & 0x7F) << shift;
+        if( ! (c & 0x80) )
+            return true;
+    }
+
+    return false;
+}
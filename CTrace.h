@@ -0,0 +1,106 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CTRACE_H
+#define CS_MINISQLITESERVER_CTRACE_H
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*Capture of client traffic for replay (see bench/TraceReplay.cpp).
+  Start() opens trace file, after that sessions record their start, stop and every received message.
+  Records are encoded on calling thread into buffer, background thread appends buffer to file,
+  so disk doesn't delay io threads. If buffer is full, records are dropped and counted
+  (see CMetrics::TRACE_RECORDS_DROPPED).
+
+  File format (integers are little-endian, varint is LEB128):
+    header: "CSTRACE1", uint64 start time (microseconds since epoch)
+    record: uint8 kind, varint microseconds since previous record, varint session id,
+            for MESSAGE: varint size, bytes of message as they were received*/
+class CTrace {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum Kind { SESSION_START = 0, SESSION_STOP = 1, MESSAGE = 2 };
+
+    struct Event {
+        Kind kind;
+        uint64_t timeUs;        // since start of capture
+        uint64_t session;
+        string data;
+    };
+
+    /*Sequential reader of trace file*/
+    class Reader : boost::noncopyable {
+    public:
+        explicit Reader(const string &path);
+
+        ~Reader();
+
+        /*Return FALSE, if file isn't trace*/
+        bool isOpen() const;
+
+        /*Start of capture (microseconds since epoch)*/
+        uint64_t startTime() const;
+
+        /*Read next event. Return FALSE at the end of file or if file is truncated*/
+        bool Next(Event &event);
+
+    private:
+        bool readVarint(uint64_t &value);
+
+        FILE *file_;
+        uint64_t startTime_;
+        uint64_t timeUs_;
+    };
+
+    CTrace() = delete;
+
+    /*Open file and start background writer. Existing file (capture of previous run) is renamed to
+      '<path>.<YYYYmmdd-HHMMSS>'. Return FALSE, if file can't be renamed or opened*/
+    static bool Start(const string &path);
+
+    /*Write buffered records and close file*/
+    static void Stop();
+
+    static bool isEnabled() {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    static void Record(Kind kind, uint64_t session, const char *data = nullptr, size_t size = 0);
+
+private:
+    enum { FLUSH_INTERVAL = 100 /*ms*/, FLUSH_SIZE = 64 * 1024, MAX_PENDING = 16 * 1024 * 1024 };
+
+    static void run();
+
+    // rename existing file, so it isn't overwritten
+    static bool rotate(const string &path);
+
+    static void appendVarint(std::vector<char> &out, uint64_t value);
+
+    static std::atomic<bool> enabled_;
+    static FILE *file_;
+    static std::mutex cs_;
+    static std::condition_variable cv_;
+    static std::vector<char> pending_;
+    static clock::time_point last_;
+    static bool stopping_;
+    static boost::thread thread_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CTRACE_H
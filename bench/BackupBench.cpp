@@ -0,0 +1,303 @@
+//
+// Created by childcity on 19.10.26.
+//
+// CS_MiniSQLiteServer_backup_bench: backup, replay of deferred queries and restore under foreground load.
+//
+// Foreground threads write and read the db at fixed rate, as clients of server do
+// (writes are saved to tmp db, while backup is in progress, and are rejected during restore).
+// Phases: baseline (only foreground), backup (CBusinessLogic::backupDb),
+// drain (SyncDbWithTmp executes deferred queries), restore (restoreDbFromFile from the backup).
+// Each phase is printed as one JSON line. Exit code is 1, if one of SLO is exceeded.
+//
+// Options (--key=value):
+//   rows=200000  row-bytes=100     size of generated db
+//   writers=2  readers=2  rate=50   foreground threads and commands per second of each thread
+//   baseline=2 (sec)
+//   slo-backup-sec=0  slo-drain-sec=0  slo-restore-sec=0  slo-p99-ms=0   (0 - not checked)
+//   dir=/tmp/CS_MiniSQLiteServer_backup_bench
+//
+// Example: CS_MiniSQLiteServer_backup_bench --rows=5000000 --slo-backup-sec=60 --slo-p99-ms=50
+
+#include "../main.h"
+#include "../CSQLiteDB.h"
+#include "../CMetrics.h"
+#include "../CBusinessLogic.h"
+#include "../CConnectionFactory.h"
+#include "../CSlowQueryLog.h"
+#include "glog/logging.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    enum Phase { BASELINE, BACKUP, DRAIN, RESTORE, PHASES_COUNT };
+    const char *const phaseNames[PHASES_COUNT] = { "baseline", "backup", "drain", "restore" };
+
+    // foreground commands of each phase
+    struct PhaseStats {
+        CHistogram latency;             // from scheduled time, microseconds
+        std::atomic<uint64_t> deferred{0};  // writes, saved to tmp db
+        std::atomic<uint64_t> rejected{0};  // commands, that weren't executed because of restore
+        std::atomic<uint64_t> errors{0};
+    };
+
+    PhaseStats stats[PHASES_COUNT];
+    std::atomic<int> phase(BASELINE);
+    std::atomic<bool> stopping(false);
+    std::atomic<int> connected(0);
+
+    uint64_t fileSize(const string &path) {
+        boost::system::error_code err;
+        const uintmax_t size = boost::filesystem::file_size(path, err);
+        return err ? 0 : static_cast<uint64_t>(size);
+    }
+
+    void createDb(size_t rows, size_t rowBytes) {
+        boost::filesystem::remove(dbPath);
+        boost::filesystem::remove(dbPath + "-wal");
+        boost::filesystem::remove(dbPath + "-shm");
+
+        CSQLiteDB::ptr db = CSQLiteDB::new_(dbPath);
+        LOG_IF(FATAL, ! db->OpenConnection(SQLITE_OPEN_FULLMUTEX|SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE))
+                << "Can't create " << dbPath << ": " << db->GetLastError();
+
+        const string script =
+                "PRAGMA journal_mode = WAL;"
+                "CREATE TABLE bench(id INTEGER PRIMARY KEY, value INTEGER NOT NULL, payload BLOB NOT NULL);"
+                "WITH RECURSIVE seq(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM seq WHERE n < " + std::to_string(rows) + ") "
+                "INSERT INTO bench(id, value, payload) SELECT n, n, randomblob(" + std::to_string(rowBytes) + ") FROM seq;"
+                "PRAGMA wal_checkpoint(TRUNCATE);";
+
+        LOG_IF(FATAL, ! db->ExecuteScript(script.c_str())) << "Can't generate " << dbPath << ": " << db->GetLastError();
+
+        // queries, deferred by previous run (tmp db of CBusinessLogic)
+        CBusinessLogic::CreateOrUseOldTmpDb();
+        CSQLiteDB::ptr tmpDb = CSQLiteDB::new_("temp_db.sqlite3");
+        LOG_IF(FATAL, ! tmpDb->OpenConnection() || tmpDb->Execute("DELETE FROM tmp_querys;") < 0) << tmpDb->GetLastError();
+    }
+
+    // thread of foreground load. Commands are scheduled at fixed rate, so stall of db isn't hidden
+    void foreground(const boost::shared_ptr<CBusinessLogic> &businessLogic, bool writer, double rate, size_t rows, unsigned seed) {
+        std::mt19937 random(seed);
+        const clock::duration interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / rate));
+        clock::time_point next = clock::now();
+        CSQLiteDB::ptr db;
+
+        while( ! stopping ){
+            next += interval;
+            std::this_thread::sleep_until(next);
+
+            const int currentPhase = phase;
+            PhaseStats &current = stats[currentPhase];
+
+            // server stops clients before restore
+            if(currentPhase == RESTORE){
+                if(db){
+                    db.reset();
+                    --connected;
+                }
+                ++current.rejected;
+                continue;
+            }
+
+            if( ! db ){
+                db = CConnectionFactory::NewConnection(dbPath, sqlCountOfAttempts, sqlWaitTime, sqlBusyTimeout);
+                ++connected;
+            }
+
+            const string id = std::to_string(std::uniform_int_distribution<size_t>(1, rows)(random));
+            bool ok = true;
+
+            if(writer){
+                const string query = "UPDATE bench SET value = value + 1 WHERE id = " + id + ";";
+                const int progress = businessLogic->getBackUpProgress();
+
+                if(progress < 0 || progress == 100){
+                    ok = db->Execute(query.c_str()) >= 0;
+                }else{
+                    ok = CBusinessLogic::SaveQueryToTmpDb(query) >= 0;
+                    ++current.deferred;
+                }
+            }else{
+                IResult *res = db->ExecuteSelect(("SELECT id, value FROM bench WHERE id = " + id + ";").c_str());
+                ok = res != nullptr;
+                if(res){
+                    while(res->Next())
+                        res->ColomnData(1);
+                    res->ReleaseStatement();
+                }
+            }
+
+            if( ! ok )
+                ++current.errors;
+
+            current.latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - next).count()));
+        }
+
+        if(db)
+            --connected;
+    }
+
+    double runPhase(Phase next, const std::function<void()> &operation) {
+        phase = next;
+
+        const clock::time_point start = clock::now();
+        operation();
+        return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    void print(Phase p, double wallSec, uint64_t bytesWritten) {
+        const CHistogram::Snapshot latency = stats[p].latency.snapshot();
+
+        char line[512];
+        std::snprintf(line, sizeof(line),
+                      "{\"phase\":\"%s\",\"wall_sec\":%.3f,\"bytes_written\":%llu,\"fg_commands\":%llu,\"fg_p50_ms\":%.3f,"
+                      "\"fg_p99_ms\":%.3f,\"fg_max_ms\":%.3f,\"deferred\":%llu,\"rejected\":%llu,\"errors\":%llu}",
+                      phaseNames[p], wallSec, static_cast<unsigned long long>(bytesWritten),
+                      static_cast<unsigned long long>(latency.count),
+                      latency.quantile(0.5) / 1000.0, latency.quantile(0.99) / 1000.0, latency.max / 1000.0,
+                      static_cast<unsigned long long>(stats[p].deferred), static_cast<unsigned long long>(stats[p].rejected),
+                      static_cast<unsigned long long>(stats[p].errors));
+
+        std::cout << line << std::endl;
+    }
+
+    void usage(const char *prog) {
+        std::cerr << "Usage: " << prog << " [--rows=N] [--row-bytes=N] [--writers=N] [--readers=N] [--rate=CMD_PER_SEC] [--baseline=SEC]\n"
+                  << "       [--slo-backup-sec=X] [--slo-drain-sec=X] [--slo-restore-sec=X] [--slo-p99-ms=X] [--dir=PATH]\n";
+        std::exit(2);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::map<string, string> args;
+    for(int i = 1; i < argc; ++i){
+        const string arg(argv[i]);
+        const size_t eq = arg.find('=');
+
+        if(arg.compare(0, 2, "--") != 0 || eq == string::npos)
+            usage(argv[0]);
+
+        args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+
+    auto arg = [&](const char *key, const char *def){
+        auto it = args.find(key);
+        const string value = it == args.end() ? def : it->second;
+        args.erase(key);
+        return value;
+    };
+
+    const size_t rows = std::stoul(arg("rows", "200000"));
+    const size_t rowBytes = std::stoul(arg("row-bytes", "100"));
+    const size_t writers = std::stoul(arg("writers", "2"));
+    const size_t readers = std::stoul(arg("readers", "2"));
+    const double rate = std::stod(arg("rate", "50"));
+    const double baselineSec = std::stod(arg("baseline", "2"));
+    const double sloBackupSec = std::stod(arg("slo-backup-sec", "0"));
+    const double sloDrainSec = std::stod(arg("slo-drain-sec", "0"));
+    const double sloRestoreSec = std::stod(arg("slo-restore-sec", "0"));
+    const double sloP99Ms = std::stod(arg("slo-p99-ms", "0"));
+    const string dir = arg("dir", "/tmp/CS_MiniSQLiteServer_backup_bench");
+
+    if( ! args.empty() || rows == 0 || rate <= 0 )
+        usage(argv[0]);
+
+    FLAGS_logtostderr = true;
+    FLAGS_minloglevel = google::GLOG_WARNING;
+    google::InitGoogleLogging(argv[0]);
+
+    // tmp db of deferred queries is created in current directory
+    boost::filesystem::create_directories(dir);
+    boost::filesystem::current_path(dir);
+
+    dbPath = dir + "/backup_bench.db";
+    bakDbPath = dir + "/backup_bench.db.bak";
+    restoreDbPath = dir + "/backup_bench.db.restore";
+
+    CConnectionFactory::Settings sqliteSettings{};
+    sqliteSettings.pageSize = blockOrClusterSize;
+    sqliteSettings.cacheSizeKb = 3000;
+    sqliteSettings.autoCheckpoint = true;
+    LOG_IF(FATAL, ! CConnectionFactory::Init(sqliteSettings)) << "Can't initialize sqlite";
+    CSlowQueryLog::Init(0);
+
+    std::cerr << "generating " << dbPath << " (" << rows << " rows)..." << std::endl;
+    createDb(rows, rowBytes);
+    std::cerr << "db size " << fileSize(dbPath) << " bytes" << std::endl;
+
+    const auto businessLogic = boost::make_shared<CBusinessLogic>();
+
+    boost::thread_group threads;
+    for(size_t i = 0; i < writers + readers; ++i)
+        threads.create_thread([&, i](){ foreground(businessLogic, i < writers, rate, rows, static_cast<unsigned>(i + 1)); });
+
+    double wall[PHASES_COUNT] = {};
+
+    wall[BASELINE] = runPhase(BASELINE, [&](){
+        boost::this_thread::sleep(boost::posix_time::milliseconds(static_cast<long>(baselineSec * 1000)));
+    });
+    print(BASELINE, wall[BASELINE], 0);
+
+    boost::filesystem::remove(bakDbPath);
+    wall[BACKUP] = runPhase(BACKUP, [&](){
+        CSQLiteDB::ptr backupDb = CConnectionFactory::NewConnection(dbPath, sqlCountOfAttempts, sqlWaitTime, sqlBusyTimeout);
+        LOG_IF(FATAL, businessLogic->backupDb(backupDb, bakDbPath) != 100) << "Backup failed: " << backupDb->GetLastError();
+    });
+    print(BACKUP, wall[BACKUP], fileSize(bakDbPath));
+
+    // the same wait, as server uses between deferred queries
+    wall[DRAIN] = runPhase(DRAIN, [&](){
+        CBusinessLogic::SyncDbWithTmp(dbPath, [](size_t ms){ boost::this_thread::sleep(boost::posix_time::milliseconds(static_cast<long>(ms))); });
+        businessLogic->resetBackUpProgress();
+    });
+    print(DRAIN, wall[DRAIN], 0);
+
+    boost::filesystem::copy_file(bakDbPath, restoreDbPath, boost::filesystem::copy_option::overwrite_if_exists);
+    wall[RESTORE] = runPhase(RESTORE, [&](){
+        // as server, wait for clients to close connections
+        while(connected > 0)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+
+        LOG_IF(FATAL, ! businessLogic->prepareBeforeRestore(dbPath, restoreDbPath)) << "Restore can't be executed";
+        businessLogic->restoreDbFromFile(dbPath, restoreDbPath);
+    });
+    print(RESTORE, wall[RESTORE], fileSize(dbPath));
+
+    stopping = true;
+    threads.join_all();
+
+    // foreground p99 is checked only during operations
+    std::vector<string> failed;
+    auto check = [&failed](const char *name, double value, double limit){
+        if(limit > 0 && value > limit)
+            failed.push_back(string(name) + " " + std::to_string(value) + " > " + std::to_string(limit));
+    };
+
+    check("backup_sec", wall[BACKUP], sloBackupSec);
+    check("drain_sec", wall[DRAIN], sloDrainSec);
+    check("restore_sec", wall[RESTORE], sloRestoreSec);
+    check("backup_fg_p99_ms", stats[BACKUP].latency.snapshot().quantile(0.99) / 1000.0, sloP99Ms);
+    check("drain_fg_p99_ms", stats[DRAIN].latency.snapshot().quantile(0.99) / 1000.0, sloP99Ms);
+
+    for(const string &it : failed)
+        std::cerr << "SLO exceeded: " << it << std::endl;
+
+    std::cout << "{\"slo\":\"" << (failed.empty() ? "pass" : "fail") << "\",\"exceeded\":" << failed.size() << "}" << std::endl;
+
+    return failed.empty() ? 0 : 1;
+}
@@ -0,0 +1,23 @@
+//
+// Created by childcity on 19.10.26.
+//
+// Globals of main.h for executables of bench/, that link sources of server without main.cpp.
+// Values are defaults of CConfig (but WAL is checkpointed by sqlite), bench can change them before start of server.
+
+#include "../main.h"
+
+//Global variable declared in main.h
+std::string dbPath;
+std::string bakDbPath;
+std::string restoreDbPath;
+size_t newBackupTimeout = 30 * 60 * 1000;
+size_t sqlWaitTime = 50;
+size_t sqlCountOfAttempts = 200;
+size_t sqlBusyTimeout = 10000;
+size_t checkpointInterval = 0;
+long long walSizeLimit = 16 * 1024 * 1024;
+long blockOrClusterSize = 4096;
+unsigned short metricsPort = 0;
+size_t slowQueryReportInterval = 10 * 60 * 1000;
+size_t compressMinBytes = 64 * 1024;
+int compressLevel = 1;
@@ -0,0 +1,307 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CLoadGenerator.h"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+#include <ostream>
+
+using boost::asio::ip::tcp;
+
+namespace {
+    const char *const commandNames[CLoadGenerator::COMMANDS_COUNT] = { "login", "ping", "get_place_free", "select", "insert" };
+
+    string milliseconds(uint64_t us) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.3f", static_cast<double>(us) / 1000.0);
+        return buf;
+    }
+}
+
+struct CLoadGenerator::Connection {
+    Connection(boost::asio::io_context &io_context, size_t index)
+            : sock(io_context)
+            , timer(io_context)
+            , random(static_cast<unsigned>(index) * 7919u + 1u)
+            , index(index)
+            , command(LOGIN)
+            , buffer(new char[READ_BUFFER])
+    {}
+
+    tcp::socket sock;
+    std::unique_ptr<CMemoryStream> stream;  // instead of sock, if server is in this process
+    boost::asio::steady_timer timer;
+    std::mt19937 random;
+    const size_t index;
+
+    Command command;
+    string request;
+    clock::time_point scheduled;    // latency is measured from this time
+    clock::time_point next;         // scheduled time of next command (open loop)
+    clock::duration interval;       // between commands of this connection (open loop)
+    std::unique_ptr<char[]> buffer;
+};
+
+CLoadGenerator::CLoadGenerator(const Settings &settings)
+        : settings_(settings)
+        , weightsSum_(std::accumulate(std::begin(settings.weights), std::end(settings.weights), 0u))
+        , connectErrors_(0)
+{
+    for(auto &errors : errors_)
+        errors = 0;
+}
+
+CLoadGenerator::~CLoadGenerator() = default;
+
+CLoadGenerator::Report CLoadGenerator::Run() {
+    tcp::resolver::results_type endpoints;
+    if( ! settings_.connectInProcess ){
+        tcp::resolver resolver(io_context_);
+        endpoints = resolver.resolve(settings_.host, std::to_string(settings_.port));
+    }
+
+    start_ = clock::now();
+    measureStart_ = start_ + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(settings_.warmupSec));
+    end_ = measureStart_ + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(settings_.durationSec));
+
+    // each connection sends connections / rate commands per second, starts of connections are spread over interval
+    const clock::duration interval = settings_.rate > 0
+            ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(settings_.connections / settings_.rate))
+            : clock::duration::zero();
+
+    for(size_t i = 0; i < settings_.connections; ++i){
+        auto connection = std::make_shared<Connection>(io_context_, i);
+        connection->interval = interval;
+        connection->next = start_ + interval * static_cast<long>(i) / static_cast<long>(settings_.connections);
+        connections_.push_back(connection);
+
+        if(settings_.connectInProcess){
+            connection->stream.reset(new CMemoryStream(io_context_));
+            if( ! settings_.connectInProcess(*connection->stream) ){
+                ++connectErrors_;
+                continue;
+            }
+
+            boost::asio::post(io_context_, [this, connection](){ connect(connection); });
+            continue;
+        }
+
+        boost::asio::async_connect(connection->sock, endpoints, [this, connection](const boost::system::error_code &err, const tcp::endpoint &){
+            if(err){
+                ++connectErrors_;
+                return;
+            }
+
+            connect(connection);
+        });
+    }
+
+    boost::thread_group threads;
+    for(size_t i = 0; i < std::max<size_t>(settings_.threads, 1); ++i)
+        threads.create_thread([this](){ io_context_.run(); });
+    threads.join_all();
+
+    Report report{};
+    report.durationSec = settings_.durationSec;
+    report.connectErrors = connectErrors_;
+
+    for(size_t i = 0; i < COMMANDS_COUNT; ++i){
+        report.errors[i] = errors_[i];
+        report.latencies[i] = latencies_[i].snapshot();
+    }
+
+    return report;
+}
+
+const char *CLoadGenerator::commandName(Command command) {
+    return commandNames[command];
+}
+
+void CLoadGenerator::Print(const Report &report, std::ostream &out) {
+    CHistogram::Snapshot total{};
+    total.buckets.resize(CHistogram::BUCKETS);
+    uint64_t totalErrors = 0;
+
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-16s %10s %10s %8s %10s %10s %10s %10s %10s\n",
+                  "command", "count", "rps", "errors", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    out << line;
+
+    auto print = [&](const char *name, const CHistogram::Snapshot &latency, uint64_t errors){
+        std::snprintf(line, sizeof(line), "%-16s %10llu %10.1f %8llu %10s %10s %10s %10s %10s\n", name,
+                      static_cast<unsigned long long>(latency.count), latency.count / report.durationSec,
+                      static_cast<unsigned long long>(errors),
+                      milliseconds(latency.quantile(0.5)).c_str(), milliseconds(latency.quantile(0.9)).c_str(),
+                      milliseconds(latency.quantile(0.99)).c_str(), milliseconds(latency.quantile(0.999)).c_str(),
+                      milliseconds(latency.max).c_str());
+        out << line;
+    };
+
+    for(size_t i = 0; i < COMMANDS_COUNT; ++i){
+        const CHistogram::Snapshot &latency = report.latencies[i];
+        if(latency.count == 0)
+            continue;
+
+        print(commandNames[i], latency, report.errors[i]);
+
+        total.count += latency.count;
+        total.sum += latency.sum;
+        total.max = std::max(total.max, latency.max);
+        for(size_t j = 0; j < CHistogram::BUCKETS; ++j)
+            total.buckets[j] += latency.buckets[j];
+        totalErrors += report.errors[i];
+    }
+
+    print("total", total, totalErrors);
+    out << "connection errors: " << report.connectErrors << "\n";
+}
+
+void CLoadGenerator::connect(const std::shared_ptr<Connection> &connection) {
+    boost::system::error_code err;
+    if( ! connection->stream )
+        connection->sock.set_option(tcp::no_delay(true), err);
+
+    // server needs login before other commands
+    connection->command = LOGIN;
+    connection->scheduled = clock::now();
+    connection->request = make_command(LOGIN, *connection);
+    send(connection);
+}
+
+void CLoadGenerator::schedule_next(const std::shared_ptr<Connection> &connection) {
+    const clock::time_point now = clock::now();
+
+    if(now >= end_){
+        close(*connection);
+        return;
+    }
+
+    connection->command = next_command(connection->random);
+    connection->request = make_command(connection->command, *connection);
+
+    if(settings_.rate <= 0){
+        connection->scheduled = now;
+        send(connection);
+        return;
+    }
+
+    connection->scheduled = connection->next;
+    connection->next += connection->interval;
+
+    // server is late: command is sent at once, time of waiting is counted in latency
+    if(connection->scheduled <= now){
+        send(connection);
+        return;
+    }
+
+    connection->timer.expires_at(connection->scheduled);
+    connection->timer.async_wait([this, connection](const boost::system::error_code &err){
+        if( ! err )
+            send(connection);
+    });
+}
+
+void CLoadGenerator::send(const std::shared_ptr<Connection> &connection) {
+    if(connection->stream)
+        send(connection, *connection->stream);
+    else
+        send(connection, connection->sock);
+}
+
+template<class Stream>
+void CLoadGenerator::send(const std::shared_ptr<Connection> &connection, Stream &stream) {
+    boost::asio::async_write(stream, boost::asio::buffer(connection->request),
+                             [this, connection, &stream](const boost::system::error_code &err, size_t){
+        if(err){
+            on_answer(connection, err, 0);
+            return;
+        }
+
+        // server sends answer by one write, small answer comes in one read
+        stream.async_read_some(boost::asio::buffer(connection->buffer.get(), READ_BUFFER),
+                               [this, connection](const boost::system::error_code &err, size_t bytes){
+            on_answer(connection, err, bytes);
+        });
+    });
+}
+
+void CLoadGenerator::on_answer(const std::shared_ptr<Connection> &connection, const boost::system::error_code &err, size_t bytes) {
+    if(err){
+        ++connectErrors_;
+        close(*connection);
+        return;
+    }
+
+    const clock::time_point now = clock::now();
+
+    if(connection->scheduled >= measureStart_ && connection->scheduled < end_){
+        const uint64_t us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - connection->scheduled).count());
+        latencies_[connection->command].record(us);
+
+        const string answer(connection->buffer.get(), std::min<size_t>(bytes, 32));
+        if(0 == answer.find("ERROR") || 0 == answer.find("Server is busy"))
+            ++errors_[connection->command];
+    }
+
+    schedule_next(connection);
+}
+
+CLoadGenerator::Command CLoadGenerator::next_command(std::mt19937 &random) const {
+    unsigned value = std::uniform_int_distribution<unsigned>(0, std::max(weightsSum_, 1u) - 1)(random);
+
+    for(size_t i = 0; i < COMMANDS_COUNT; ++i){
+        if(value < settings_.weights[i])
+            return static_cast<Command>(i);
+        value -= settings_.weights[i];
+    }
+
+    return PING;
+}
+
+string CLoadGenerator::make_command(Command command, Connection &connection) const {
+    string msg;
+    const size_t row = std::uniform_int_distribution<size_t>(1, std::max<size_t>(settings_.tableRows, 1))(connection.random);
+
+    switch(command){
+        case LOGIN:
+            msg = "login bench_" + std::to_string(connection.index);
+            break;
+        case PING:
+            msg = "ping";
+            break;
+        case GET_PLACE_FREE:
+            msg = "get_place_free";
+            break;
+        case SELECT:
+            msg = "SELECT id, name, value FROM bench WHERE id >= " + std::to_string(row) + " LIMIT " + std::to_string(settings_.selectRows) + ";";
+            break;
+        case INSERT:
+            msg = "INSERT INTO bench(name, value) VALUES('bench_" + std::to_string(connection.index) + "', " + std::to_string(row) + ");";
+            break;
+        default:
+            break;
+    }
+
+    if(msg.size() < PADDED_COMMAND)
+        msg.resize(PADDED_COMMAND, ' ');
+
+    return msg + '\0';
+}
+
+void CLoadGenerator::close(Connection &connection) {
+    boost::system::error_code err;
+    connection.timer.cancel(err);
+
+    if(connection.stream){
+        connection.stream->close(err);
+        return;
+    }
+
+    connection.sock.shutdown(tcp::socket::shutdown_both, err);
+    connection.sock.close(err);
+}
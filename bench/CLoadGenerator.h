@@ -0,0 +1,110 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CLOADGENERATOR_H
+#define CS_MINISQLITESERVER_CLOADGENERATOR_H
+#pragma once
+
+#include "../CMetrics.h"
+#include "../CMemoryStream.h"
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*Client load for CS_MiniSQLiteServer, that speaks its wire protocol (command + '\0', one answer per command).
+  Each connection sends next command only after answer (server reads next message after answer).
+  closed loop (rate == 0): next command is sent right after answer, latency is measured from sending.
+  open loop (rate > 0): commands are scheduled at fixed rate, latency is measured from scheduled time,
+  so the time, that command waits for slow server, isn't lost (coordinated omission)*/
+class CLoadGenerator : boost::noncopyable {
+public:
+    enum Command { LOGIN, PING, GET_PLACE_FREE, SELECT, INSERT, COMMANDS_COUNT };
+
+    struct Settings {
+        string host;
+        unsigned short port;
+        size_t connections;
+        size_t threads;
+        double rate;                        // commands per second of all connections. 0 - closed loop
+        double warmupSec;                   // results of warmup aren't counted
+        double durationSec;
+        unsigned weights[COMMANDS_COUNT];   // mix of commands
+        size_t selectRows;                  // LIMIT of SELECT. Answer must fit in one read, so keep it small
+        size_t tableRows;                   // SELECT reads random rows from [1, tableRows]
+        // if set, connections are CMemoryStream, connected to server of this process, instead of TCP to host:port.
+        // Returns FALSE, if server rejects connection
+        std::function<bool(CMemoryStream &)> connectInProcess;
+    };
+
+    struct Report {
+        double durationSec;
+        size_t connectErrors;
+        uint64_t errors[COMMANDS_COUNT];
+        CHistogram::Snapshot latencies[COMMANDS_COUNT];  // microseconds
+    };
+
+    explicit CLoadGenerator(const Settings &settings);
+
+    ~CLoadGenerator();
+
+    /*Connect, run load during warmup + duration and return results*/
+    Report Run();
+
+    static const char *commandName(Command command);
+
+    /*Print throughput and latency percentiles*/
+    static void Print(const Report &report, std::ostream &out);
+
+private:
+    using clock = std::chrono::steady_clock;
+    enum { PADDED_COMMAND = 15, READ_BUFFER = 64 * 1024 };
+
+    struct Connection;
+
+    void connect(const std::shared_ptr<Connection> &connection);
+
+    // wait for scheduled time (open loop) and send next command
+    void schedule_next(const std::shared_ptr<Connection> &connection);
+
+    void send(const std::shared_ptr<Connection> &connection);
+
+    template<class Stream>
+    void send(const std::shared_ptr<Connection> &connection, Stream &stream);
+
+    void on_answer(const std::shared_ptr<Connection> &connection, const boost::system::error_code &err, size_t bytes);
+
+    Command next_command(std::mt19937 &random) const;
+
+    // text of command, padded for server (it ignores too short messages) and terminated by '\0'
+    string make_command(Command command, Connection &connection) const;
+
+    void close(Connection &connection);
+
+    const Settings settings_;
+    const unsigned weightsSum_;
+
+    boost::asio::io_context io_context_;
+    std::vector<std::shared_ptr<Connection>> connections_;
+
+    clock::time_point start_;
+    clock::time_point measureStart_;
+    clock::time_point end_;
+
+    std::atomic<size_t> connectErrors_;
+    std::atomic<uint64_t> errors_[COMMANDS_COUNT];
+    CHistogram latencies_[COMMANDS_COUNT];
+};
+
+
+#endif //CS_MINISQLITESERVER_CLOADGENERATOR_H
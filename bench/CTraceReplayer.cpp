@@ -0,0 +1,222 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#include "CTraceReplayer.h"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <ostream>
+
+using boost::asio::ip::tcp;
+
+namespace {
+    string milliseconds(uint64_t us) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.3f", static_cast<double>(us) / 1000.0);
+        return buf;
+    }
+}
+
+struct CTraceReplayer::Connection {
+    Connection(boost::asio::io_context &io_context, const Session &session)
+            : sock(io_context)
+            , timer(io_context)
+            , session(session)
+            , next(0)
+            , buffer(new char[READ_BUFFER])
+    {}
+
+    tcp::socket sock;
+    boost::asio::steady_timer timer;
+    const Session &session;
+    size_t next;                    // index of message, that is sent
+    clock::time_point sent;
+    std::unique_ptr<char[]> buffer;
+};
+
+CTraceReplayer::CTraceReplayer(const Settings &settings)
+        : settings_(settings)
+        , messages_(0)
+        , errors_(0)
+        , connectErrors_(0)
+        , skipped_(0)
+{}
+
+CTraceReplayer::~CTraceReplayer() = default;
+
+bool CTraceReplayer::Load(const string &tracePath) {
+    CTrace::Reader reader(tracePath);
+    if( ! reader.isOpen() )
+        return false;
+
+    // sessions, that are started in trace (session ids aren't reused by server)
+    std::map<uint64_t, size_t> started;
+    CTrace::Event event;
+
+    auto sessionOf = [&](const CTrace::Event &event){
+        auto it = started.find(event.session);
+        if(it == started.end()){
+            it = started.emplace(event.session, sessions_.size()).first;
+            sessions_.push_back(Session{ event.timeUs, event.timeUs, {} });
+        }
+        return &sessions_[it->second];
+    };
+
+    while(reader.Next(event)){
+        Session *session = sessionOf(event);
+        session->stopUs = event.timeUs;
+
+        if(event.kind == CTrace::MESSAGE)
+            session->messages.push_back(Message{ event.timeUs, std::move(event.data) });
+        else if(event.kind == CTrace::SESSION_STOP)
+            started.erase(event.session);
+    }
+
+    return true;
+}
+
+CTraceReplayer::Report CTraceReplayer::Run() {
+    tcp::resolver resolver(io_context_);
+    const tcp::resolver::results_type endpoints = resolver.resolve(settings_.host, std::to_string(settings_.port));
+
+    start_ = clock::now();
+
+    for(const Session &session : sessions_){
+        auto connection = std::make_shared<Connection>(io_context_, session);
+
+        connection->timer.expires_at(scheduled(session.startUs));
+        connection->timer.async_wait([this, connection, endpoints](const boost::system::error_code &){
+            boost::asio::async_connect(connection->sock, endpoints, [this, connection](const boost::system::error_code &err, const tcp::endpoint &){
+                if(err){
+                    finish(connection, true);
+                    return;
+                }
+
+                connect(connection);
+            });
+        });
+    }
+
+    boost::thread_group threads;
+    for(size_t i = 0; i < std::max<size_t>(settings_.threads, 1); ++i)
+        threads.create_thread([this](){ io_context_.run(); });
+    threads.join_all();
+
+    Report report{};
+    report.durationSec = std::chrono::duration<double>(clock::now() - start_).count();
+    report.sessions = sessions_.size();
+    report.messages = messages_;
+    report.errors = errors_;
+    report.connectErrors = connectErrors_;
+    report.skipped = skipped_;
+    report.latency = latency_.snapshot();
+    report.lag = lag_.snapshot();
+
+    return report;
+}
+
+void CTraceReplayer::Print(const Report &report, std::ostream &out) {
+    char line[256];
+
+    std::snprintf(line, sizeof(line), "sessions %zu, messages %llu (%.1f/s), errors %llu, connection errors %zu, skipped messages %llu, time %.3f s\n",
+                  report.sessions, static_cast<unsigned long long>(report.messages), report.messages / report.durationSec,
+                  static_cast<unsigned long long>(report.errors), report.connectErrors,
+                  static_cast<unsigned long long>(report.skipped), report.durationSec);
+    out << line;
+
+    for(const auto &it : { std::make_pair("latency", &report.latency), std::make_pair("lag", &report.lag) }){
+        const CHistogram::Snapshot &histogram = *it.second;
+        if(histogram.count == 0)
+            continue;
+
+        out << it.first << " ms: p50 " << milliseconds(histogram.quantile(0.5)) << ", p90 " << milliseconds(histogram.quantile(0.9))
+            << ", p99 " << milliseconds(histogram.quantile(0.99)) << ", p99.9 " << milliseconds(histogram.quantile(0.999))
+            << ", max " << milliseconds(histogram.max) << "\n";
+    }
+}
+
+void CTraceReplayer::connect(const std::shared_ptr<Connection> &connection) {
+    boost::system::error_code err;
+    connection->sock.set_option(tcp::no_delay(true), err);
+
+    send_next(connection);
+}
+
+void CTraceReplayer::send_next(const std::shared_ptr<Connection> &connection) {
+    const Session &session = connection->session;
+    const bool done = connection->next == session.messages.size();
+    const clock::time_point at = scheduled(done ? session.stopUs : session.messages[connection->next].timeUs);
+
+    // server is later, than trace: message is sent at once
+    if(at <= clock::now()){
+        done ? finish(connection, false) : do_send(connection);
+        return;
+    }
+
+    connection->timer.expires_at(at);
+    connection->timer.async_wait([this, connection, done](const boost::system::error_code &){
+        done ? finish(connection, false) : do_send(connection);
+    });
+}
+
+void CTraceReplayer::do_send(const std::shared_ptr<Connection> &connection) {
+    const Message &message = connection->session.messages[connection->next];
+
+    connection->sent = clock::now();
+    if(settings_.speed > 0)
+        lag_.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(connection->sent - scheduled(message.timeUs)).count()));
+
+    boost::asio::async_write(connection->sock, boost::asio::buffer(message.data),
+                             [this, connection](const boost::system::error_code &err, size_t){
+        if(err){
+            on_answer(connection, err, 0);
+            return;
+        }
+
+        // answer has no framing, it is read by one read as by terminals
+        connection->sock.async_read_some(boost::asio::buffer(connection->buffer.get(), READ_BUFFER),
+                                         [this, connection](const boost::system::error_code &err, size_t bytes){
+            on_answer(connection, err, bytes);
+        });
+    });
+}
+
+void CTraceReplayer::on_answer(const std::shared_ptr<Connection> &connection, const boost::system::error_code &err, size_t bytes) {
+    if(err){
+        finish(connection, true);
+        return;
+    }
+
+    latency_.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - connection->sent).count()));
+    ++messages_;
+
+    const string answer(connection->buffer.get(), std::min<size_t>(bytes, 32));
+    if(0 == answer.find("ERROR") || 0 == answer.find("Server is busy"))
+        ++errors_;
+
+    ++connection->next;
+    send_next(connection);
+}
+
+void CTraceReplayer::finish(const std::shared_ptr<Connection> &connection, bool failed) {
+    if(failed){
+        ++connectErrors_;
+        skipped_ += connection->session.messages.size() - connection->next;
+    }
+
+    boost::system::error_code err;
+    connection->timer.cancel(err);
+    connection->sock.shutdown(tcp::socket::shutdown_both, err);
+    connection->sock.close(err);
+}
+
+CTraceReplayer::clock::time_point CTraceReplayer::scheduled(uint64_t timeUs) const {
+    if(settings_.speed <= 0)
+        return start_;
+
+    return start_ + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::micro>(timeUs / settings_.speed));
+}
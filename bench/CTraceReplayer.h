@@ -0,0 +1,103 @@
+//
+// Created by childcity on 19.10.26.
+//
+
+#ifndef CS_MINISQLITESERVER_CTRACEREPLAYER_H
+#define CS_MINISQLITESERVER_CTRACEREPLAYER_H
+#pragma once
+
+#include "../CTrace.h"
+#include "../CMetrics.h"
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*Replay of trace, that was captured by CTrace (TraceFile in settings).
+  Each captured session gets own connection and sends the same messages in the same order.
+  Timed replay: connection and every message are started at their time in trace (divided by speed),
+  but not before answer on previous message (server reads next message after answer).
+  Fast replay (speed == 0): all sessions start at once and send next message right after answer*/
+class CTraceReplayer : boost::noncopyable {
+public:
+    struct Settings {
+        string host;
+        unsigned short port;
+        size_t threads;
+        double speed;               // 1 - timing of trace, 2 - twice faster, 0 - as fast as possible
+    };
+
+    struct Report {
+        double durationSec;
+        size_t sessions;
+        uint64_t messages;
+        uint64_t errors;            // answers "ERROR..." and "Server is busy..."
+        size_t connectErrors;       // connections, that failed or were closed by server before the end
+        uint64_t skipped;           // messages, that weren't sent because of closed connection
+        CHistogram::Snapshot latency;   // from sending to answer, microseconds
+        CHistogram::Snapshot lag;       // from time in trace to sending, microseconds
+    };
+
+    explicit CTraceReplayer(const Settings &settings);
+
+    ~CTraceReplayer();
+
+    /*Read sessions from trace file. Return FALSE, if it isn't trace*/
+    bool Load(const string &tracePath);
+
+    Report Run();
+
+    static void Print(const Report &report, std::ostream &out);
+
+private:
+    using clock = std::chrono::steady_clock;
+    enum { READ_BUFFER = 512 * 1024 + 1024 };
+
+    struct Message {
+        uint64_t timeUs;
+        string data;
+    };
+
+    struct Session {
+        uint64_t startUs;
+        uint64_t stopUs;
+        std::vector<Message> messages;
+    };
+
+    struct Connection;
+
+    void connect(const std::shared_ptr<Connection> &connection);
+
+    void send_next(const std::shared_ptr<Connection> &connection);
+
+    void do_send(const std::shared_ptr<Connection> &connection);
+
+    void on_answer(const std::shared_ptr<Connection> &connection, const boost::system::error_code &err, size_t bytes);
+
+    void finish(const std::shared_ptr<Connection> &connection, bool failed);
+
+    clock::time_point scheduled(uint64_t timeUs) const;
+
+    const Settings settings_;
+    std::vector<Session> sessions_;
+
+    boost::asio::io_context io_context_;
+    clock::time_point start_;
+
+    std::atomic<uint64_t> messages_;
+    std::atomic<uint64_t> errors_;
+    std::atomic<size_t> connectErrors_;
+    std::atomic<uint64_t> skipped_;
+    CHistogram latency_;
+    CHistogram lag_;
+};
+
+
+#endif //CS_MINISQLITESERVER_CTRACEREPLAYER_H
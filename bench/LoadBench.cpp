@@ -0,0 +1,193 @@
+//
+// Created by childcity on 19.10.26.
+//
+// CS_MiniSQLiteServer_bench: load generator for CS_MiniSQLiteServer.
+//
+// Without --host starts server in this process on generated database (in --dir) and loads it.
+// With --host=<ip> --port=<port> loads already running server
+// (it must have tables of bench: see createBenchDb()).
+// --transport=memory connects to server of this process by CMemoryStream instead of TCP,
+// so results show cost of protocol and db without network stack.
+//
+// Options (--key=value):
+//   connections=64  threads=4  rate=0 (commands/sec, 0 - closed loop)  warmup=2  duration=10 (sec)
+//   mix=login:0,ping:10,place:10,select:60,insert:20  rows=10 (LIMIT of select)  table-rows=100000
+//   host=  port=65043  server-threads=4  dir=/tmp/CS_MiniSQLiteServer_bench  transport=tcp (tcp|memory)
+//
+// Example: CS_MiniSQLiteServer_bench --connections=128 --rate=20000 --duration=30
+
+#include "CLoadGenerator.h"
+#include "../main.h"
+#include "../CServer.h"
+#include "../CSQLiteDB.h"
+#include "../CBusinessLogic.h"
+#include "../CConnectionFactory.h"
+#include "../CSlowQueryLog.h"
+#include "glog/logging.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+namespace {
+    void usage(const char *prog) {
+        std::cerr << "Usage: " << prog << " [--connections=N] [--threads=N] [--rate=CMD_PER_SEC] [--warmup=SEC] [--duration=SEC]\n"
+                  << "       [--mix=login:W,ping:W,place:W,select:W,insert:W] [--rows=N] [--table-rows=N]\n"
+                  << "       [--host=IP --port=PORT | --server-threads=N --dir=PATH [--transport=tcp|memory]]\n";
+        std::exit(2);
+    }
+
+    std::map<string, string> parseArgs(int argc, char *argv[]) {
+        std::map<string, string> args;
+
+        for(int i = 1; i < argc; ++i){
+            const string arg(argv[i]);
+            const size_t eq = arg.find('=');
+
+            if(arg.compare(0, 2, "--") != 0 || eq == string::npos)
+                usage(argv[0]);
+
+            args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        }
+
+        return args;
+    }
+
+    void parseMix(const string &mix, unsigned (&weights)[CLoadGenerator::COMMANDS_COUNT]) {
+        for(auto &weight : weights)
+            weight = 0;
+
+        std::istringstream in(mix);
+        string item;
+
+        while(std::getline(in, item, ',')){
+            const size_t colon = item.find(':');
+            const string name = item.substr(0, colon);
+            const unsigned weight = colon == string::npos ? 1 : static_cast<unsigned>(std::stoul(item.substr(colon + 1)));
+
+            bool found = false;
+            for(int i = 0; i < CLoadGenerator::COMMANDS_COUNT; ++i){
+                const string command = CLoadGenerator::commandName(static_cast<CLoadGenerator::Command>(i));
+                if(name == command || (name == "place" && i == CLoadGenerator::GET_PLACE_FREE)){
+                    weights[i] = weight;
+                    found = true;
+                }
+            }
+
+            if( ! found ){
+                std::cerr << "Unknown command in mix: " << name << "\n";
+                std::exit(2);
+            }
+        }
+    }
+
+    // table for SELECT and INSERT, and Config for get_place_free
+    void createBenchDb(size_t rows) {
+        CSQLiteDB::ptr db = CSQLiteDB::new_(dbPath);
+        LOG_IF(FATAL, ! db->OpenConnection(SQLITE_OPEN_FULLMUTEX|SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE))
+                << "Can't create " << dbPath << ": " << db->GetLastError();
+
+        const string script =
+                "PRAGMA journal_mode = WAL;"
+                "DROP TABLE IF EXISTS bench;"
+                "CREATE TABLE bench(id INTEGER PRIMARY KEY, name TEXT NOT NULL, value INTEGER NOT NULL);"
+                "WITH RECURSIVE seq(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM seq WHERE n < " + std::to_string(rows) + ") "
+                "INSERT INTO bench(id, name, value) SELECT n, 'name_' || n, n * 7 FROM seq;"
+                "DROP TABLE IF EXISTS Config;"
+                "CREATE TABLE Config(PlaceFree INTEGER NOT NULL);"
+                "INSERT INTO Config(PlaceFree) VALUES(100);";
+
+        LOG_IF(FATAL, ! db->ExecuteScript(script.c_str())) << "Can't create tables of bench: " << db->GetLastError();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::map<string, string> args = parseArgs(argc, argv);
+    auto arg = [&](const char *key, const char *def){
+        auto it = args.find(key);
+        const string value = it == args.end() ? def : it->second;
+        args.erase(key);
+        return value;
+    };
+
+    CLoadGenerator::Settings settings{};
+    settings.connections = std::stoul(arg("connections", "64"));
+    settings.threads = std::stoul(arg("threads", "4"));
+    settings.rate = std::stod(arg("rate", "0"));
+    settings.warmupSec = std::stod(arg("warmup", "2"));
+    settings.durationSec = std::stod(arg("duration", "10"));
+    settings.selectRows = std::stoul(arg("rows", "10"));
+    settings.tableRows = std::stoul(arg("table-rows", "100000"));
+    settings.host = arg("host", "");
+    settings.port = static_cast<unsigned short>(std::stoul(arg("port", "65043")));
+    parseMix(arg("mix", "login:0,ping:10,place:10,select:60,insert:20"), settings.weights);
+
+    const size_t serverThreads = std::stoul(arg("server-threads", "4"));
+    const string dir = arg("dir", "/tmp/CS_MiniSQLiteServer_bench");
+    const string transport = arg("transport", "tcp");
+
+    if( ! args.empty() || (transport != "tcp" && transport != "memory") || ( ! settings.host.empty() && transport != "tcp") )
+        usage(argv[0]);
+
+    FLAGS_logtostderr = true;
+    FLAGS_minloglevel = google::GLOG_WARNING;
+    google::InitGoogleLogging(argv[0]);
+
+    if(settings.host.empty()){
+        // tmp db of server is created in current directory
+        boost::filesystem::create_directories(dir);
+        boost::filesystem::current_path(dir);
+
+        dbPath = dir + "/bench.db";
+        bakDbPath = dir + "/bench.db.bak";
+        restoreDbPath = dir + "/bench.db.restore";
+
+        CConnectionFactory::Settings sqliteSettings{};
+        sqliteSettings.pageSize = blockOrClusterSize;
+        sqliteSettings.cacheSizeKb = 8192;
+        sqliteSettings.autoCheckpoint = true;
+        LOG_IF(FATAL, ! CConnectionFactory::Init(sqliteSettings)) << "Can't initialize sqlite";
+
+        CSlowQueryLog::Init(0);
+        createBenchDb(settings.tableRows);
+        CBusinessLogic::CreateOrUseOldTmpDb();
+
+        std::cout << "Server: " << dbPath << " (" << settings.tableRows << " rows), " << serverThreads << " threads, "
+                  << transport << " transport" << std::endl;
+
+        boost::promise<CServer *> started;
+        CServer::AcceptSettings acceptSettings{ boost::asio::socket_base::max_listen_connections, 1, 0 };
+        acceptSettings.onStarted = [&started](CServer &server){ started.set_value(&server); };
+
+        // CServer runs in its constructor till process exit
+        boost::thread([&settings, serverThreads, acceptSettings](){
+            boost::asio::io_context io_context;
+            CServer Server(io_context, 600000, "127.0.0.1", settings.port, static_cast<unsigned short>(serverThreads), false, false, acceptSettings);
+        }).detach();
+
+        CServer *server = started.get_future().get();
+
+        if(transport == "memory")
+            settings.connectInProcess = [server](CMemoryStream &client){ return server->ConnectInProcess(client); };
+
+        // acceptors listen already, when onStarted is called
+        settings.host = "127.0.0.1";
+    }
+
+    std::cout << "Load: " << settings.connections << (settings.connectInProcess ? " in-process" : "") << " connections, " << settings.threads << " threads, "
+              << (settings.rate > 0 ? "open loop " + std::to_string(static_cast<long>(settings.rate)) + " cmd/s" : string("closed loop"))
+              << ", warmup " << settings.warmupSec << " s, duration " << settings.durationSec << " s" << std::endl;
+
+    CLoadGenerator generator(settings);
+    const CLoadGenerator::Report report = generator.Run();
+    CLoadGenerator::Print(report, std::cout);
+    std::cout.flush();
+
+    // server has no stop, connections and threads die with process
+    std::_Exit(report.connectErrors == 0 ? 0 : 1);
+}
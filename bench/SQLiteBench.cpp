@@ -0,0 +1,286 @@
+//
+// Created by childcity on 19.10.26.
+//
+// CS_MiniSQLiteServer_sqlite_bench: microbenchmarks of CSQLiteDB hot paths on generated databases.
+// Each result is printed to stdout as one JSON object per line, progress goes to stderr.
+//
+// Options (--key=value):
+//   rows=1000,10000,100000,1000000   sizes of datasets (up to 10000000)
+//   bench=open,open_bare,select_scan,select_point,integrity,backup,insert,insert_tx
+//   seconds=2      time budget of one benchmark (at least one iteration is done)
+//   batch=100      statements in one transaction of insert_tx
+//   dir=/tmp/CS_MiniSQLiteServer_sqlite_bench   datasets are generated once and reused
+//
+// Example: CS_MiniSQLiteServer_sqlite_bench --rows=1000,10000000 --bench=select_scan,backup > results.jsonl
+
+#include "../main.h"
+#include "../CSQLiteDB.h"
+#include "../CMetrics.h"
+#include "../CConnectionFactory.h"
+#include "../CSlowQueryLog.h"
+#include "glog/logging.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <vector>
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    // dataset of benchmarks and connection, that is reused by benchmarks of statements
+    struct Context {
+        string path;
+        size_t rows;
+        CSQLiteDB::ptr db;
+        std::mt19937 random;
+    };
+
+    struct Benchmark {
+        const char *name;
+        const char *unit;       // what op returns: rows, statements or bytes
+        std::function<uint64_t(Context &ctx)> op;
+    };
+
+    // ColomnData results are summed here, so reading of rows isn't optimized out
+    volatile char sink;
+
+    std::vector<string> split(const string &list) {
+        std::vector<string> items;
+        std::istringstream in(list);
+        string item;
+
+        while(std::getline(in, item, ','))
+            if( ! item.empty() )
+                items.push_back(item);
+
+        return items;
+    }
+
+    uint64_t fileSize(const string &path) {
+        boost::system::error_code err;
+        const uintmax_t size = boost::filesystem::file_size(path, err);
+        return err ? 0 : static_cast<uint64_t>(size);
+    }
+
+    CSQLiteDB::ptr connect(const string &path) {
+        CSQLiteDB::ptr db = CConnectionFactory::NewConnection(path, sqlCountOfAttempts, sqlWaitTime, sqlBusyTimeout);
+        LOG_IF(FATAL, ! db->isConnected()) << "Can't connect to " << path << ": " << db->GetLastError();
+        return db;
+    }
+
+    // bench(id, name, value) with 'rows' rows and empty bench_write for inserts. Generated once
+    string dataset(const string &dir, size_t rows) {
+        const string path = dir + "/dataset_" + std::to_string(rows) + ".db";
+        if(fileSize(path) > 0)
+            return path;
+
+        std::cerr << "generating " << path << "..." << std::endl;
+
+        CSQLiteDB::ptr db = CSQLiteDB::new_(path);
+        LOG_IF(FATAL, ! db->OpenConnection(SQLITE_OPEN_FULLMUTEX|SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE))
+                << "Can't create " << path << ": " << db->GetLastError();
+
+        const string script =
+                "PRAGMA journal_mode = WAL;"
+                "CREATE TABLE bench(id INTEGER PRIMARY KEY, name TEXT NOT NULL, value INTEGER NOT NULL);"
+                "WITH RECURSIVE seq(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM seq WHERE n < " + std::to_string(rows) + ") "
+                "INSERT INTO bench(id, name, value) SELECT n, 'name_' || n, n * 7 FROM seq;"
+                "CREATE TABLE bench_write(id INTEGER PRIMARY KEY, value INTEGER NOT NULL);"
+                "PRAGMA wal_checkpoint(TRUNCATE);";
+
+        LOG_IF(FATAL, ! db->ExecuteScript(script.c_str())) << "Can't generate " << path << ": " << db->GetLastError();
+        return path;
+    }
+
+    uint64_t readAll(IResult *res) {
+        LOG_IF(FATAL, res == nullptr) << "ExecuteSelect failed";
+
+        uint64_t rows = 0;
+        char sum = 0;
+        const int columns = res->GetColumnCount();
+
+        while(res->Next()){
+            for(int i = 0; i < columns; ++i){
+                const char *data = res->ColomnData(i);
+                sum ^= data ? data[0] : 0;
+            }
+            ++rows;
+        }
+
+        res->ReleaseStatement();
+        sink = sum;
+        return rows;
+    }
+
+    string insertSql(Context &ctx) {
+        return "INSERT INTO bench_write(value) VALUES(" + std::to_string(ctx.random()) + ");";
+    }
+
+    std::vector<Benchmark> benchmarks(size_t batch) {
+        return {
+            // connection of server: OpenConnection + open script (PRAGMAs)
+            { "open", "connections", [](Context &ctx){
+                connect(ctx.path);
+                return 1;
+            }},
+            { "open_bare", "connections", [](Context &ctx){
+                CSQLiteDB::ptr db = CSQLiteDB::new_(ctx.path);
+                LOG_IF(FATAL, ! db->OpenConnection()) << db->GetLastError();
+                return 1;
+            }},
+            // ExecuteSelect + Next + ColomnData over all rows
+            { "select_scan", "rows", [](Context &ctx){
+                return readAll(ctx.db->ExecuteSelect("SELECT id, name, value FROM bench;"));
+            }},
+            // statement is prepared for each call
+            { "select_point", "statements", [](Context &ctx){
+                const size_t id = std::uniform_int_distribution<size_t>(1, ctx.rows)(ctx.random);
+                const string sql = "SELECT id, name, value FROM bench WHERE id = " + std::to_string(id) + ";";
+                readAll(ctx.db->ExecuteSelect(sql.c_str()));
+                return 1;
+            }},
+            // Execute wraps each statement in BEGIN/COMMIT
+            { "insert", "statements", [](Context &ctx){
+                LOG_IF(FATAL, ctx.db->Execute(insertSql(ctx).c_str()) < 0) << ctx.db->GetLastError();
+                return 1;
+            }},
+            // the same statements in one explicit transaction
+            { "insert_tx", "statements", [batch](Context &ctx){
+                LOG_IF(FATAL, ! ctx.db->Begin(CSQLiteDB::IMMEDIATE)) << ctx.db->GetLastError();
+                for(size_t i = 0; i < batch; ++i)
+                    LOG_IF(FATAL, ctx.db->Execute(insertSql(ctx).c_str()) < 0) << ctx.db->GetLastError();
+                LOG_IF(FATAL, ! ctx.db->Commit()) << ctx.db->GetLastError();
+                return batch;
+            }},
+            { "integrity", "bytes", [](Context &ctx){
+                LOG_IF(FATAL, ! ctx.db->IntegrityCheck()) << ctx.db->GetLastError();
+                return fileSize(ctx.path);
+            }},
+            { "backup", "bytes", [](Context &ctx){
+                const string backupPath = ctx.path + ".bak";
+                boost::filesystem::remove(backupPath);
+
+                LOG_IF(FATAL, ! ctx.db->BackupDb(backupPath.c_str(), nullptr)) << ctx.db->GetLastError();
+                return fileSize(backupPath);
+            }},
+        };
+    }
+
+    void run(const Benchmark &benchmark, Context &ctx, double budgetSec) {
+        CHistogram latency;
+        uint64_t iterations = 0, items = 0;
+
+        const clock::time_point start = clock::now();
+        const clock::time_point deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(budgetSec));
+        clock::time_point now = start;
+
+        do {
+            const clock::time_point opStart = now;
+            items += benchmark.op(ctx);
+            now = clock::now();
+
+            latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - opStart).count()));
+            ++iterations;
+        } while(now < deadline);
+
+        const double seconds = std::chrono::duration<double>(now - start).count();
+        const CHistogram::Snapshot snapshot = latency.snapshot();
+
+        char line[512];
+        std::snprintf(line, sizeof(line),
+                      "{\"benchmark\":\"%s\",\"rows\":%zu,\"iterations\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.2f,"
+                      "\"mean_us\":%.2f,\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu,\"unit\":\"%s\",\"items\":%llu,\"items_per_sec\":%.2f}",
+                      benchmark.name, ctx.rows, static_cast<unsigned long long>(iterations), seconds, iterations / seconds,
+                      seconds * 1e6 / iterations,
+                      static_cast<unsigned long long>(snapshot.quantile(0.5)), static_cast<unsigned long long>(snapshot.quantile(0.99)),
+                      static_cast<unsigned long long>(snapshot.max), benchmark.unit,
+                      static_cast<unsigned long long>(items), items / seconds);
+
+        std::cout << line << std::endl;
+    }
+
+    void usage(const char *prog) {
+        std::cerr << "Usage: " << prog << " [--rows=N,N,...] [--bench=NAME,NAME,...] [--seconds=SEC] [--batch=N] [--dir=PATH]\n";
+        std::exit(2);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::map<string, string> args;
+    for(int i = 1; i < argc; ++i){
+        const string arg(argv[i]);
+        const size_t eq = arg.find('=');
+
+        if(arg.compare(0, 2, "--") != 0 || eq == string::npos)
+            usage(argv[0]);
+
+        args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+
+    auto arg = [&](const char *key, const char *def){
+        auto it = args.find(key);
+        const string value = it == args.end() ? def : it->second;
+        args.erase(key);
+        return value;
+    };
+
+    const std::vector<string> sizes = split(arg("rows", "1000,10000,100000,1000000"));
+    const std::vector<string> names = split(arg("bench", "open,open_bare,select_scan,select_point,integrity,backup,insert,insert_tx"));
+    const double budgetSec = std::stod(arg("seconds", "2"));
+    const size_t batch = std::stoul(arg("batch", "100"));
+    const string dir = arg("dir", "/tmp/CS_MiniSQLiteServer_sqlite_bench");
+
+    if( ! args.empty() )
+        usage(argv[0]);
+
+    FLAGS_logtostderr = true;
+    FLAGS_minloglevel = google::GLOG_WARNING;
+    google::InitGoogleLogging(argv[0]);
+
+    // the same settings of sqlite, as default settings of server
+    CConnectionFactory::Settings sqliteSettings{};
+    sqliteSettings.pageSize = blockOrClusterSize;
+    sqliteSettings.cacheSizeKb = 3000;
+    sqliteSettings.mmapSize = 64 * 1024 * 1024;
+    sqliteSettings.autoCheckpoint = true;
+    LOG_IF(FATAL, ! CConnectionFactory::Init(sqliteSettings)) << "Can't initialize sqlite";
+    CSlowQueryLog::Init(0);
+
+    boost::filesystem::create_directories(dir);
+
+    const std::vector<Benchmark> all = benchmarks(batch);
+
+    for(const string &size : sizes){
+        Context ctx;
+        ctx.rows = std::stoul(size);
+        ctx.path = dataset(dir, ctx.rows);
+        ctx.db = connect(ctx.path);
+        ctx.random.seed(42);
+
+        for(const string &name : names){
+            auto it = std::find_if(all.begin(), all.end(), [&name](const Benchmark &b){ return name == b.name; });
+            if(it == all.end()){
+                std::cerr << "Unknown benchmark: " << name << "\n";
+                return 2;
+            }
+
+            // rows of inserts (also of previous run) aren't read, but integrity and backup process them
+            LOG_IF(FATAL, ctx.db->Execute("DELETE FROM bench_write;") < 0) << ctx.db->GetLastError();
+
+            std::cerr << name << " on " << ctx.rows << " rows..." << std::endl;
+            run(*it, ctx, budgetSec);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+//
+// Created by childcity on 19.10.26.
+//
+// CS_MiniSQLiteServer_replay: replays traffic, that server captured to TraceFile (see CTrace),
+// against running server. Server should be started on copy of database, that was used during capture.
+//
+// Options (--key=value):
+//   trace=PATH (required)  host=127.0.0.1  port=65043  threads=4
+//   speed=1 (timing of trace; 2 - twice faster; 0 - as fast as possible)
+//
+// Example: CS_MiniSQLiteServer_replay --trace=shift_change.trace --speed=0
+
+#include "CTraceReplayer.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+namespace {
+    void usage(const char *prog) {
+        std::cerr << "Usage: " << prog << " --trace=PATH [--host=IP] [--port=PORT] [--threads=N] [--speed=X]\n";
+        std::exit(2);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::map<string, string> args;
+    for(int i = 1; i < argc; ++i){
+        const string arg(argv[i]);
+        const size_t eq = arg.find('=');
+
+        if(arg.compare(0, 2, "--") != 0 || eq == string::npos)
+            usage(argv[0]);
+
+        args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+
+    auto arg = [&](const char *key, const char *def){
+        auto it = args.find(key);
+        const string value = it == args.end() ? def : it->second;
+        args.erase(key);
+        return value;
+    };
+
+    CTraceReplayer::Settings settings{};
+    const string trace = arg("trace", "");
+    settings.host = arg("host", "127.0.0.1");
+    settings.port = static_cast<unsigned short>(std::stoul(arg("port", "65043")));
+    settings.threads = std::stoul(arg("threads", "4"));
+    settings.speed = std::stod(arg("speed", "1"));
+
+    if(trace.empty() || ! args.empty())
+        usage(argv[0]);
+
+    CTraceReplayer replayer(settings);
+    if( ! replayer.Load(trace) ){
+        std::cerr << "'" << trace << "' isn't trace file\n";
+        return 2;
+    }
+
+    std::cout << "Replay of " << trace << " to " << settings.host << ":" << settings.port;
+    if(settings.speed > 0)
+        std::cout << ", speed x" << settings.speed << std::endl;
+    else
+        std::cout << ", as fast as possible" << std::endl;
+
+    const CTraceReplayer::Report report = replayer.Run();
+    CTraceReplayer::Print(report, std::cout);
+
+    return report.connectErrors == 0 ? 0 : 1;
+}
@@ -1,6 +1,7 @@
 ﻿#include <boost/asio.hpp>
 #include <iostream>
 #include <fstream>
+#include <atomic>
 
 #include "glog/logging.h"
 #include "sqlite3/sqlite3.h"
@@ -9,6 +10,11 @@
 #include "CSQLiteDB.h"
 #include "CServer.h"
 #include "CConfig.h"
+#include "CConnectionFactory.h"
+#include "CSlowQueryLog.h"
+#include "CAsyncLog.h"
+#include "CTrace.h"
+#include "CNotifier.h"
 
 #ifdef WIN32
 	#include "Service.h" //For Windows Service
@@ -22,7 +28,14 @@ std::string restoreDbPath;
 size_t newBackupTimeout;
 size_t sqlWaitTime;
 size_t sqlCountOfAttempts;
+size_t sqlBusyTimeout;
+size_t checkpointInterval;
+long long walSizeLimit;
 long blockOrClusterSize;
+unsigned short metricsPort;
+size_t slowQueryReportInterval;
+size_t compressMinBytes;
+int compressLevel;
 
 static int running_from_service = 0;
 
@@ -63,6 +76,28 @@ int main(int argc, char *argv[])
 	{
 		boost::asio::io_context io_context;
 
+		// memory settings of sqlite can be changed only before first connection
+		CConnectionFactory::Settings sqliteSettings{};
+		sqliteSettings.pageSize = cfg.keyBindings.blockOrClusterSize;
+		sqliteSettings.cacheSizeKb = cfg.keyBindings.cacheSizeKb;
+		sqliteSettings.mmapSize = static_cast<long long>(cfg.keyBindings.mmapSizeKb) * 1024;
+		sqliteSettings.tempStore = cfg.keyBindings.tempStore;
+		sqliteSettings.pageCacheSize = static_cast<long long>(cfg.keyBindings.pageCachePoolKb) * 1024;
+		sqliteSettings.softHeapLimit = static_cast<long long>(cfg.keyBindings.softHeapLimitKb) * 1024;
+		sqliteSettings.autoCheckpoint = (cfg.keyBindings.checkpointIntervalMillisec == 0);
+		sqliteSettings.poolAllocator = cfg.keyBindings.poolAllocator;
+		sqliteSettings.foreignKeys = cfg.keyBindings.foreignKeys;
+		LOG_IF(FATAL, ! CConnectionFactory::Init(sqliteSettings)) <<"Can't initialize sqlite";
+
+		CSlowQueryLog::Init(static_cast<size_t>(cfg.keyBindings.slowQueryMillisec));
+
+		if( ! cfg.keyBindings.traceFile.empty() )
+			CTrace::Start(cfg.keyBindings.traceFile);
+
+		// must be started before connections of clients are opened (they install hooks only if notifier is enabled)
+		if(cfg.keyBindings.notifyWindowMillisec > 0)
+			CNotifier::Start(static_cast<size_t>(cfg.keyBindings.notifyWindowMillisec));
+
 		// try connect to db and check sqlite settings
         TestSqlite3Settings(&cfg);
 
@@ -73,23 +108,41 @@ int main(int argc, char *argv[])
         blockOrClusterSize = cfg.keyBindings.blockOrClusterSize;
         sqlWaitTime = static_cast<size_t>(cfg.keyBindings.waitTimeMillisec);
         sqlCountOfAttempts = static_cast<size_t>(cfg.keyBindings.countOfEttempts);
+        sqlBusyTimeout = static_cast<size_t>(cfg.keyBindings.busyTimeoutMillisec);
+        checkpointInterval = static_cast<size_t>(cfg.keyBindings.checkpointIntervalMillisec);
+        walSizeLimit = static_cast<long long>(cfg.keyBindings.walSizeLimitKb) * 1024;
+        metricsPort = static_cast<unsigned short>(cfg.keyBindings.metricsPort);
+        slowQueryReportInterval = static_cast<size_t>(cfg.keyBindings.slowQueryReportIntervalMillisec);
+        compressMinBytes = static_cast<size_t>(cfg.keyBindings.compressMinBytes);
+        compressLevel = static_cast<int>(cfg.keyBindings.compressLevel);
+
+        CServer::AcceptSettings acceptSettings{};
+        acceptSettings.backlog = static_cast<int>(cfg.keyBindings.listenBacklog);
+        acceptSettings.pendingAccepts = static_cast<size_t>(cfg.keyBindings.pendingAccepts);
+        acceptSettings.maxConnections = static_cast<size_t>(cfg.keyBindings.maxConnections);
+        acceptSettings.localPath = cfg.keyBindings.localSocketPath;
 
         if(cfg.keyBindings.ipAdress.empty()){
             CServer Server(io_context,
 						   static_cast<const size_t>(cfg.keyBindings.timeoutToDropConnection),
 						   static_cast<unsigned short>(cfg.keyBindings.port),
-						   static_cast<unsigned short>(static_cast<short>(cfg.keyBindings.threads)));
+						   static_cast<unsigned short>(static_cast<short>(cfg.keyBindings.threads)),
+						   cfg.keyBindings.ioContextPerCore, cfg.keyBindings.pinThreads, acceptSettings);
         }
         else {
 			CServer Server(io_context,
 						   static_cast<const size_t>(cfg.keyBindings.timeoutToDropConnection),
 						   cfg.keyBindings.ipAdress, static_cast<unsigned short>(cfg.keyBindings.port),
-						   static_cast<unsigned short>(cfg.keyBindings.threads));
+						   static_cast<unsigned short>(cfg.keyBindings.threads),
+						   cfg.keyBindings.ioContextPerCore, cfg.keyBindings.pinThreads, acceptSettings);
 		}
 
 	} catch(std::exception &e) {
 		LOG(FATAL) << "Server has been crashed: " << e.what() << std::endl;
 	}
+
+	// server returns after SIGINT/SIGTERM (see CServer::Stop), all clients are closed with io_context
+	SafeExit();
 	return 0;
 }
 
@@ -130,10 +183,18 @@ void TestSqlite3Settings(CConfig *cfg){
 
 void SafeExit()
 {
+	// service can call it before main returns
+	static std::atomic<bool> exited(false);
+	if(exited.exchange(true))
+		return;
+
 	LOG(INFO) <<"Server stopped safely.";
 
 	//We just exit from program. All connections wrapped in shared_ptr, so they will be closed soon
 	//We don't need to watch them
 
+	CNotifier::Stop();
+	CTrace::Stop();
+	CAsyncLog::Shutdown();
 	google::ShutdownGoogleLogging();
 }
\ No newline at end of file
@@ -6,7 +6,6 @@
 //#define GOOGLE_STRIP_LOG 0 // cut all glog strings from .exe
 
 #include <string>
-#include <boost/thread/recursive_mutex.hpp>
 #include "CConfig.h"
 
 extern std::string dbPath;
@@ -15,15 +14,21 @@ extern std::string restoreDbPath;
 extern size_t newBackupTimeout;
 extern size_t sqlWaitTime;
 extern size_t sqlCountOfAttempts;
+extern size_t sqlBusyTimeout;
+extern size_t checkpointInterval;
+extern long long walSizeLimit;
 extern long blockOrClusterSize;
-
-extern boost::recursive_mutex clients_cs;
+extern unsigned short metricsPort;
+extern size_t slowQueryReportInterval;
+extern size_t compressMinBytes;
+extern int compressLevel;
 
 int main(int argc, char *argv[]);
 
 class CConfig;
 void TestSqlite3Settings(CConfig *cfg);
 
+// stop background threads and flush logs. Called once, when server is stopped (by signal or by service)
 void SafeExit();
 
 template <typename T, std::size_t N>